@@ -0,0 +1,536 @@
+/*
+    throughput and latency benchmark for the DMA-accelerated multi-UART USB CDC
+
+    Copyright (C) 2015,2016 Peter Lawrence
+
+    Permission is hereby granted, free of charge, to any person obtaining a
+    copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the
+    Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+    THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+each port is given as the CDC port's tty, optionally followed by ":" and the tty at the far end of its UART (a USB
+serial adapter, or a pseudo-terminal of the gadget build); without a far end, the UART is expected to send back
+whatever it is sent, with a TX-RX jumper or the firmware's loopback mode
+
+data is sent as numbered frames, so that each one can be checked on arrival for loss, reordering and corruption, and
+timed from the moment it was written to the moment it was read
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_PORTS      16
+#define FRAME_SIZE     16
+#define FRAME_SYNC0    0x55
+#define FRAME_SYNC1    0xAA
+#define STAMPS         (1 << 18) /* frames that can be in flight at once */
+#define ECHO_TIMEOUT   1000000000ULL /* an echo not back within this is given up on */
+
+enum mode { MODE_TX, MODE_RX, MODE_DUPLEX, MODE_ECHO };
+
+struct stream
+{
+  int wfd, rfd;
+  const char *from, *to;
+  uint32_t sent, written, received, reordered, expect; /* written: frames write() has taken all of */
+  uint64_t corrupt, bytes, window_bytes, abandoned;
+  uint64_t stamps[STAMPS];
+  uint64_t burst_at, echo_at;
+  uint32_t burst_left;
+  uint8_t out[4096];
+  unsigned out_head, out_count;
+  uint8_t in[4096];
+  unsigned in_count;
+  uint32_t *latency;
+  size_t latency_count, latency_size;
+};
+
+struct relay
+{
+  int fd;
+  uint8_t buffer[4096];
+  unsigned count;
+};
+
+static struct stream *streams[2 * MAX_PORTS];
+static unsigned num_streams;
+static struct relay relays[MAX_PORTS];
+static unsigned num_relays;
+
+static enum mode mode = MODE_DUPLEX;
+static unsigned baud = 115200, seconds = 10, drain_ms = 1000, burst_bytes, burst_gap_ms, echo_frames = 1, flow;
+static uint64_t run_start, run_end;
+
+static uint64_t Now(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static speed_t Speed(unsigned rate)
+{
+  switch (rate)
+  {
+  case 1200: return B1200;
+  case 2400: return B2400;
+  case 4800: return B4800;
+  case 9600: return B9600;
+  case 19200: return B19200;
+  case 38400: return B38400;
+  case 57600: return B57600;
+  case 115200: return B115200;
+  case 230400: return B230400;
+  case 460800: return B460800;
+  case 500000: return B500000;
+  case 576000: return B576000;
+  case 921600: return B921600;
+  case 1000000: return B1000000;
+  case 1152000: return B1152000;
+  case 1500000: return B1500000;
+  case 2000000: return B2000000;
+  case 2500000: return B2500000;
+  case 3000000: return B3000000;
+  case 3500000: return B3500000;
+  case 4000000: return B4000000;
+  default:
+    fprintf(stderr, "cdcbench: unsupported baud rate %u\n", rate);
+    exit(2);
+  }
+}
+
+/* for a CDC port, this is what sends SET_LINE_CODING and SET_CONTROL_LINE_STATE to the device */
+static int Open(const char *name)
+{
+  struct termios tio;
+  int fd;
+
+  fd = open(name, O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (fd < 0)
+  {
+    perror(name);
+    exit(1);
+  }
+
+  if (tcgetattr(fd, &tio))
+  {
+    perror(name);
+    exit(1);
+  }
+  cfmakeraw(&tio);
+  tio.c_cflag |= CLOCAL | CREAD;
+  if (flow)
+    tio.c_cflag |= CRTSCTS;
+  else
+    tio.c_cflag &= ~CRTSCTS;
+  cfsetispeed(&tio, Speed(baud));
+  cfsetospeed(&tio, Speed(baud));
+  if (tcsetattr(fd, TCSANOW, &tio))
+  {
+    perror(name);
+    exit(1);
+  }
+
+  tcflush(fd, TCIOFLUSH);
+  return fd;
+}
+
+static struct stream *Stream(int wfd, int rfd, const char *from, const char *to)
+{
+  struct stream *stream = calloc(1, sizeof(*stream));
+
+  if (!stream)
+  {
+    perror("cdcbench");
+    exit(1);
+  }
+
+  stream->wfd = wfd;
+  stream->rfd = rfd;
+  stream->from = from;
+  stream->to = to;
+  streams[num_streams++] = stream;
+  return stream;
+}
+
+static void Frame(uint8_t *frame, uint32_t seq)
+{
+  uint8_t sum = 0;
+  unsigned index;
+
+  frame[0] = FRAME_SYNC0;
+  frame[1] = FRAME_SYNC1;
+  frame[2] = seq; frame[3] = seq >> 8; frame[4] = seq >> 16; frame[5] = seq >> 24;
+  for (index = 6; index < (FRAME_SIZE - 1); index++)
+    frame[index] = seq + index;
+  for (index = 0; index < (FRAME_SIZE - 1); index++)
+    sum += frame[index];
+  frame[FRAME_SIZE - 1] = sum;
+}
+
+static unsigned Burst_Frames(void)
+{
+  return (burst_bytes + FRAME_SIZE - 1) / FRAME_SIZE;
+}
+
+/* how many more frames the stream may queue for writing now; this only looks, and Write() starts the echo or burst */
+static unsigned Allowance(const struct stream *stream, uint64_t now)
+{
+  if (now < run_start || now >= run_end)
+    return 0;
+
+  if (MODE_ECHO == mode)
+  {
+    /* one message in flight at a time */
+    if (((stream->received + stream->abandoned) < stream->sent) && ((now - stream->echo_at) < ECHO_TIMEOUT))
+      return 0;
+    return echo_frames;
+  }
+
+  if (burst_bytes)
+    return (now >= stream->burst_at) ? Burst_Frames() : stream->burst_left;
+
+  return ~0U;
+}
+
+static void Write(struct stream *stream, uint64_t now)
+{
+  unsigned frames;
+  ssize_t length;
+
+  if (!stream->out_count)
+  {
+    frames = Allowance(stream, now);
+    if (frames && (MODE_ECHO == mode))
+    {
+      stream->abandoned = (stream->sent > stream->received) ? (stream->sent - stream->received) : 0;
+      stream->echo_at = now;
+    }
+    else if (frames && burst_bytes && (now >= stream->burst_at))
+    {
+      stream->burst_at += burst_gap_ms * 1000000ULL;
+      stream->burst_left = Burst_Frames();
+    }
+
+    if (frames > (sizeof(stream->out) / FRAME_SIZE))
+      frames = sizeof(stream->out) / FRAME_SIZE;
+    if (burst_bytes && (MODE_ECHO != mode))
+      stream->burst_left -= frames;
+
+    stream->out_head = 0;
+    for (; frames; frames--)
+    {
+      Frame(stream->out + stream->out_count, stream->sent++);
+      stream->out_count += FRAME_SIZE;
+    }
+  }
+
+  if (!stream->out_count)
+    return;
+
+  length = write(stream->wfd, stream->out + stream->out_head, stream->out_count);
+  if (length > 0)
+  {
+    stream->out_head += length;
+    stream->out_count -= length;
+
+    /* a frame is timed from when write() has taken the last of it, not from when it was queued here */
+    now = Now();
+    while (stream->written < (stream->sent - (stream->out_count + FRAME_SIZE - 1) / FRAME_SIZE))
+      stream->stamps[stream->written++ % STAMPS] = now;
+  }
+  else if ((length < 0) && (EAGAIN != errno))
+  {
+    perror(stream->from);
+    exit(1);
+  }
+}
+
+static void Latency(struct stream *stream, uint64_t ns)
+{
+  if (stream->latency_count == stream->latency_size)
+  {
+    stream->latency_size = stream->latency_size ? (2 * stream->latency_size) : 65536;
+    stream->latency = realloc(stream->latency, stream->latency_size * sizeof(*stream->latency));
+    if (!stream->latency)
+    {
+      perror("cdcbench");
+      exit(1);
+    }
+  }
+
+  stream->latency[stream->latency_count++] = (ns > (0xFFFFFFFFULL * 1000)) ? 0xFFFFFFFF : (ns / 1000);
+}
+
+static void Read(struct stream *stream, uint64_t now)
+{
+  ssize_t length;
+  unsigned offset = 0, index;
+  uint32_t seq;
+  uint8_t sum;
+
+  length = read(stream->rfd, stream->in + stream->in_count, sizeof(stream->in) - stream->in_count);
+  if (length <= 0)
+  {
+    if ((length < 0) && (EAGAIN != errno))
+    {
+      perror(stream->to);
+      exit(1);
+    }
+    return;
+  }
+
+  stream->bytes += length;
+  if ((now >= run_start) && (now < run_end))
+    stream->window_bytes += length;
+  stream->in_count += length;
+
+  while ((stream->in_count - offset) >= FRAME_SIZE)
+  {
+    const uint8_t *frame = stream->in + offset;
+
+    for (sum = 0, index = 0; index < (FRAME_SIZE - 1); index++)
+      sum += frame[index];
+
+    if ((FRAME_SYNC0 != frame[0]) || (FRAME_SYNC1 != frame[1]) || (sum != frame[FRAME_SIZE - 1]))
+    {
+      /* skip a byte at a time until the frames line up again */
+      stream->corrupt++;
+      offset++;
+      continue;
+    }
+
+    seq = frame[2] | (frame[3] << 8) | (frame[4] << 16) | ((uint32_t)frame[5] << 24);
+    offset += FRAME_SIZE;
+
+    if (seq >= stream->written)
+    {
+      stream->corrupt += FRAME_SIZE;
+      continue;
+    }
+
+    stream->received++;
+    if (seq < stream->expect)
+      stream->reordered++;
+    else
+      stream->expect = seq + 1;
+
+    Latency(stream, now - stream->stamps[seq % STAMPS]);
+  }
+
+  memmove(stream->in, stream->in + offset, stream->in_count - offset);
+  stream->in_count -= offset;
+}
+
+static void Relay(struct relay *relay)
+{
+  ssize_t length;
+
+  if (relay->count < sizeof(relay->buffer))
+  {
+    length = read(relay->fd, relay->buffer + relay->count, sizeof(relay->buffer) - relay->count);
+    if (length > 0)
+      relay->count += length;
+  }
+
+  if (relay->count)
+  {
+    length = write(relay->fd, relay->buffer, relay->count);
+    if (length > 0)
+    {
+      relay->count -= length;
+      memmove(relay->buffer, relay->buffer + length, relay->count);
+    }
+  }
+}
+
+static int Compare(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+static double Percentile(const struct stream *stream, unsigned percent)
+{
+  size_t index;
+
+  if (!stream->latency_count)
+    return 0.0;
+
+  index = (stream->latency_count * percent + 99) / 100;
+  if (index)
+    index--;
+  return stream->latency[index] / 1000.0;
+}
+
+static int Report(struct stream *stream)
+{
+  uint32_t lost = stream->sent - stream->received;
+
+  qsort(stream->latency, stream->latency_count, sizeof(*stream->latency), Compare);
+
+  printf("%s -> %s: %.0f B/s, %u frames, lost %u, reordered %u, corrupt %llu bytes, latency ms p50 %.2f p90 %.2f p99 %.2f max %.2f\n",
+    stream->from, stream->to, stream->window_bytes / (double)seconds, stream->sent, lost, stream->reordered,
+    (unsigned long long)stream->corrupt, Percentile(stream, 50), Percentile(stream, 90), Percentile(stream, 99),
+    Percentile(stream, 100));
+
+  return lost || stream->reordered || stream->corrupt;
+}
+
+static void Usage(const char *name)
+{
+  fprintf(stderr,
+    "usage: %s [options] port[:far-end] ...\n"
+    "  -m mode     tx (port to far end), rx (far end to port), duplex (both) or echo (default duplex)\n"
+    "  -b baud     baud rate for every port (default 115200)\n"
+    "  -t seconds  how long to send for (default 10)\n"
+    "  -w ms       time allowed afterwards for data still in flight (default 1000)\n"
+    "  -B bytes    send in bursts of this many bytes...\n"
+    "  -g ms       ...every this many milliseconds\n"
+    "  -s frames   frames in each echo message (%u bytes each, default 1)\n"
+    "  -f          RTS/CTS flow control\n"
+    "without a far end, the port's UART must send back what it is sent, and tx, duplex and echo are all the same\n"
+    "stream; with one, echo has this program send everything arriving at the far end straight back\n",
+    name, FRAME_SIZE);
+  exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+  struct pollfd fds[4 * MAX_PORTS + MAX_PORTS];
+  unsigned index, count;
+  uint64_t now;
+  int opt, bad = 0;
+
+  while (-1 != (opt = getopt(argc, argv, "m:b:t:w:B:g:s:f")))
+  {
+    switch (opt)
+    {
+    case 'm':
+      if (!strcmp(optarg, "tx")) mode = MODE_TX;
+      else if (!strcmp(optarg, "rx")) mode = MODE_RX;
+      else if (!strcmp(optarg, "duplex")) mode = MODE_DUPLEX;
+      else if (!strcmp(optarg, "echo")) mode = MODE_ECHO;
+      else Usage(argv[0]);
+      break;
+    case 'b': baud = strtoul(optarg, NULL, 0); break;
+    case 't': seconds = atoi(optarg); break;
+    case 'w': drain_ms = atoi(optarg); break;
+    case 'B': burst_bytes = atoi(optarg); break;
+    case 'g': burst_gap_ms = atoi(optarg); break;
+    case 's': echo_frames = atoi(optarg); break;
+    case 'f': flow = 1; break;
+    default:
+      Usage(argv[0]);
+    }
+  }
+
+  if ((optind >= argc) || ((argc - optind) > MAX_PORTS) || !seconds || !echo_frames || (burst_bytes && !burst_gap_ms))
+    Usage(argv[0]);
+
+  for (index = optind; index < (unsigned)argc; index++)
+  {
+    char *port = argv[index], *far = strchr(port, ':');
+    int port_fd, far_fd;
+
+    if (far)
+      *far++ = '\0';
+    port_fd = Open(port);
+
+    if (!far)
+    {
+      if (MODE_RX == mode)
+      {
+        fprintf(stderr, "cdcbench: rx needs the far end of %s\n", port);
+        exit(2);
+      }
+      Stream(port_fd, port_fd, port, port);
+      continue;
+    }
+
+    far_fd = Open(far);
+    if (MODE_ECHO == mode)
+    {
+      relays[num_relays++].fd = far_fd;
+      Stream(port_fd, port_fd, port, port);
+      continue;
+    }
+    if (MODE_RX != mode)
+      Stream(port_fd, far_fd, port, far);
+    if (MODE_TX != mode)
+      Stream(far_fd, port_fd, far, port);
+  }
+
+  /* give the device a moment to act on the line coding before anything is sent */
+  run_start = Now() + 100000000ULL;
+  run_end = run_start + seconds * 1000000000ULL;
+  for (index = 0; index < num_streams; index++)
+    streams[index]->burst_at = run_start;
+
+  while ((now = Now()) < (run_end + drain_ms * 1000000ULL))
+  {
+    count = 0;
+    for (index = 0; index < num_streams; index++)
+    {
+      fds[count].fd = streams[index]->rfd;
+      fds[count++].events = POLLIN;
+      if (streams[index]->out_count || Allowance(streams[index], now))
+      {
+        fds[count].fd = streams[index]->wfd;
+        fds[count++].events = POLLOUT;
+      }
+    }
+    for (index = 0; index < num_relays; index++)
+    {
+      fds[count].fd = relays[index].fd;
+      fds[count++].events = POLLIN | (relays[index].count ? POLLOUT : 0);
+    }
+
+    /* a short timeout, as bursts and the end of the run are timed rather than waited for */
+    if (poll(fds, count, 1) < 0)
+    {
+      perror("poll");
+      exit(1);
+    }
+
+    now = Now();
+    for (index = 0; index < num_streams; index++)
+    {
+      Read(streams[index], now);
+      Write(streams[index], now);
+    }
+    for (index = 0; index < num_relays; index++)
+      Relay(&relays[index]);
+  }
+
+  for (index = 0; index < num_streams; index++)
+    bad |= Report(streams[index]);
+
+  return bad ? 1 : 0;
+}
@@ -0,0 +1,324 @@
+/*
+    Linux gadget build of the DMA-accelerated multi-UART USB CDC
+
+    Copyright (C) 2015,2016 Peter Lawrence
+
+    Permission is hereby granted, free of charge, to any person obtaining a
+    copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the
+    Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+    THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+the firmware as a real USB device: the same models as the simulation, but with the virtual clock kept in step with
+the real one, the host's side of the PCD model driven by the kernel through Raw Gadget (see gadget_udc.c), and each
+USART wired to a pseudo-terminal; under dummy_hcd, the host then sees the ports as ttyACM devices, and the UARTs'
+far ends are the pseudo-terminals named at start-up
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+/* termios.h's output delay flags have the same names as the USART's control registers */
+#undef CR1
+#undef CR2
+#undef CR3
+
+#include "sim.h"
+#include "gadget.h"
+#include "config.h"
+#include "usbd_core.h"
+#include "usbd_desc.h"
+#include "usbd_composite.h"
+#include "usbd_cdc.h"
+
+#define MAX_ENDPOINTS 16
+#define SERVICE_ROUNDS 16 /* most times the endpoints are serviced before the clock is looked at again */
+
+/* as parameters[] in usbd_cdc.c: the sim_usart[] index of each port's USART */
+static const unsigned port_usart[] = { 0, 2, 3 };
+
+struct pty
+{
+  int master, slave;
+  uint8_t rx[256];
+  unsigned rx_head, rx_count;
+  uint8_t tx[4096];
+  unsigned tx_count;
+  uint32_t dropped;
+};
+
+uint64_t sim_now;
+USBD_HandleTypeDef USBD_Device;
+
+static struct pty ptys[4]; /* indexed as sim_usart[] */
+static const uint8_t *endpoints[MAX_ENDPOINTS]; /* the endpoint descriptors in the configuration descriptor */
+static unsigned num_endpoints;
+static struct timespec start;
+
+void sim_fail(const char *reason)
+{
+  fprintf(stderr, "gadget: %s at %llu.%06llu ms\n", reason, (unsigned long long)(sim_now / 1000000), (unsigned long long)(sim_now % 1000000));
+  exit(2);
+}
+
+int sim_peer_transmit(unsigned usart, uint64_t when)
+{
+  struct pty *pty = &ptys[usart];
+
+  if (!pty->rx_count)
+    return -1;
+
+  pty->rx_count--;
+  return pty->rx[pty->rx_head++];
+}
+
+void sim_peer_receive(unsigned usart, uint8_t byte, uint64_t when)
+{
+  struct pty *pty = &ptys[usart];
+
+  /* a wire has no flow control of its own; whatever the pseudo-terminal can't take is lost */
+  if (pty->tx_count < sizeof(pty->tx))
+    pty->tx[pty->tx_count++] = byte;
+  else
+    pty->dropped++;
+}
+
+static const char *Pty_Open(struct pty *pty)
+{
+  struct termios tio;
+  const char *name;
+
+  pty->master = posix_openpt(O_RDWR | O_NOCTTY);
+  if ((pty->master < 0) || grantpt(pty->master) || unlockpt(pty->master) || !(name = ptsname(pty->master)))
+  {
+    perror("gadget: posix_openpt");
+    exit(1);
+  }
+
+  /* holding the slave open keeps the master usable whilst nothing else has it open */
+  pty->slave = open(name, O_RDWR | O_NOCTTY);
+  if (pty->slave < 0)
+  {
+    perror(name);
+    exit(1);
+  }
+
+  tcgetattr(pty->slave, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(pty->slave, TCSANOW, &tio);
+  fcntl(pty->master, F_SETFL, fcntl(pty->master, F_GETFL) | O_NONBLOCK);
+
+  return name;
+}
+
+static void Pty_Service(void)
+{
+  struct pty *pty;
+  ssize_t length;
+
+  for (pty = ptys; pty < (ptys + 4); pty++)
+  {
+    if (pty->master <= 0)
+      continue;
+
+    /* only read more once the USART has sent everything read before, so the writer is held back at the baud rate */
+    if (!pty->rx_count)
+    {
+      length = read(pty->master, pty->rx, sizeof(pty->rx));
+      if (length > 0)
+      {
+        pty->rx_head = 0;
+        pty->rx_count = length;
+      }
+    }
+
+    if (pty->tx_count)
+    {
+      length = write(pty->master, pty->tx, pty->tx_count);
+      if (length > 0)
+      {
+        pty->tx_count -= length;
+        memmove(pty->tx, pty->tx + length, pty->tx_count);
+      }
+    }
+  }
+}
+
+static int Control(struct gadget_request *request)
+{
+  int result;
+  unsigned index;
+
+  if (GADGET_RESET == request->type)
+  {
+    /* the UDC answers SET_ADDRESS itself, so the stack is given one straight after the reset */
+    sim_usb_reset();
+    sim_irq_dispatch();
+    sim_usb_control(0x00, USB_REQ_SET_ADDRESS, 1, 0, 0, NULL);
+    sim_irq_dispatch();
+    return 0;
+  }
+
+  result = sim_usb_control(request->type, request->bRequest, request->wValue, request->wIndex, request->wLength, request->data);
+  sim_irq_dispatch();
+
+  if ((result >= 0) && (0x00 == request->type) && (USB_REQ_SET_CONFIGURATION == request->bRequest) && request->wValue)
+  {
+    for (index = 0; index < num_endpoints; index++)
+      gadget_enable(endpoints[index]);
+    gadget_configure();
+  }
+
+  return result;
+}
+
+/* returns non-zero if anything moved */
+static int Usb_Service(void)
+{
+  struct gadget_request request;
+  uint8_t buffer[USB_FS_MAX_PACKET_SIZE], *data;
+  unsigned index;
+  int length, busy = 0;
+
+  if (gadget_request(&request))
+  {
+    gadget_reply(Control(&request));
+    busy = 1;
+  }
+
+  for (index = 0; index < num_endpoints; index++)
+  {
+    uint8_t ep_addr = endpoints[index][2];
+
+    if (ep_addr & 0x80)
+    {
+      if (!gadget_in_free(ep_addr))
+        continue;
+      length = sim_usb_in(ep_addr, buffer);
+      if (length >= 0)
+      {
+        gadget_in(ep_addr, buffer, length);
+        busy = 1;
+      }
+    }
+    else
+    {
+      length = gadget_out(ep_addr, &data);
+      if (length < 0)
+        continue;
+      /* a NAKed packet is offered again next time; a stalled one is dropped, as the host would see it fail */
+      if (SIM_NAK != sim_usb_out(ep_addr, data, length))
+      {
+        gadget_out_done(ep_addr);
+        busy = 1;
+      }
+    }
+
+    sim_irq_dispatch();
+  }
+
+  return busy;
+}
+
+static uint64_t Clock(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)(now.tv_sec - start.tv_sec) * 1000000000ULL + now.tv_nsec - start.tv_nsec;
+}
+
+static void Usage(const char *name)
+{
+  fprintf(stderr,
+    "usage: %s [options]\n"
+    "  -d driver   UDC driver name (default dummy_udc)\n"
+    "  -D device   UDC device name (default dummy_udc.0)\n",
+    name);
+  exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+  const char *driver = "dummy_udc", *device = "dummy_udc.0";
+  unsigned index, offset, rounds;
+  uint64_t target;
+  int opt;
+
+  while (-1 != (opt = getopt(argc, argv, "d:D:")))
+  {
+    switch (opt)
+    {
+    case 'd': driver = optarg; break;
+    case 'D': device = optarg; break;
+    default:
+      Usage(argv[0]);
+    }
+  }
+
+  for (index = 0; index < NUM_OF_CDC_UARTS; index++)
+    printf("port %u: %s\n", index, Pty_Open(&ptys[port_usart[index]]));
+  fflush(stdout);
+
+  /* the endpoints are enabled on the UDC just as they are described to the host */
+  for (offset = 0; (offset + 2) <= USBD_CfgFSDesc_len && USBD_CfgFSDesc_pnt[offset]; offset += USBD_CfgFSDesc_pnt[offset])
+    if ((USB_DESC_TYPE_ENDPOINT == USBD_CfgFSDesc_pnt[offset + 1]) && (num_endpoints < MAX_ENDPOINTS))
+      endpoints[num_endpoints++] = USBD_CfgFSDesc_pnt + offset;
+
+  /* as main() does on the target */
+  USBD_Init(&USBD_Device, &USBD_Desc, 0);
+  USBD_RegisterClass(&USBD_Device, &USBD_Composite);
+  USBD_Start(&USBD_Device);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  gadget_start(driver, device);
+
+  for (;;)
+  {
+    target = Clock();
+    while (sim_now < target)
+    {
+      sim_now += SIM_STEP_NS;
+      sim_tick();
+      if (0 == (sim_now % SIM_FRAME_NS))
+      {
+        sim_usb_sof();
+        sim_irq_dispatch();
+      }
+      sim_uart_step();
+      sim_irq_dispatch();
+    }
+
+    Pty_Service();
+
+    for (rounds = 0; rounds < SERVICE_ROUNDS; rounds++)
+      if (!Usb_Service())
+        break;
+
+    if (!rounds)
+      usleep(100);
+  }
+
+  return 0;
+}
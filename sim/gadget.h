@@ -0,0 +1,57 @@
+/*
+    Linux gadget build of the DMA-accelerated multi-UART USB CDC
+
+    Copyright (C) 2015,2016 Peter Lawrence
+
+    Permission is hereby granted, free of charge, to any person obtaining a
+    copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the
+    Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+    THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __GADGET_H_
+#define __GADGET_H_
+
+#include <stdint.h>
+
+/*
+gadget_udc.c is the only file that talks to Raw Gadget, as the kernel's USB headers and ST's usbd_def.h define many
+of the same names; it does the blocking I/O in its own threads, and gadget.c collects the results from its main loop,
+which is the only thread that ever calls into the firmware
+*/
+
+#define GADGET_RESET                0x100 /* in place of a request, when the UDC reports a (re)connection */
+
+struct gadget_request
+{
+  uint16_t type; /* bmRequestType, or GADGET_RESET */
+  uint8_t bRequest;
+  uint16_t wValue, wIndex, wLength;
+  uint8_t *data; /* wLength bytes; already filled in for an OUT request, to be filled in for an IN request */
+};
+
+void gadget_start(const char *driver, const char *device);
+int gadget_request(struct gadget_request *request); /* non-zero if there is one to answer */
+void gadget_reply(int length); /* bytes to send for an IN request, 0 to acknowledge, or negative to stall */
+void gadget_configure(void);
+
+void gadget_enable(const uint8_t *descriptor); /* an endpoint descriptor from the configuration descriptor */
+int gadget_out(uint8_t ep_addr, uint8_t **data); /* length of the packet waiting on an OUT endpoint, or -1 */
+void gadget_out_done(uint8_t ep_addr);
+int gadget_in_free(uint8_t ep_addr); /* non-zero if an IN endpoint can take another packet */
+void gadget_in(uint8_t ep_addr, const uint8_t *data, unsigned length);
+
+#endif /* __GADGET_H_ */
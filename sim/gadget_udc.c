@@ -0,0 +1,384 @@
+/*
+    Linux gadget build of the DMA-accelerated multi-UART USB CDC
+
+    Copyright (C) 2015,2016 Peter Lawrence
+
+    Permission is hereby granted, free of charge, to any person obtaining a
+    copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the
+    Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+    THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+Raw Gadget (/dev/raw-gadget) hands every control request on EP0 to user space, descriptors included, so ST's stack
+answers them just as it does on the target; FunctionFS was not used, as it builds the device and configuration
+descriptors itself and refuses the CDC functional descriptors
+
+each enabled endpoint has a thread that moves one packet at a time between Raw Gadget and a single-packet mailbox, so
+that an OUT packet is only read from the host once the previous one has been taken, as a single-buffered endpoint would
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/ioctl.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/raw_gadget.h>
+#include "gadget.h"
+
+#define MAX_PACKET 64 /* full speed only */
+
+struct endpoint
+{
+  int enabled, handle;
+  uint8_t address;
+  uint16_t maxpacket;
+  pthread_t thread;
+  int full; /* the mailbox holds a packet for the other side */
+  uint32_t length;
+  uint8_t data[MAX_PACKET];
+};
+
+static int fd = -1;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed = PTHREAD_COND_INITIALIZER;
+
+static struct endpoint endpoints[32]; /* indexed by endpoint number, plus 16 for IN */
+
+static struct
+{
+  int pending, taken, replied, result;
+  struct gadget_request request;
+} ep0;
+
+static struct
+{
+  struct usb_raw_ep_io inner;
+  uint8_t data[65536];
+} ep0_io;
+
+static void Fail(const char *what)
+{
+  perror(what);
+  exit(1);
+}
+
+static struct endpoint *Endpoint(uint8_t ep_addr)
+{
+  return &endpoints[(ep_addr & 0x0F) + ((ep_addr & 0x80) ? 16 : 0)];
+}
+
+/* a request cancelled by a bus reset or disconnection is simply tried again */
+static int Retry(int rv)
+{
+  if ((rv >= 0) || ((ECONNRESET != errno) && (ESHUTDOWN != errno) && (EINPROGRESS != errno)))
+    return 0;
+  usleep(10000);
+  return 1;
+}
+
+static void *Endpoint_Out(void *arg)
+{
+  struct endpoint *ep = arg;
+  struct
+  {
+    struct usb_raw_ep_io inner;
+    uint8_t data[MAX_PACKET];
+  } io;
+  int rv;
+
+  for (;;)
+  {
+    io.inner.ep = ep->handle;
+    io.inner.flags = 0;
+    io.inner.length = ep->maxpacket;
+    rv = ioctl(fd, USB_RAW_IOCTL_EP_READ, &io);
+    if (Retry(rv))
+      continue;
+    if (rv < 0)
+      Fail("gadget: USB_RAW_IOCTL_EP_READ");
+
+    pthread_mutex_lock(&lock);
+    memcpy(ep->data, io.data, rv);
+    ep->length = rv;
+    ep->full = 1;
+    while (ep->full)
+      pthread_cond_wait(&changed, &lock);
+    pthread_mutex_unlock(&lock);
+  }
+
+  return NULL;
+}
+
+static void *Endpoint_In(void *arg)
+{
+  struct endpoint *ep = arg;
+  struct
+  {
+    struct usb_raw_ep_io inner;
+    uint8_t data[MAX_PACKET];
+  } io;
+  int rv;
+
+  for (;;)
+  {
+    pthread_mutex_lock(&lock);
+    while (!ep->full)
+      pthread_cond_wait(&changed, &lock);
+    memcpy(io.data, ep->data, ep->length);
+    io.inner.ep = ep->handle;
+    io.inner.flags = 0;
+    io.inner.length = ep->length;
+    pthread_mutex_unlock(&lock);
+
+    do
+      rv = ioctl(fd, USB_RAW_IOCTL_EP_WRITE, &io);
+    while (Retry(rv));
+    if (rv < 0)
+      Fail("gadget: USB_RAW_IOCTL_EP_WRITE");
+
+    pthread_mutex_lock(&lock);
+    ep->full = 0;
+    pthread_mutex_unlock(&lock);
+  }
+
+  return NULL;
+}
+
+/* hands a request to the main loop, and waits for gadget_reply() */
+static int Post(void)
+{
+  int result;
+
+  pthread_mutex_lock(&lock);
+  ep0.pending = 1;
+  ep0.taken = ep0.replied = 0;
+  while (!ep0.replied)
+    pthread_cond_wait(&changed, &lock);
+  ep0.pending = 0;
+  result = ep0.result;
+  pthread_mutex_unlock(&lock);
+
+  return result;
+}
+
+static void *Endpoint_Zero(void *arg)
+{
+  struct
+  {
+    struct usb_raw_event inner;
+    struct usb_ctrlrequest ctrl;
+  } event;
+  struct gadget_request *request = &ep0.request;
+  int result;
+
+  for (;;)
+  {
+    event.inner.type = 0;
+    event.inner.length = sizeof(event.ctrl);
+    if (ioctl(fd, USB_RAW_IOCTL_EVENT_FETCH, &event) < 0)
+      Fail("gadget: USB_RAW_IOCTL_EVENT_FETCH");
+
+    if (USB_RAW_EVENT_CONNECT == event.inner.type)
+    {
+      request->type = GADGET_RESET;
+      Post();
+      continue;
+    }
+
+    if (USB_RAW_EVENT_CONTROL != event.inner.type)
+      continue;
+
+    request->type = event.ctrl.bRequestType;
+    request->bRequest = event.ctrl.bRequest;
+    request->wValue = le16toh(event.ctrl.wValue);
+    request->wIndex = le16toh(event.ctrl.wIndex);
+    request->wLength = le16toh(event.ctrl.wLength);
+    request->data = ep0_io.data;
+
+    /* the data stage of an OUT request has to be read before the stack can see it */
+    if (!(request->type & USB_DIR_IN) && request->wLength)
+    {
+      ep0_io.inner.ep = 0;
+      ep0_io.inner.flags = 0;
+      ep0_io.inner.length = request->wLength;
+      if (ioctl(fd, USB_RAW_IOCTL_EP0_READ, &ep0_io) < 0)
+        continue;
+    }
+
+    result = Post();
+
+    if (result < 0)
+    {
+      ioctl(fd, USB_RAW_IOCTL_EP0_STALL, 0);
+    }
+    else if (request->type & USB_DIR_IN)
+    {
+      ep0_io.inner.ep = 0;
+      ep0_io.inner.flags = (result < request->wLength) ? USB_RAW_IO_FLAGS_ZERO : 0;
+      ep0_io.inner.length = result;
+      ioctl(fd, USB_RAW_IOCTL_EP0_WRITE, &ep0_io);
+    }
+    else if (!request->wLength)
+    {
+      /* a zero-length read is how Raw Gadget is told to complete the status stage */
+      ep0_io.inner.ep = 0;
+      ep0_io.inner.flags = 0;
+      ep0_io.inner.length = 0;
+      ioctl(fd, USB_RAW_IOCTL_EP0_READ, &ep0_io);
+    }
+  }
+
+  return NULL;
+}
+
+void gadget_start(const char *driver, const char *device)
+{
+  struct usb_raw_init init;
+  pthread_t thread;
+
+  fd = open("/dev/raw-gadget", O_RDWR);
+  if (fd < 0)
+    Fail("gadget: /dev/raw-gadget");
+
+  memset(&init, 0, sizeof(init));
+  strncpy((char *)init.driver_name, driver, UDC_NAME_LENGTH_MAX - 1);
+  strncpy((char *)init.device_name, device, UDC_NAME_LENGTH_MAX - 1);
+  init.speed = USB_SPEED_FULL;
+
+  if (ioctl(fd, USB_RAW_IOCTL_INIT, &init) < 0)
+    Fail("gadget: USB_RAW_IOCTL_INIT");
+  if (ioctl(fd, USB_RAW_IOCTL_RUN, 0) < 0)
+    Fail("gadget: USB_RAW_IOCTL_RUN");
+
+  if (pthread_create(&thread, NULL, Endpoint_Zero, NULL))
+    Fail("gadget: pthread_create");
+}
+
+int gadget_request(struct gadget_request *request)
+{
+  int found = 0;
+
+  pthread_mutex_lock(&lock);
+  if (ep0.pending && !ep0.taken)
+  {
+    *request = ep0.request;
+    ep0.taken = found = 1;
+  }
+  pthread_mutex_unlock(&lock);
+
+  return found;
+}
+
+void gadget_reply(int length)
+{
+  pthread_mutex_lock(&lock);
+  ep0.result = length;
+  ep0.replied = 1;
+  pthread_cond_broadcast(&changed);
+  pthread_mutex_unlock(&lock);
+}
+
+void gadget_configure(void)
+{
+  if (ioctl(fd, USB_RAW_IOCTL_CONFIGURE, 0) < 0)
+    Fail("gadget: USB_RAW_IOCTL_CONFIGURE");
+}
+
+/*
+Raw Gadget refuses to disable an endpoint with a request outstanding, so once enabled, an endpoint stays enabled; it
+is the PCD model that NAKs traffic on an endpoint that the stack has closed
+*/
+void gadget_enable(const uint8_t *descriptor)
+{
+  struct usb_endpoint_descriptor desc;
+  struct endpoint *ep = Endpoint(descriptor[2]);
+  int handle;
+
+  if (ep->enabled)
+    return;
+
+  memset(&desc, 0, sizeof(desc));
+  memcpy(&desc, descriptor, USB_DT_ENDPOINT_SIZE);
+  handle = ioctl(fd, USB_RAW_IOCTL_EP_ENABLE, &desc);
+  if (handle < 0)
+    Fail("gadget: USB_RAW_IOCTL_EP_ENABLE");
+
+  ep->handle = handle;
+  ep->address = descriptor[2];
+  ep->maxpacket = descriptor[4] | (descriptor[5] << 8);
+  if (ep->maxpacket > MAX_PACKET)
+    ep->maxpacket = MAX_PACKET;
+  ep->enabled = 1;
+
+  if (pthread_create(&ep->thread, NULL, (ep->address & USB_DIR_IN) ? Endpoint_In : Endpoint_Out, ep))
+    Fail("gadget: pthread_create");
+}
+
+int gadget_out(uint8_t ep_addr, uint8_t **data)
+{
+  struct endpoint *ep = Endpoint(ep_addr);
+  int length = -1;
+
+  pthread_mutex_lock(&lock);
+  if (ep->enabled && ep->full)
+  {
+    *data = ep->data;
+    length = ep->length;
+  }
+  pthread_mutex_unlock(&lock);
+
+  return length;
+}
+
+void gadget_out_done(uint8_t ep_addr)
+{
+  struct endpoint *ep = Endpoint(ep_addr);
+
+  pthread_mutex_lock(&lock);
+  ep->full = 0;
+  pthread_cond_broadcast(&changed);
+  pthread_mutex_unlock(&lock);
+}
+
+int gadget_in_free(uint8_t ep_addr)
+{
+  struct endpoint *ep = Endpoint(ep_addr);
+  int free;
+
+  pthread_mutex_lock(&lock);
+  free = ep->enabled && !ep->full;
+  pthread_mutex_unlock(&lock);
+
+  return free;
+}
+
+void gadget_in(uint8_t ep_addr, const uint8_t *data, unsigned length)
+{
+  struct endpoint *ep = Endpoint(ep_addr);
+
+  pthread_mutex_lock(&lock);
+  memcpy(ep->data, data, length);
+  ep->length = length;
+  ep->full = 1;
+  pthread_cond_broadcast(&changed);
+  pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,488 @@
+/*
+    host simulation of the DMA-accelerated multi-UART USB CDC
+
+    Copyright (C) 2015,2016 Peter Lawrence
+
+    Permission is hereby granted, free of charge, to any person obtaining a
+    copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the
+    Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+    THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+the host and the devices on the UART pins: the host enumerates the firmware, opens each port at the requested baud
+rate, and then moves a known byte pattern through it in both directions while the peers on the UART pins do the same
+
+every byte is checked on arrival, so data lost or reordered anywhere along the way is counted (and, with -c, makes
+the exit status non-zero); the time each byte was sent is kept so that its latency can be measured too
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sim.h"
+#include "config.h"
+#include "usbd_core.h"
+#include "usbd_desc.h"
+#include "usbd_composite.h"
+#include "usbd_cdc.h"
+
+#define PATTERN_MODULUS   251 /* prime, so that a run of lost bytes is unlikely to go unnoticed */
+#define STAMPS            65536 /* must exceed the number of bytes a port can have in flight */
+#define LATENCY_BUCKET_NS 10000ULL
+#define LATENCY_BUCKETS   10000 /* 100ms; anything slower is counted in the last bucket */
+#define DRAIN_MS          200 /* once the sources stop, time allowed for data still in flight to arrive */
+
+/* as parameters[] in usbd_cdc.c: the sim_usart[] index of each port's USART */
+static const unsigned port_usart[] = { 0, 2, 3 };
+
+struct stream
+{
+  uint32_t sent, received, window, lost, errors;
+  uint8_t expect;
+  uint64_t stamps[STAMPS];
+  uint32_t latency[LATENCY_BUCKETS];
+};
+
+struct port
+{
+  uint8_t command_itf, command_ep, data_in_ep, data_out_ep;
+  unsigned usart;
+  struct stream up;   /* UART RX pin to host */
+  struct stream down; /* host to UART TX pin */
+  uint32_t burst_sent;
+  uint64_t burst_at;
+  uint32_t notifications;
+};
+
+uint64_t sim_now;
+USBD_HandleTypeDef USBD_Device;
+
+static struct port ports[NUM_OF_CDC_UARTS];
+static unsigned num_ports, found_ports;
+static int only_port = -1;
+static struct port *port_by_usart[4];
+
+static uint32_t baud = 115200;
+static unsigned run_ms = 1000, read_interval = 1, latency_timer, loopback, quiet, check;
+static unsigned burst_bytes, burst_gap_ms;
+static int want_up = 1, want_down = 1;
+static uint64_t run_start, run_end, bus_free;
+static unsigned next_pipe;
+
+void sim_fail(const char *reason)
+{
+  fprintf(stderr, "sim: %s at %llu.%06llu ms\n", reason, (unsigned long long)(sim_now / 1000000), (unsigned long long)(sim_now % 1000000));
+  exit(2);
+}
+
+static uint8_t Stream_Send(struct stream *stream, uint64_t when)
+{
+  uint8_t byte = stream->sent % PATTERN_MODULUS;
+
+  stream->stamps[stream->sent % STAMPS] = when;
+  stream->sent++;
+  return byte;
+}
+
+static void Stream_Receive(struct stream *stream, uint8_t byte, uint64_t when)
+{
+  uint32_t index, skipped;
+  uint64_t latency;
+
+  if (byte != stream->expect)
+  {
+    /* resynchronize on the pattern; bytes skipped over are counted as lost */
+    stream->errors++;
+    skipped = (byte + PATTERN_MODULUS - stream->expect) % PATTERN_MODULUS;
+    stream->lost += skipped;
+  }
+
+  index = stream->received + stream->lost;
+  stream->received++;
+  if ((when >= run_start) && (when <= run_end))
+    stream->window++;
+  stream->expect = (byte + 1) % PATTERN_MODULUS;
+
+  if (index >= stream->sent)
+    return; /* a byte that was never sent */
+
+  latency = (when - stream->stamps[index % STAMPS]) / LATENCY_BUCKET_NS;
+  stream->latency[(latency < LATENCY_BUCKETS) ? latency : (LATENCY_BUCKETS - 1)]++;
+}
+
+static double Stream_Percentile(const struct stream *stream, unsigned percent)
+{
+  uint64_t total = 0, target, sum = 0;
+  unsigned bucket;
+
+  for (bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+    total += stream->latency[bucket];
+  if (!total)
+    return 0.0;
+
+  target = (total * percent + 99) / 100;
+  for (bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+  {
+    sum += stream->latency[bucket];
+    if (sum >= target)
+      break;
+  }
+
+  return (bucket + 1) * (double)LATENCY_BUCKET_NS / 1000000.0;
+}
+
+int sim_peer_transmit(unsigned usart, uint64_t when)
+{
+  struct port *port = port_by_usart[usart];
+
+  if (!port || !want_up || loopback || (when < run_start) || (when >= run_end))
+    return -1;
+
+  if (burst_bytes)
+  {
+    /* a burst of burst_bytes every burst_gap_ms */
+    if (when >= port->burst_at)
+    {
+      port->burst_at += burst_gap_ms * SIM_FRAME_NS;
+      port->burst_sent = 0;
+    }
+    if (port->burst_sent >= burst_bytes)
+      return -1;
+    port->burst_sent++;
+  }
+
+  return Stream_Send(&port->up, when);
+}
+
+void sim_peer_receive(unsigned usart, uint8_t byte, uint64_t when)
+{
+  struct port *port = port_by_usart[usart];
+
+  if (!port)
+    sim_fail("data sent on an unused USART");
+
+  Stream_Receive(&port->down, byte, when);
+}
+
+static int Control(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength, uint8_t *data)
+{
+  int result = sim_usb_control(bmRequestType, bRequest, wValue, wIndex, wLength, data);
+
+  sim_irq_dispatch();
+  if (result < 0)
+  {
+    fprintf(stderr, "sim: request %02x/%02x (wValue %04x, wIndex %04x) failed\n", bmRequestType, bRequest, wValue, wIndex);
+    exit(2);
+  }
+
+  return result;
+}
+
+static void Enumerate(void)
+{
+  uint8_t buffer[512];
+  unsigned offset, length;
+  struct port *port = NULL;
+  int data_itf = 0;
+
+  sim_usb_reset();
+
+  Control(0x80, USB_REQ_GET_DESCRIPTOR, USB_DESC_TYPE_DEVICE << 8, 0, USB_LEN_DEV_DESC, buffer);
+  Control(0x00, USB_REQ_SET_ADDRESS, 1, 0, 0, NULL);
+
+  Control(0x80, USB_REQ_GET_DESCRIPTOR, USB_DESC_TYPE_CONFIGURATION << 8, 0, USB_LEN_CFG_DESC, buffer);
+  length = buffer[2] | (buffer[3] << 8);
+  if (length > sizeof(buffer))
+    sim_fail("configuration descriptor too long");
+  if (Control(0x80, USB_REQ_GET_DESCRIPTOR, USB_DESC_TYPE_CONFIGURATION << 8, 0, length, buffer) != (int)length)
+    sim_fail("configuration descriptor truncated");
+
+  /* find each CDC function's interfaces and endpoints, just as the host's driver would */
+  for (offset = 0; (offset + 2) <= length && buffer[offset]; offset += buffer[offset])
+  {
+    const uint8_t *desc = buffer + offset;
+
+    if (USB_DESC_TYPE_INTERFACE == desc[1])
+    {
+      data_itf = (0x0A == desc[5]);
+      if ((0x02 == desc[5]) && (found_ports < NUM_OF_CDC_UARTS))
+      {
+        port = &ports[found_ports];
+        port->usart = port_usart[found_ports++];
+        port->command_itf = desc[2];
+      }
+    }
+    else if ((USB_DESC_TYPE_ENDPOINT == desc[1]) && port)
+    {
+      if (!data_itf)
+        port->command_ep = desc[2];
+      else if (desc[2] & 0x80)
+        port->data_in_ep = desc[2];
+      else
+        port->data_out_ep = desc[2];
+    }
+  }
+
+  if (found_ports < num_ports)
+    sim_fail("too few CDC functions in the configuration descriptor");
+
+  Control(0x00, USB_REQ_SET_CONFIGURATION, 1, 0, 0, NULL);
+}
+
+static void Open(struct port *port)
+{
+  uint8_t coding[7] = { baud, baud >> 8, baud >> 16, baud >> 24, 0, 0, 8 };
+
+  Control(0x21, CDC_SET_LINE_CODING, 0, port->command_itf, sizeof(coding), coding);
+  Control(0x21, CDC_SET_CONTROL_LINE_STATE, 0x0003, port->command_itf, 0, NULL);
+  Control(0x41, CDC_VENDOR_SET_LATENCY_TIMER, latency_timer, port->command_itf, 0, NULL);
+  if (loopback)
+    Control(0x41, CDC_VENDOR_SET_LOOPBACK, 1, port->command_itf, 0, NULL);
+}
+
+/* a bulk transaction on one of the ports' data pipes; returns the bus time it took, or 0 if the pipe has nothing to do */
+static uint64_t Pipe(unsigned pipe, uint64_t frame)
+{
+  struct port *port = &ports[pipe / 2];
+  struct stream *stream = loopback ? &port->up : &port->down;
+  uint8_t buffer[USB_FS_MAX_PACKET_SIZE];
+  int index, length;
+
+  if (pipe & 1)
+  {
+    if (!(want_down || loopback) || (sim_now < run_start) || (sim_now >= run_end))
+      return 0;
+
+    /* the host writes whole packets; a packet that is NAKed is sent again, so it only counts once it is accepted */
+    for (index = 0; index < USB_FS_MAX_PACKET_SIZE; index++)
+      buffer[index] = (stream->sent + index) % PATTERN_MODULUS;
+    length = sim_usb_out(port->data_out_ep, buffer, sizeof(buffer));
+    if (SIM_STALL == length)
+      sim_fail("bulk OUT endpoint stalled");
+    if (SIM_NAK == length)
+      return sim_usb_cost(0);
+
+    for (index = 0; index < USB_FS_MAX_PACKET_SIZE; index++)
+      Stream_Send(stream, sim_now);
+    return sim_usb_cost(USB_FS_MAX_PACKET_SIZE);
+  }
+
+  if (!(want_up || loopback) || (frame % read_interval))
+    return 0;
+
+  length = sim_usb_in(port->data_in_ep, buffer);
+  if (SIM_STALL == length)
+    sim_fail("bulk IN endpoint stalled");
+  if (SIM_NAK == length)
+    return sim_usb_cost(0);
+
+  for (index = 0; index < length; index++)
+    Stream_Receive(&port->up, buffer[index], sim_now);
+  return sim_usb_cost(length);
+}
+
+/* the host controller: bulk transactions, round-robin between the pipes, fill whatever is left of each frame */
+static void Host_Bus(void)
+{
+  uint64_t frame = sim_now / SIM_FRAME_NS, frame_end = (frame + 1) * SIM_FRAME_NS, cost = 0;
+  unsigned tried;
+
+  if (bus_free + SIM_STEP_NS < sim_now)
+    bus_free = sim_now - SIM_STEP_NS;
+
+  while (bus_free <= sim_now)
+  {
+    /* no transaction may run into the next SOF */
+    if ((bus_free + sim_usb_cost(USB_FS_MAX_PACKET_SIZE)) > frame_end)
+      return;
+
+    for (tried = 0; tried < (2 * num_ports); tried++)
+    {
+      cost = Pipe(next_pipe, frame);
+      next_pipe = (next_pipe + 1) % (2 * num_ports);
+      sim_irq_dispatch();
+      if (cost)
+        break;
+    }
+
+    if (!cost)
+      return;
+    bus_free += cost;
+  }
+}
+
+static void Host_Frame(void)
+{
+  uint8_t buffer[CDC_CMD_PACKET_SIZE];
+  unsigned index;
+  int length;
+
+  bus_free = sim_now + sim_usb_cost(3);
+  sim_usb_sof();
+  sim_irq_dispatch();
+
+  /* the interrupt endpoints are polled before any bulk traffic; bInterval is not modelled, so they are polled every frame */
+  for (index = 0; index < num_ports; index++)
+  {
+    length = sim_usb_in(ports[index].command_ep, buffer);
+    sim_irq_dispatch();
+    bus_free += sim_usb_cost((length > 0) ? length : 0);
+    if (length > 0)
+      ports[index].notifications++;
+  }
+}
+
+static void Run(uint64_t until)
+{
+  while (sim_now < until)
+  {
+    sim_now += SIM_STEP_NS;
+    sim_tick();
+    if (0 == (sim_now % SIM_FRAME_NS))
+      Host_Frame();
+    sim_uart_step();
+    sim_irq_dispatch();
+    Host_Bus();
+  }
+}
+
+static int Report_Stream(const char *name, const struct stream *stream, int active)
+{
+  if (!active)
+    return 0;
+
+  printf("  %-4s %8u bytes, %8.0f B/s, lost %u, errors %u, latency p50 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+    name, stream->received, stream->window * 1000.0 / run_ms, stream->sent - stream->received, stream->errors,
+    Stream_Percentile(stream, 50), Stream_Percentile(stream, 99), Stream_Percentile(stream, 100));
+
+  return (stream->sent != stream->received) || stream->errors;
+}
+
+static int Report(struct port *port, unsigned index)
+{
+  USBD_CDC_StatsTypeDef stats;
+  int bad = 0;
+
+  printf("port %u (USART%u, %lu baud%s)\n", index, port->usart + 1, (unsigned long)baud, loopback ? ", loopback" : "");
+  bad |= Report_Stream("up", &port->up, want_up || loopback);
+  bad |= Report_Stream("down", &port->down, want_down && !loopback);
+
+  if (quiet)
+    return bad;
+
+  Control(0xC1, CDC_VENDOR_GET_STATISTICS, 0, port->command_itf, sizeof(stats), (uint8_t *)&stats);
+  printf("  device: in packets %u, out packets %u, high water %u, overflows %u, busy retries %u, renewals %u, notifications %u\n",
+    stats.InPackets, stats.OutPackets, stats.HighWater, stats.Overflows, stats.BusyRetries, stats.Renewals, port->notifications);
+
+  return bad;
+}
+
+static void Usage(const char *name)
+{
+  fprintf(stderr,
+    "usage: %s [options]\n"
+    "  -n ports    number of ports to use (1 to %u, default all)\n"
+    "  -p port     use only this port (from 0)\n"
+    "  -b baud     baud rate (default 115200)\n"
+    "  -t ms       how long the sources send for (default 1000)\n"
+    "  -d dir      up, down or both (default both)\n"
+    "  -r frames   host reads the bulk IN pipes only every this many frames (default 1)\n"
+    "  -B bytes    the UART peers send in bursts of this many bytes...\n"
+    "  -g ms       ...every this many milliseconds\n"
+    "  -L ms       latency timer to set on each port (default 0)\n"
+    "  -l          put each port in loopback\n"
+    "  -x          have the host take the next IN packet as soon as the USB ISR acknowledges the last one\n"
+    "  -c          exit with status 1 if any data is lost or corrupted\n"
+    "  -q          quiet; don't fetch and print the device's statistics\n",
+    name, NUM_OF_CDC_UARTS);
+  exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+  unsigned index;
+  int opt, bad = 0;
+
+  num_ports = NUM_OF_CDC_UARTS;
+
+  while (-1 != (opt = getopt(argc, argv, "n:p:b:t:d:r:B:g:L:lxcq")))
+  {
+    switch (opt)
+    {
+    case 'n': num_ports = atoi(optarg); break;
+    case 'p': only_port = atoi(optarg); break;
+    case 'b': baud = strtoul(optarg, NULL, 0); break;
+    case 't': run_ms = atoi(optarg); break;
+    case 'r': read_interval = atoi(optarg); break;
+    case 'B': burst_bytes = atoi(optarg); break;
+    case 'g': burst_gap_ms = atoi(optarg); break;
+    case 'L': latency_timer = atoi(optarg); break;
+    case 'l': loopback = 1; break;
+    case 'x': sim_usb_race = 1; break;
+    case 'c': check = 1; break;
+    case 'q': quiet = 1; break;
+    case 'd':
+      want_up = strcmp(optarg, "down");
+      want_down = strcmp(optarg, "up");
+      break;
+    default:
+      Usage(argv[0]);
+    }
+  }
+
+  if (only_port >= NUM_OF_CDC_UARTS)
+    Usage(argv[0]);
+  if (only_port >= 0)
+    num_ports = only_port + 1;
+
+  if (!num_ports || (num_ports > NUM_OF_CDC_UARTS) || !run_ms || !read_interval || !baud || (burst_bytes && !burst_gap_ms))
+    Usage(argv[0]);
+
+  /* as main() does on the target */
+  USBD_Init(&USBD_Device, &USBD_Desc, 0);
+  USBD_RegisterClass(&USBD_Device, &USBD_Composite);
+  USBD_Start(&USBD_Device);
+
+  Enumerate();
+
+  /* the chosen port takes the place of the first, so that it is the only one the host and the peers see */
+  if (only_port >= 0)
+  {
+    ports[0] = ports[only_port];
+    num_ports = 1;
+  }
+
+  for (index = 0; index < num_ports; index++)
+  {
+    port_by_usart[ports[index].usart] = &ports[index];
+    Open(&ports[index]);
+  }
+
+  /* let the line settle before any data is sent */
+  run_start = 10 * SIM_FRAME_NS;
+  run_end = run_start + run_ms * SIM_FRAME_NS;
+  for (index = 0; index < num_ports; index++)
+    ports[index].burst_at = run_start;
+
+  Run(run_end + DRAIN_MS * SIM_FRAME_NS);
+
+  for (index = 0; index < num_ports; index++)
+    bad |= Report(&ports[index], (only_port >= 0) ? (unsigned)only_port : index);
+
+  return (check && bad) ? 1 : 0;
+}
@@ -0,0 +1,79 @@
+/*
+    host simulation of the DMA-accelerated multi-UART USB CDC
+
+    Copyright (C) 2015,2016 Peter Lawrence
+
+    Permission is hereby granted, free of charge, to any person obtaining a
+    copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the
+    Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+    THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __SIM_H_
+#define __SIM_H_
+
+#include <stdint.h>
+#include "stm32f0xx_hal.h"
+
+/*
+everything runs on a single virtual clock, counted in nanoseconds; the main loop in sim.c advances it in steps of
+SIM_STEP_NS, and each model catches up with it in turn, so a given command line always gives the same results
+
+ISRs are called from the main loop between steps, and so never pre-empt one another; the NVIC model only keeps track
+of which IRQs are enabled, and sim_isr() fails the simulation if an ISR returns with the USB IRQ still masked
+*/
+
+#define SIM_STEP_NS                 1000ULL
+#define SIM_FRAME_NS                1000000ULL
+#define SIM_CPU_HZ                  48000000UL
+
+extern uint64_t sim_now;
+
+/* sim_hal.c: NVIC, SysTick, USART and DMA models */
+void sim_isr(IRQn_Type IRQn);
+void sim_irq_raise(IRQn_Type IRQn);
+int sim_irq_enabled(IRQn_Type IRQn);
+void sim_irq_dispatch(void);
+void sim_tick(void);
+void sim_uart_step(void);
+unsigned sim_uart_index(const UART_HandleTypeDef *huart);
+
+/* supplied by sim.c: the device wired to each USART's pins (indexed as sim_usart[]) */
+int sim_peer_transmit(unsigned usart, uint64_t when); /* the next byte it sends to the USART's RX pin, or -1 for none */
+void sim_peer_receive(unsigned usart, uint8_t byte, uint64_t when);
+
+/* sim_pcd.c: PCD/PMA model and the host's side of the bus */
+#define SIM_NAK                     (-1)
+#define SIM_STALL                   (-2)
+
+extern PCD_HandleTypeDef hpcd; /* in usbd_conf.c */
+extern int sim_usb_race; /* non-zero to have the host take an IN packet between the ISR's CTR_TX acknowledgement and its next register read */
+
+void sim_usb_reset(void);
+void sim_usb_sof(void);
+void sim_usb_deferred(void);
+int sim_usb_in(uint8_t ep_addr, uint8_t *buffer);
+int sim_usb_out(uint8_t ep_addr, const uint8_t *buffer, unsigned length);
+int sim_usb_control(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength, uint8_t *data);
+uint64_t sim_usb_cost(unsigned length);
+
+/* ISR handlers in usbd_cdc.c */
+void USART1_IRQHandler(void);
+void USART3_4_IRQHandler(void);
+void DMA1_Channel2_3_IRQHandler(void);
+void DMA1_Channel4_5_6_7_IRQHandler(void);
+
+#endif /* __SIM_H_ */
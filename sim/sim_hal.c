@@ -0,0 +1,631 @@
+/*
+    host simulation of the DMA-accelerated multi-UART USB CDC
+
+    Copyright (C) 2015,2016 Peter Lawrence
+
+    Permission is hereby granted, free of charge, to any person obtaining a
+    copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the
+    Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+    THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+*/
+
+#include <string.h>
+#include "sim.h"
+#include "config.h"
+#include "usbd_cdc.h"
+
+/* register blocks that the firmware's peripheral pointers lead to */
+USART_TypeDef sim_usart[SIM_NUM_OF_USARTS];
+DMA_TypeDef sim_dma;
+DMA_Channel_TypeDef sim_dma_channel[SIM_NUM_OF_DMA_CHANNELS];
+GPIO_TypeDef sim_gpio[6];
+PCD_TypeDef sim_usb;
+SysTick_Type sim_systick;
+SCB_Type sim_scb;
+NVIC_Type sim_nvic;
+
+/*
+NVIC
+*/
+
+static uint32_t nvic_pending;
+static volatile uint32_t tick;
+
+static void DMA_Clear(void);
+
+/* as with CMSIS, the system exceptions (negative numbers) are not the NVIC's to enable or disable */
+void NVIC_EnableIRQ(IRQn_Type IRQn)
+{
+  if (IRQn >= 0)
+    sim_nvic.ISER[0] |= 1UL << IRQn;
+}
+
+void NVIC_DisableIRQ(IRQn_Type IRQn)
+{
+  if (IRQn >= 0)
+    sim_nvic.ISER[0] &= ~(1UL << IRQn);
+}
+
+void NVIC_SetPendingIRQ(IRQn_Type IRQn)
+{
+  sim_irq_raise(IRQn);
+}
+
+void HAL_NVIC_SetPriority(IRQn_Type IRQn, uint32_t PreemptPriority, uint32_t SubPriority)
+{
+}
+
+void HAL_NVIC_EnableIRQ(IRQn_Type IRQn)
+{
+  NVIC_EnableIRQ(IRQn);
+}
+
+void HAL_NVIC_DisableIRQ(IRQn_Type IRQn)
+{
+  NVIC_DisableIRQ(IRQn);
+}
+
+void sim_isr(IRQn_Type IRQn)
+{
+  if (!(sim_nvic.ISER[0] & (1UL << USB_IRQn)))
+    sim_fail("an ISR was entered with the USB IRQ masked");
+
+  switch (IRQn)
+  {
+  case USART1_IRQn:
+    USART1_IRQHandler();
+    break;
+  case USART3_4_IRQn:
+    USART3_4_IRQHandler();
+    break;
+  case DMA1_Channel2_3_IRQn:
+    DMA1_Channel2_3_IRQHandler();
+    break;
+  case DMA1_Channel4_5_6_7_IRQn:
+    DMA1_Channel4_5_6_7_IRQHandler();
+    break;
+  case USB_IRQn:
+    /* only ever pended for a packet held back in PMA; other USB events are delivered by sim_pcd.c as they happen */
+    sim_usb_deferred();
+    break;
+  case PendSV_IRQn:
+    /* all that PendSV_Handler() in stm32f0xx_it.c does */
+    USBD_CDC_Service();
+    break;
+  default:
+    break;
+  }
+
+  DMA_Clear();
+
+  if (!(sim_nvic.ISER[0] & (1UL << USB_IRQn)))
+    sim_fail("an ISR returned with the USB IRQ still masked");
+}
+
+void sim_irq_raise(IRQn_Type IRQn)
+{
+  if (IRQn >= 0)
+    nvic_pending |= 1UL << IRQn;
+}
+
+int sim_irq_enabled(IRQn_Type IRQn)
+{
+  return (sim_nvic.ISER[0] & (1UL << IRQn)) ? 1 : 0;
+}
+
+void sim_irq_dispatch(void)
+{
+  uint32_t ready;
+  unsigned irq;
+
+  for (;;)
+  {
+    /* an IRQ that is not enabled stays pending until it is, just as with the real NVIC */
+    while ((ready = nvic_pending & sim_nvic.ISER[0]))
+    {
+      for (irq = 0; !(ready & (1UL << irq)); irq++);
+      nvic_pending &= ~(1UL << irq);
+      sim_isr((IRQn_Type)irq);
+    }
+
+    /* PendSV is taken once nothing else is pending; it is never pre-empted here, just as the UART and DMA ISRs never pre-empt it on the target */
+    if (!(sim_scb.ICSR & SCB_ICSR_PENDSVSET_Msk))
+      break;
+    sim_scb.ICSR &= ~SCB_ICSR_PENDSVSET_Msk;
+    sim_isr(PendSV_IRQn);
+  }
+}
+
+/*
+SysTick
+*/
+
+uint32_t HAL_GetTick(void)
+{
+  return tick;
+}
+
+void HAL_IncTick(void)
+{
+  tick++;
+}
+
+void HAL_Delay(uint32_t Delay)
+{
+  sim_fail("HAL_Delay() would block the simulation");
+}
+
+void sim_tick(void)
+{
+  uint64_t within = sim_now % SIM_FRAME_NS;
+
+  /* SysTick counts down from LOAD once a millisecond, which is what ISR_PROFILING samples */
+  sim_systick.LOAD = (SIM_CPU_HZ / 1000) - 1;
+  sim_systick.VAL = sim_systick.LOAD - (uint32_t)(within * (SIM_CPU_HZ / 1000) / SIM_FRAME_NS);
+
+  if (0 == within)
+    HAL_IncTick();
+}
+
+/*
+GPIO
+*/
+
+void HAL_GPIO_Init(GPIO_TypeDef *GPIOx, GPIO_InitTypeDef *GPIO_Init)
+{
+}
+
+/*
+DMA
+*/
+
+/*
+CMAR and CNDTR as the model last left them, and the CNDTR that the transfer started with; the firmware programs the TX
+channels directly, so the model notices a new transfer by the registers no longer being as it left them
+*/
+static uint32_t dma_base[SIM_NUM_OF_DMA_CHANNELS];
+static uint32_t dma_count[SIM_NUM_OF_DMA_CHANNELS];
+static uint32_t dma_size[SIM_NUM_OF_DMA_CHANNELS];
+
+static unsigned DMA_Index(const DMA_Channel_TypeDef *channel)
+{
+  return channel - sim_dma_channel;
+}
+
+static IRQn_Type DMA_IRQn(unsigned channel)
+{
+  if (0 == channel)
+    return DMA1_Channel1_IRQn;
+  return (channel < 3) ? DMA1_Channel2_3_IRQn : DMA1_Channel4_5_6_7_IRQn;
+}
+
+/* the channel can move a byte if it is enabled and has not reached the end of a (non-circular) transfer */
+static int DMA_Ready(const DMA_Channel_TypeDef *instance)
+{
+  return instance && (instance->CCR & DMA_CCR_EN) && instance->CNDTR;
+}
+
+/* where the channel's next byte goes to or comes from */
+static uint8_t *DMA_Address(DMA_Channel_TypeDef *instance)
+{
+  unsigned channel = DMA_Index(instance);
+
+  if ((instance->CMAR != dma_base[channel]) || (instance->CNDTR != dma_count[channel]))
+  {
+    dma_base[channel] = instance->CMAR;
+    dma_size[channel] = dma_count[channel] = instance->CNDTR;
+  }
+
+  /* the Makefile links without PIE, so that this turns back into a pointer */
+  return (uint8_t *)(uintptr_t)instance->CMAR + dma_size[channel] - instance->CNDTR;
+}
+
+static void DMA_Start(DMA_HandleTypeDef *hdma, uint8_t *memory, uint32_t size, uint32_t ccr)
+{
+  unsigned channel = DMA_Index(hdma->Instance);
+
+  hdma->Instance->CCR = 0;
+  sim_dma.ISR &= ~(0xFUL << (4 * channel));
+  hdma->Instance->CMAR = dma_base[channel] = (uint32_t)(uintptr_t)memory;
+  hdma->Instance->CNDTR = dma_size[channel] = dma_count[channel] = size;
+  hdma->State = HAL_DMA_STATE_BUSY;
+  hdma->Instance->CCR = ccr | DMA_CCR_MINC | DMA_CCR_TCIE | DMA_CCR_HTIE | DMA_CCR_TEIE | DMA_CCR_EN;
+}
+
+/*
+the channel has moved one more byte; flag half and full transfer, reloading a circular channel; as on the target, a
+channel that is not circular stays enabled at the end of a transfer, but does nothing more until it is reprogrammed
+*/
+static void DMA_Advance(DMA_Channel_TypeDef *instance)
+{
+  unsigned channel = DMA_Index(instance);
+  uint32_t flags = 0;
+
+  instance->CNDTR--;
+
+  if (instance->CNDTR == dma_size[channel] / 2)
+    flags |= DMA_ISR_HTIF1;
+
+  if (0 == instance->CNDTR)
+  {
+    flags |= DMA_ISR_TCIF1;
+    if (instance->CCR & DMA_CCR_CIRC)
+      instance->CNDTR = dma_size[channel];
+  }
+
+  dma_count[channel] = instance->CNDTR;
+
+  if (flags)
+  {
+    sim_dma.ISR |= (flags | DMA_ISR_GIF1) << (4 * channel);
+    if (((flags & DMA_ISR_TCIF1) && (instance->CCR & DMA_CCR_TCIE)) || ((flags & DMA_ISR_HTIF1) && (instance->CCR & DMA_CCR_HTIE)))
+      sim_irq_raise(DMA_IRQn(channel));
+  }
+}
+
+/* DMA1->IFCR reads as zero on the target, so what an ISR wrote there is applied as it returns; CGIF clears all four flags */
+static void DMA_Clear(void)
+{
+  unsigned channel;
+
+  for (channel = 0; channel < SIM_NUM_OF_DMA_CHANNELS; channel++)
+    if (sim_dma.IFCR & (DMA_IFCR_CGIF1 << (4 * channel)))
+      sim_dma.IFCR |= 0xFUL << (4 * channel);
+
+  sim_dma.ISR &= ~sim_dma.IFCR;
+  sim_dma.IFCR = 0;
+}
+
+HAL_StatusTypeDef HAL_DMA_Abort(DMA_HandleTypeDef *hdma)
+{
+  hdma->Instance->CCR &= ~DMA_CCR_EN;
+  hdma->State = HAL_DMA_STATE_READY;
+  return HAL_OK;
+}
+
+void HAL_DMA_IRQHandler(DMA_HandleTypeDef *hdma)
+{
+  unsigned channel = DMA_Index(hdma->Instance);
+  uint32_t flags = (sim_dma.ISR >> (4 * channel)) & 0xF;
+
+  sim_dma.ISR &= ~(0xFUL << (4 * channel));
+
+  if ((flags & DMA_ISR_TEIF1) && (hdma->Instance->CCR & DMA_CCR_TEIE))
+  {
+    hdma->Instance->CCR &= ~DMA_CCR_EN;
+    hdma->State = HAL_DMA_STATE_ERROR;
+    if (hdma->XferErrorCallback)
+      hdma->XferErrorCallback(hdma);
+    return;
+  }
+
+  if ((flags & DMA_ISR_HTIF1) && (hdma->Instance->CCR & DMA_CCR_HTIE))
+  {
+    if (hdma->XferHalfCpltCallback)
+      hdma->XferHalfCpltCallback(hdma);
+  }
+
+  if ((flags & DMA_ISR_TCIF1) && (hdma->Instance->CCR & DMA_CCR_TCIE))
+  {
+    if (!(hdma->Instance->CCR & DMA_CCR_CIRC))
+      hdma->State = HAL_DMA_STATE_READY;
+    if (hdma->XferCpltCallback)
+      hdma->XferCpltCallback(hdma);
+  }
+}
+
+/*
+USART
+
+each USART has a line in each direction, on which one character at a time is either in progress or not; the time a
+character finishes is kept as a whole number of nanoseconds plus a remainder, so that long runs do not drift
+*/
+
+struct sim_line
+{
+  uint8_t busy;
+  uint8_t byte;
+  uint64_t done;      /* when the character in progress finishes */
+  uint64_t remainder; /* fraction of a nanosecond carried over, in units of 1/baud */
+};
+
+struct sim_uart
+{
+  UART_HandleTypeDef *huart;
+  uint64_t char_ns, char_remainder;
+  struct sim_line rx, tx;
+  uint8_t idle_armed;
+  uint64_t idle_at;
+  uint8_t rts;
+};
+
+static struct sim_uart uarts[SIM_NUM_OF_USARTS];
+
+/* as in UARTconfig in stm32f0xx_hal_msp.c: the DMA channels (numbered from zero) and IRQ used by each USART */
+static const struct
+{
+  unsigned tx_channel, rx_channel;
+  IRQn_Type IRQn;
+} uart_wiring[SIM_NUM_OF_USARTS] =
+{
+#if (NUM_OF_CDC_UARTS > 2)
+  { 3, 4, USART1_IRQn },
+#else
+  { 1, 2, USART1_IRQn },
+#endif
+  { 0, 0, USART2_IRQn }, /* USART2 has no entry in UARTconfig, so the firmware never uses it */
+#if (NUM_OF_CDC_UARTS > 2)
+  { 1, 2, USART3_4_IRQn },
+#else
+  { 6, 5, USART3_4_IRQn },
+#endif
+  { 6, 5, USART3_4_IRQn },
+};
+
+unsigned sim_uart_index(const UART_HandleTypeDef *huart)
+{
+  return huart->Instance - sim_usart;
+}
+
+static void UART_DMAReceiveCplt(DMA_HandleTypeDef *hdma)
+{
+  /* the firmware only ever receives with a circular channel, which carries on by itself */
+  HAL_UART_RxCpltCallback((UART_HandleTypeDef *)hdma->Parent);
+}
+
+static void UART_DMARxHalfCplt(DMA_HandleTypeDef *hdma)
+{
+  HAL_UART_RxHalfCpltCallback((UART_HandleTypeDef *)hdma->Parent);
+}
+
+static void UART_DMAError(DMA_HandleTypeDef *hdma)
+{
+  UART_HandleTypeDef *huart = (UART_HandleTypeDef *)hdma->Parent;
+
+  huart->RxXferCount = 0;
+  huart->TxXferCount = 0;
+  huart->State = HAL_UART_STATE_READY;
+  huart->ErrorCode |= HAL_UART_ERROR_DMA;
+  HAL_UART_ErrorCallback(huart);
+}
+
+void HAL_UART_MspInit(UART_HandleTypeDef *huart)
+{
+  unsigned index = sim_uart_index(huart);
+
+  if (USART2 == huart->Instance)
+    sim_fail("USART2 was initialized, but has no entry in UARTconfig");
+
+  uarts[index].huart = huart;
+  huart->hdmatx->Instance = &sim_dma_channel[uart_wiring[index].tx_channel];
+  huart->hdmarx->Instance = &sim_dma_channel[uart_wiring[index].rx_channel];
+  huart->hdmatx->State = huart->hdmarx->State = HAL_DMA_STATE_READY;
+
+  HAL_NVIC_EnableIRQ(DMA_IRQn(uart_wiring[index].tx_channel));
+  HAL_NVIC_EnableIRQ(DMA_IRQn(uart_wiring[index].rx_channel));
+  HAL_NVIC_EnableIRQ(uart_wiring[index].IRQn);
+}
+
+void HAL_UART_MspDeInit(UART_HandleTypeDef *huart)
+{
+  uarts[sim_uart_index(huart)].huart = NULL;
+}
+
+void HAL_UART_MspRTS(UART_HandleTypeDef *huart, uint8_t ready)
+{
+  uarts[sim_uart_index(huart)].rts = ready;
+}
+
+uint8_t HAL_UART_MspLines(UART_HandleTypeDef *huart)
+{
+  /* no modem status inputs are wired up */
+  return 0;
+}
+
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef *huart)
+{
+  struct sim_uart *uart;
+  uint64_t bits;
+
+  if ((NULL == huart) || (0 == huart->Init.BaudRate))
+    return HAL_ERROR;
+
+  if (HAL_UART_STATE_RESET == huart->State)
+    HAL_UART_MspInit(huart);
+
+  uart = &uarts[sim_uart_index(huart)];
+
+  huart->Instance->CR1 = huart->Init.WordLength | huart->Init.Parity | huart->Init.Mode | USART_CR1_UE;
+  huart->Instance->CR2 = huart->Init.StopBits;
+  huart->Instance->CR3 = huart->Init.HwFlowCtl;
+  huart->Instance->BRR = SIM_CPU_HZ / huart->Init.BaudRate;
+  huart->Instance->ISR = USART_ISR_TC;
+
+  /* start bit, 8 or 9 bits (including any parity), and 1 or 2 stop bits */
+  bits = 1 + ((UART_WORDLENGTH_9B == huart->Init.WordLength) ? 9 : 8) + ((UART_STOPBITS_2 == huart->Init.StopBits) ? 2 : 1);
+  uart->char_ns = (bits * 1000000000ULL) / huart->Init.BaudRate;
+  uart->char_remainder = (bits * 1000000000ULL) % huart->Init.BaudRate;
+  uart->rx.busy = uart->tx.busy = 0;
+  uart->idle_armed = 0;
+  uart->rts = 1;
+
+  huart->ErrorCode = HAL_UART_ERROR_NONE;
+  huart->State = HAL_UART_STATE_READY;
+
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_DeInit(UART_HandleTypeDef *huart)
+{
+  if (NULL == huart)
+    return HAL_ERROR;
+
+  /* the driver waits on TC first, so that nothing still being sent is cut off */
+  if (uarts[sim_uart_index(huart)].tx.busy)
+    sim_fail("a USART was de-initialized mid-character");
+
+  if (huart->hdmatx && huart->hdmatx->Instance)
+    HAL_DMA_Abort(huart->hdmatx);
+  if (huart->hdmarx && huart->hdmarx->Instance)
+    HAL_DMA_Abort(huart->hdmarx);
+
+  huart->Instance->CR1 = huart->Instance->CR2 = huart->Instance->CR3 = 0;
+  HAL_UART_MspDeInit(huart);
+
+  huart->ErrorCode = HAL_UART_ERROR_NONE;
+  huart->State = HAL_UART_STATE_RESET;
+
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Receive_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size)
+{
+  if ((HAL_UART_STATE_READY != huart->State) && (HAL_UART_STATE_BUSY_TX != huart->State))
+    return HAL_BUSY;
+
+  if ((NULL == pData) || (0 == Size))
+    return HAL_ERROR;
+
+  huart->pRxBuffPtr = pData;
+  huart->RxXferSize = huart->RxXferCount = Size;
+  huart->ErrorCode = HAL_UART_ERROR_NONE;
+  huart->State = (HAL_UART_STATE_BUSY_TX == huart->State) ? HAL_UART_STATE_BUSY_TX_RX : HAL_UART_STATE_BUSY_RX;
+
+  /* stm32f0xx_hal_msp.c sets the RX channels up as circular */
+  huart->hdmarx->XferCpltCallback = UART_DMAReceiveCplt;
+  huart->hdmarx->XferHalfCpltCallback = UART_DMARxHalfCplt;
+  huart->hdmarx->XferErrorCallback = UART_DMAError;
+  DMA_Start(huart->hdmarx, pData, Size, DMA_CCR_CIRC);
+
+  huart->Instance->CR3 |= USART_CR3_DMAR;
+
+  return HAL_OK;
+}
+
+static void Line_Start(struct sim_uart *uart, struct sim_line *line, uint8_t byte, uint64_t from)
+{
+  line->busy = 1;
+  line->byte = byte;
+  line->done = from + uart->char_ns;
+  line->remainder += uart->char_remainder;
+  if (line->remainder >= uart->huart->Init.BaudRate)
+  {
+    line->remainder -= uart->huart->Init.BaudRate;
+    line->done++;
+  }
+}
+
+/* a character has arrived at the USART's RX pin */
+static void UART_Received(struct sim_uart *uart, uint8_t byte)
+{
+  USART_TypeDef *usart = uart->huart->Instance;
+  DMA_Channel_TypeDef *channel = uart->huart->hdmarx->Instance;
+
+  if (!(usart->CR1 & USART_CR1_RE))
+    return;
+
+  if ((usart->CR3 & USART_CR3_DMAR) && DMA_Ready(channel))
+  {
+    *DMA_Address(channel) = byte;
+    DMA_Advance(channel);
+  }
+  else
+  {
+    /* nobody took the previous character out of RDR */
+    usart->ISR |= USART_ISR_ORE;
+    if (usart->CR3 & USART_CR3_EIE)
+      sim_irq_raise(uart_wiring[uart - uarts].IRQn);
+  }
+
+  uart->idle_armed = 1;
+}
+
+static void UART_Step(struct sim_uart *uart, unsigned index)
+{
+  USART_TypeDef *usart = uart->huart->Instance;
+  DMA_Channel_TypeDef *channel;
+  uint64_t from;
+  int byte;
+
+  /* the peer's side, which sends characters back to back for as long as it has them */
+  for (from = sim_now;;)
+  {
+    if (uart->rx.busy)
+    {
+      if (sim_now < uart->rx.done)
+        break;
+      uart->rx.busy = 0;
+      UART_Received(uart, uart->rx.byte);
+      uart->idle_at = uart->rx.done + uart->char_ns;
+      from = uart->rx.done;
+    }
+
+    /* the peer only holds off when flow control is on and RTS has been withdrawn */
+    if ((usart->CR3 & USART_CR3_CTSE) && !uart->rts)
+      break;
+
+    byte = sim_peer_transmit(index, from);
+    if (byte < 0)
+      break;
+
+    Line_Start(uart, &uart->rx, (uint8_t)byte, from);
+  }
+
+  /* a whole character time without a new start bit is an idle line */
+  if (uart->idle_armed && !uart->rx.busy && (sim_now >= uart->idle_at))
+  {
+    uart->idle_armed = 0;
+    usart->ISR |= USART_ISR_IDLE;
+    if (usart->CR1 & USART_CR1_IDLEIE)
+      sim_irq_raise(uart_wiring[index].IRQn);
+  }
+
+  /* the USART's own transmitter, fed by its TX DMA channel; the channel counts a character once it is off the wire */
+  for (from = sim_now;;)
+  {
+    channel = uart->huart->hdmatx->Instance;
+
+    if (uart->tx.busy)
+    {
+      if (sim_now < uart->tx.done)
+        break;
+      uart->tx.busy = 0;
+      sim_peer_receive(index, uart->tx.byte, uart->tx.done);
+      if (DMA_Ready(channel))
+        DMA_Advance(channel);
+      from = uart->tx.done;
+    }
+
+    /* TC is set once the transmitter has nothing more to send, and cleared when it starts on another character */
+    if (!(usart->CR1 & USART_CR1_TE) || !(usart->CR3 & USART_CR3_DMAT) || !DMA_Ready(channel))
+    {
+      usart->ISR |= USART_ISR_TC;
+      break;
+    }
+
+    usart->ISR &= ~USART_ISR_TC;
+    Line_Start(uart, &uart->tx, *DMA_Address(channel), from);
+  }
+}
+
+void sim_uart_step(void)
+{
+  unsigned index;
+
+  for (index = 0; index < SIM_NUM_OF_USARTS; index++)
+    if (uarts[index].huart)
+      UART_Step(&uarts[index], index);
+}
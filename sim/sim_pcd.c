@@ -0,0 +1,720 @@
+/*
+    host simulation of the DMA-accelerated multi-UART USB CDC
+
+    Copyright (C) 2015,2016 Peter Lawrence
+
+    Permission is hereby granted, free of charge, to any person obtaining a
+    copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the
+    Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+    THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+*/
+
+#include <string.h>
+#include "sim.h"
+#include "usbd_core.h"
+#include "usbd_pma.h"
+#include "usbd_bulk.h"
+
+/*
+the PCD model works at the level of transactions: the host's side calls sim_usb_in() and sim_usb_out() for each
+packet, and the PCD callbacks in usbd_conf.c are called just as PCD_EP_ISR_Handler() would call them
+
+packets pass through a model of PMA at the addresses given to HAL_PCDEx_PMAConfig(), and opening an endpoint checks
+that its buffers neither overlap another open endpoint's nor fall outside PMA
+
+the endpoints claimed by usbd_bulk.c are modelled a level lower, as it works on the endpoint registers and BTABLE
+itself: the HAL's opening and closing of them is reproduced on their registers, writes to the registers are given the
+peripheral's semantics, and the host's side moves each packet through whichever bank the register gives the peripheral
+*/
+
+static uint8_t pma[PMA_SIZE];
+
+/* a double-buffered OUT endpoint that is not armed still takes one packet into its free bank */
+static uint32_t dbuf_pending[8];
+
+/*
+with sim_usb_race, the host takes the bank that firmware hands over to a double-buffered IN endpoint in the same write
+that acknowledges its CTR_TX, before the ISR can go any further; the packet is kept for the host's next IN transaction
+on the endpoint, and the ISR is entered again if it returns with the CTR_TX that this raised still set
+*/
+int sim_usb_race;
+static uint8_t race_packet[8][USB_FS_MAX_PACKET_SIZE];
+static int race_length[8]; /* the packet's length plus one, or 0 if there is none */
+static uint8_t raced;
+
+static int PCD_Register_Send(PCD_EPTypeDef *ep, uint8_t *buffer);
+
+static void PCD_Event(void (*callback)(PCD_HandleTypeDef *hpcd, uint8_t epnum), uint8_t epnum)
+{
+  if (!sim_irq_enabled(USB_IRQn))
+    sim_fail("a USB event arrived with the USB IRQ masked");
+
+  callback(&hpcd, epnum);
+
+  if (!sim_irq_enabled(USB_IRQn))
+    sim_fail("the USB ISR returned with the USB IRQ still masked");
+}
+
+static void PCD_Setup(PCD_HandleTypeDef *hpcd, uint8_t epnum)
+{
+  HAL_PCD_SetupStageCallback(hpcd);
+}
+
+static void PCD_Reset(PCD_HandleTypeDef *hpcd, uint8_t epnum)
+{
+  HAL_PCD_ResetCallback(hpcd);
+}
+
+static void PCD_SOF(PCD_HandleTypeDef *hpcd, uint8_t epnum)
+{
+  HAL_PCD_SOFCallback(hpcd);
+}
+
+static PCD_EPTypeDef *PCD_Endpoint(uint8_t ep_addr)
+{
+  return (ep_addr & 0x80) ? &hpcd.IN_ep[ep_addr & 0x7F] : &hpcd.OUT_ep[ep_addr & 0x7F];
+}
+
+static uint16_t PCD_Bank(PCD_EPTypeDef *ep)
+{
+  uint16_t address;
+
+  if (!ep->doublebuffer)
+    return ep->pmaadress;
+
+  address = ep->bank ? ep->pmaaddr1 : ep->pmaaddr0;
+  ep->bank ^= 1;
+  return address;
+}
+
+/* non-zero if the endpoint is modelled at the level of its register */
+static uint8_t PCD_Register(uint8_t ep_addr)
+{
+#if (USB_BULK_FASTPATH)
+  return USBD_Bulk_Claimed(ep_addr);
+#else
+  return 0;
+#endif
+}
+
+/* as HAL_PCD_EP_Open() leaves the register; a single-buffered endpoint's half of it is all that is touched */
+static void PCD_Register_Open(PCD_EPTypeDef *ep)
+{
+  uint16_t epr = sim_usb.EPR[ep->num];
+
+  epr &= ~(USB_EP_T_FIELD | USB_EP_KIND | USB_EPADDR_FIELD);
+  epr |= ((USBD_EP_TYPE_INTR == ep->type) ? USB_EP_INTERRUPT : USB_EP_BULK) | ep->num;
+
+  if (ep->doublebuffer)
+  {
+    /* an OUT endpoint starts with SW_BUF set, so the peripheral has bank 0; an IN endpoint with it clear, so firmware has */
+    epr &= ~(USB_EP_DTOG_RX | USB_EPRX_STAT | USB_EP_DTOG_TX | USB_EPTX_STAT);
+    epr |= USB_EP_KIND | (ep->is_in ? USB_EP_TX_VALID : (USB_EP_DTOG_TX | USB_EP_RX_VALID));
+  }
+  else if (ep->is_in)
+  {
+    epr = (epr & ~(USB_EP_DTOG_TX | USB_EPTX_STAT)) | USB_EP_TX_NAK;
+  }
+  else
+  {
+    epr = (epr & ~(USB_EP_DTOG_RX | USB_EPRX_STAT)) | USB_EP_RX_VALID;
+  }
+
+  sim_usb.EPR[ep->num] = epr;
+}
+
+/* as HAL_PCD_EP_Close() leaves the register */
+static void PCD_Register_Close(PCD_EPTypeDef *ep)
+{
+  uint16_t epr = sim_usb.EPR[ep->num];
+
+  if (ep->doublebuffer)
+  {
+    epr = (epr & ~(USB_EP_DTOG_RX | USB_EPRX_STAT | USB_EP_DTOG_TX | USB_EPTX_STAT)) | (ep->is_in ? 0 : USB_EP_DTOG_TX);
+    if (ep->is_in)
+      race_length[ep->num] = 0;
+  }
+  else if (ep->is_in)
+    epr &= ~(USB_EP_DTOG_TX | USB_EPTX_STAT);
+  else
+    epr &= ~(USB_EP_DTOG_RX | USB_EPRX_STAT);
+
+  sim_usb.EPR[ep->num] = epr;
+}
+
+/* an interrupt on a register-level endpoint, handed over just as PCD_EP_ISR_Handler() hands it over */
+static void PCD_CTR(PCD_HandleTypeDef *hpcd, uint8_t epnum)
+{
+  for (;;)
+  {
+    raced = 0;
+#if (USB_BULK_FASTPATH)
+    USBD_Bulk_CTR(hpcd, epnum);
+#endif
+
+    if (!(sim_usb.EPR[epnum] & (USB_EP_CTR_RX | USB_EP_CTR_TX)))
+      return;
+
+    /* apart from sim_usb_race, nothing happens on the bus whilst the ISR runs here, so any other flag was missed */
+    if (!raced)
+      sim_fail("the USB ISR returned with a CTR flag still set");
+  }
+}
+
+#if (USB_BULK_FASTPATH)
+static void PCD_Bulk_Deferred(PCD_HandleTypeDef *hpcd, uint8_t epnum)
+{
+  USBD_Bulk_Deferred(hpcd);
+}
+#endif
+
+static void PCD_Check(void)
+{
+  uint32_t start[32], end[32];
+  unsigned count = 0, index, other, dir, num;
+  PCD_EPTypeDef *ep;
+
+  for (dir = 0; dir < 2; dir++)
+  {
+    for (num = 0; num < 8; num++)
+    {
+      ep = dir ? &hpcd.IN_ep[num] : &hpcd.OUT_ep[num];
+      if (!ep->is_open)
+        continue;
+
+      if (ep->doublebuffer)
+      {
+        start[count] = ep->pmaaddr0; end[count] = ep->pmaaddr0 + ep->maxpacket; count++;
+        start[count] = ep->pmaaddr1; end[count] = ep->pmaaddr1 + ep->maxpacket; count++;
+      }
+      else
+      {
+        start[count] = ep->pmaadress; end[count] = ep->pmaadress + ep->maxpacket; count++;
+      }
+    }
+  }
+
+  for (index = 0; index < count; index++)
+  {
+    if ((start[index] < (PMA_BTABLE_ADDR + PMA_BTABLE_SIZE)) || (end[index] > PMA_SIZE))
+      sim_fail("an endpoint buffer lies outside PMA");
+
+    for (other = 0; other < index; other++)
+      if ((start[index] < end[other]) && (start[other] < end[index]))
+        sim_fail("two endpoint buffers overlap in PMA");
+  }
+}
+
+/*
+PCD driver
+*/
+
+void sim_usb_epr_write(uint8_t num, uint16_t value)
+{
+  uint16_t old = sim_usb.EPR[num];
+  int length;
+  const uint16_t fixed = USB_EP_T_FIELD | USB_EP_KIND | USB_EPADDR_FIELD;
+  const uint16_t toggle = USB_EP_DTOG_RX | USB_EPRX_STAT | USB_EP_DTOG_TX | USB_EPTX_STAT;
+
+  if ((old ^ value) & fixed)
+    sim_fail("an endpoint register write changed the endpoint's type, kind or address");
+
+  /* CTR bits are cleared by writing 0 and left alone by writing 1; DTOG and STAT bits are toggled by writing 1 */
+  sim_usb.EPR[num] = (value & fixed) | (old & value & (USB_EP_CTR_RX | USB_EP_CTR_TX)) | ((old ^ value) & toggle) | (old & USB_EP_SETUP);
+
+  if (sim_usb_race && (old & USB_EP_CTR_TX) && !(value & USB_EP_CTR_TX) && !race_length[num] &&
+      hpcd.IN_ep[num].is_open && hpcd.IN_ep[num].doublebuffer && PCD_Register(num | 0x80))
+  {
+    length = PCD_Register_Send(&hpcd.IN_ep[num], race_packet[num]);
+    if (length >= 0)
+    {
+      race_length[num] = length + 1;
+      raced = 1;
+    }
+  }
+}
+
+void PCD_WritePMA(PCD_TypeDef *USBx, uint8_t *pbUsrBuf, uint16_t wPMABufAddr, uint16_t wNBytes)
+{
+  if ((wPMABufAddr + wNBytes) > PMA_SIZE)
+    sim_fail("a copy into PMA runs past its end");
+  if (wNBytes)
+    memcpy(&pma[wPMABufAddr], pbUsrBuf, wNBytes);
+}
+
+void PCD_ReadPMA(PCD_TypeDef *USBx, uint8_t *pbUsrBuf, uint16_t wPMABufAddr, uint16_t wNBytes)
+{
+  if ((wPMABufAddr + wNBytes) > PMA_SIZE)
+    sim_fail("a copy from PMA runs past its end");
+  if (wNBytes)
+    memcpy(pbUsrBuf, &pma[wPMABufAddr], wNBytes);
+}
+
+HAL_StatusTypeDef HAL_PCD_Init(PCD_HandleTypeDef *hpcd)
+{
+  unsigned index;
+
+  HAL_PCD_MspInit(hpcd);
+
+  for (index = 0; index < 8; index++)
+  {
+    memset(&hpcd->IN_ep[index], 0, sizeof(hpcd->IN_ep[index]));
+    memset(&hpcd->OUT_ep[index], 0, sizeof(hpcd->OUT_ep[index]));
+    hpcd->IN_ep[index].is_in = 1;
+    hpcd->IN_ep[index].num = hpcd->OUT_ep[index].num = index;
+  }
+
+  hpcd->USB_Address = 0;
+
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_PCD_DeInit(PCD_HandleTypeDef *hpcd)
+{
+  HAL_PCD_MspDeInit(hpcd);
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_PCD_Start(PCD_HandleTypeDef *hpcd)
+{
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_PCD_Stop(PCD_HandleTypeDef *hpcd)
+{
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_PCD_SetAddress(PCD_HandleTypeDef *hpcd, uint8_t address)
+{
+  hpcd->USB_Address = address;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_PCDEx_PMAConfig(PCD_HandleTypeDef *hpcd, uint16_t ep_addr, uint16_t ep_kind, uint32_t pmaadress)
+{
+  PCD_EPTypeDef *ep = PCD_Endpoint(ep_addr);
+
+  if (PCD_SNG_BUF == ep_kind)
+  {
+    ep->doublebuffer = 0;
+    ep->pmaadress = (uint16_t)pmaadress;
+  }
+  else
+  {
+    ep->doublebuffer = 1;
+    ep->pmaaddr0 = pmaadress & 0xFFFF;
+    ep->pmaaddr1 = (pmaadress & 0xFFFF0000) >> 16;
+  }
+
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_PCD_EP_Open(PCD_HandleTypeDef *hpcd, uint8_t ep_addr, uint16_t ep_mps, uint8_t ep_type)
+{
+  PCD_EPTypeDef *ep = PCD_Endpoint(ep_addr);
+
+  ep->maxpacket = ep_mps;
+  ep->type = ep_type;
+  ep->is_open = 1;
+  ep->is_stall = 0;
+  ep->xfer_armed = 0;
+  ep->bank = 0;
+  if (!(ep_addr & 0x80))
+    dbuf_pending[ep_addr & 0x7F] = 0;
+  if (PCD_Register(ep_addr))
+    PCD_Register_Open(ep);
+
+  PCD_Check();
+
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_PCD_EP_Close(PCD_HandleTypeDef *hpcd, uint8_t ep_addr)
+{
+  PCD_EPTypeDef *ep = PCD_Endpoint(ep_addr);
+
+  ep->is_open = 0;
+  ep->xfer_armed = 0;
+  if (PCD_Register(ep_addr))
+    PCD_Register_Close(ep);
+
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_PCD_EP_Receive(PCD_HandleTypeDef *hpcd, uint8_t ep_addr, uint8_t *pBuf, uint32_t len)
+{
+  PCD_EPTypeDef *ep = &hpcd->OUT_ep[ep_addr & 0x7F];
+
+  ep->xfer_buff = pBuf;
+  ep->xfer_len = len;
+  ep->xfer_count = 0;
+  ep->xfer_armed = 1;
+
+  /* as with the real driver, a packet already waiting in PMA is delivered by the USB ISR rather than from here */
+  if (dbuf_pending[ep->num])
+    NVIC_SetPendingIRQ(USB_IRQn);
+
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_PCD_EP_Transmit(PCD_HandleTypeDef *hpcd, uint8_t ep_addr, uint8_t *pBuf, uint32_t len)
+{
+  PCD_EPTypeDef *ep = &hpcd->IN_ep[ep_addr & 0x7F];
+
+  ep->xfer_buff = pBuf;
+  ep->xfer_len = len;
+  ep->xfer_count = 0;
+  ep->xfer_armed = 1;
+
+  return HAL_OK;
+}
+
+uint16_t HAL_PCD_EP_GetRxCount(PCD_HandleTypeDef *hpcd, uint8_t ep_addr)
+{
+  return hpcd->OUT_ep[ep_addr & 0x7F].xfer_count;
+}
+
+HAL_StatusTypeDef HAL_PCD_EP_SetStall(PCD_HandleTypeDef *hpcd, uint8_t ep_addr)
+{
+  PCD_Endpoint(ep_addr)->is_stall = 1;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_PCD_EP_ClrStall(PCD_HandleTypeDef *hpcd, uint8_t ep_addr)
+{
+  PCD_EPTypeDef *ep = PCD_Endpoint(ep_addr);
+
+  ep->is_stall = 0;
+
+  /* as with the real driver, a double-buffered endpoint goes back to how it was opened, abandoning any transfer */
+  if (ep->doublebuffer)
+  {
+    ep->xfer_armed = 0;
+    ep->bank = 0;
+    if (ep_addr & 0x80)
+      race_length[ep->num] = 0;
+    else
+      dbuf_pending[ep->num] = 0;
+    if (PCD_Register(ep_addr))
+      PCD_Register_Open(ep);
+  }
+
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_PCD_EP_Flush(PCD_HandleTypeDef *hpcd, uint8_t ep_addr)
+{
+  return HAL_OK;
+}
+
+/*
+the host's side of the bus
+*/
+
+void sim_usb_reset(void)
+{
+  unsigned index;
+
+  /* a bus reset clears every endpoint register */
+  for (index = 0; index < 8; index++)
+  {
+    sim_usb.EPR[index] = 0;
+    race_length[index] = 0;
+  }
+
+  PCD_Event(PCD_Reset, 0);
+}
+
+void sim_usb_sof(void)
+{
+  PCD_Event(PCD_SOF, 0);
+}
+
+/* a packet that waited in the free bank of a double-buffered OUT endpoint until it was armed */
+static void PCD_Deferred(PCD_HandleTypeDef *hpcd, uint8_t epnum)
+{
+  PCD_EPTypeDef *ep = &hpcd->OUT_ep[epnum];
+  uint16_t count = dbuf_pending[epnum] - 1;
+
+  dbuf_pending[epnum] = 0;
+  memcpy(ep->xfer_buff, &pma[ep->bank ? ep->pmaaddr0 : ep->pmaaddr1], count);
+  ep->xfer_count = count;
+  ep->xfer_armed = 0;
+  HAL_PCD_DataOutStageCallback(hpcd, epnum);
+}
+
+void sim_usb_deferred(void)
+{
+  unsigned epnum;
+
+  for (epnum = 1; epnum < 8; epnum++)
+    if (dbuf_pending[epnum] && hpcd.OUT_ep[epnum].xfer_armed)
+      PCD_Event(PCD_Deferred, epnum);
+
+#if (USB_BULK_FASTPATH)
+  PCD_Event(PCD_Bulk_Deferred, 0);
+#endif
+}
+
+/* the peripheral's side of an IN transaction on a register-level endpoint, short of raising the interrupt */
+static int PCD_Register_Send(PCD_EPTypeDef *ep, uint8_t *buffer)
+{
+  uint16_t epr = sim_usb.EPR[ep->num], address, length;
+
+  if ((epr & USB_EPTX_STAT) != USB_EP_TX_VALID)
+    return SIM_NAK;
+
+  if (ep->doublebuffer)
+  {
+    /* the bank DTOG_TX selects is sent, unless it is the one SW_BUF (DTOG_RX) gives firmware */
+    if (!(epr & USB_EP_DTOG_TX) == !(epr & USB_EP_DTOG_RX))
+      return SIM_NAK;
+    address = (epr & USB_EP_DTOG_TX) ? ep->pmaaddr1 : ep->pmaaddr0;
+    length = (epr & USB_EP_DTOG_TX) ? sim_usb.RX_COUNT[ep->num] : sim_usb.TX_COUNT[ep->num];
+  }
+  else
+  {
+    address = ep->pmaadress;
+    length = sim_usb.TX_COUNT[ep->num];
+    epr = (epr & ~USB_EPTX_STAT) | USB_EP_TX_NAK;
+  }
+
+  length &= 0x3FF;
+  if (length > ep->maxpacket)
+    sim_fail("an IN packet is larger than the endpoint's maximum");
+  if (length)
+    memcpy(buffer, &pma[address], length);
+
+  sim_usb.EPR[ep->num] = (epr ^ USB_EP_DTOG_TX) | USB_EP_CTR_TX;
+
+  return length;
+}
+
+static int PCD_Register_In(PCD_EPTypeDef *ep, uint8_t *buffer)
+{
+  int length;
+
+  /* a packet taken whilst the ISR ran (see sim_usb_race) has already had its interrupt */
+  if (race_length[ep->num])
+  {
+    length = race_length[ep->num] - 1;
+    memcpy(buffer, race_packet[ep->num], length);
+    race_length[ep->num] = 0;
+    return length;
+  }
+
+  length = PCD_Register_Send(ep, buffer);
+  if (length >= 0)
+    PCD_Event(PCD_CTR, ep->num);
+
+  return length;
+}
+
+/* the peripheral's side of an OUT transaction on a register-level endpoint */
+static int PCD_Register_Out(PCD_EPTypeDef *ep, const uint8_t *buffer, unsigned length)
+{
+  uint16_t epr = sim_usb.EPR[ep->num], address;
+  __IO uint16_t *count;
+
+  if ((epr & USB_EPRX_STAT) != USB_EP_RX_VALID)
+    return SIM_NAK;
+
+  if (ep->doublebuffer)
+  {
+    /* the bank DTOG_RX selects is filled, unless it is the one SW_BUF (DTOG_TX) gives firmware */
+    if (!(epr & USB_EP_DTOG_RX) == !(epr & USB_EP_DTOG_TX))
+      return SIM_NAK;
+    address = (epr & USB_EP_DTOG_RX) ? ep->pmaaddr1 : ep->pmaaddr0;
+    count = (epr & USB_EP_DTOG_RX) ? &sim_usb.RX_COUNT[ep->num] : &sim_usb.TX_COUNT[ep->num];
+  }
+  else
+  {
+    address = ep->pmaadress;
+    count = &sim_usb.RX_COUNT[ep->num];
+    epr = (epr & ~USB_EPRX_STAT) | USB_EP_RX_NAK;
+  }
+
+  if (length)
+    memcpy(&pma[address], buffer, length);
+  *count = (*count & 0xFC00) | length;
+
+  sim_usb.EPR[ep->num] = (epr ^ USB_EP_DTOG_RX) | USB_EP_CTR_RX;
+  PCD_Event(PCD_CTR, ep->num);
+
+  return length;
+}
+
+int sim_usb_in(uint8_t ep_addr, uint8_t *buffer)
+{
+  PCD_EPTypeDef *ep = &hpcd.IN_ep[ep_addr & 0x7F];
+  uint16_t address;
+  uint32_t length;
+
+  if (!ep->is_open)
+    return SIM_NAK;
+  if (ep->is_stall)
+    return SIM_STALL;
+  if (PCD_Register(ep_addr))
+    return PCD_Register_In(ep, buffer);
+  if (!ep->xfer_armed)
+    return SIM_NAK;
+
+  length = ep->xfer_len - ep->xfer_count;
+  if (length > ep->maxpacket)
+    length = ep->maxpacket;
+
+  address = PCD_Bank(ep);
+  if (length)
+  {
+    memcpy(&pma[address], ep->xfer_buff + ep->xfer_count, length);
+    memcpy(buffer, &pma[address], length);
+  }
+  ep->xfer_count += length;
+
+  if (0 == ep->num)
+  {
+    /* EP0 is single-buffered and reports every packet, leaving xfer_buff at whatever is still to be sent */
+    ep->xfer_buff += length;
+    ep->xfer_armed = 0;
+    PCD_Event(HAL_PCD_DataInStageCallback, 0);
+  }
+  else if (ep->xfer_count >= ep->xfer_len)
+  {
+    ep->xfer_armed = 0;
+    PCD_Event(HAL_PCD_DataInStageCallback, ep->num);
+  }
+
+  return length;
+}
+
+int sim_usb_out(uint8_t ep_addr, const uint8_t *buffer, unsigned length)
+{
+  PCD_EPTypeDef *ep = &hpcd.OUT_ep[ep_addr & 0x7F];
+  uint16_t address;
+
+  if (!ep->is_open)
+    return SIM_NAK;
+  if (ep->is_stall)
+    return SIM_STALL;
+  if (length > ep->maxpacket)
+    sim_fail("the host sent a packet larger than the endpoint's maximum");
+  if (PCD_Register(ep_addr))
+    return PCD_Register_Out(ep, buffer, length);
+
+  if (!ep->xfer_armed)
+  {
+    if (!ep->doublebuffer || dbuf_pending[ep->num])
+      return SIM_NAK;
+
+    /* park it in the free bank, to be handed over once HAL_PCD_EP_Receive() is called */
+    address = PCD_Bank(ep);
+    memcpy(&pma[address], buffer, length);
+    dbuf_pending[ep->num] = length + 1;
+    return length;
+  }
+
+  if ((ep->xfer_count + length) > ep->xfer_len)
+    sim_fail("the host sent more than the OUT transfer had room for");
+
+  address = PCD_Bank(ep);
+  if (length)
+  {
+    memcpy(&pma[address], buffer, length);
+    memcpy(ep->xfer_buff + ep->xfer_count, &pma[address], length);
+  }
+
+  if (0 == ep->num)
+  {
+    /* EP0 reports every packet too, and is left ready for the next one just as PCD_EP_ISR_Handler() leaves it */
+    ep->xfer_count = length;
+    ep->xfer_buff += length;
+    PCD_Event(HAL_PCD_DataOutStageCallback, 0);
+  }
+  else
+  {
+    ep->xfer_count += length;
+    if ((length < ep->maxpacket) || (ep->xfer_count >= ep->xfer_len))
+    {
+      ep->xfer_armed = 0;
+      PCD_Event(HAL_PCD_DataOutStageCallback, ep->num);
+    }
+  }
+
+  return length;
+}
+
+int sim_usb_control(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength, uint8_t *data)
+{
+  uint8_t packet[USB_MAX_EP0_SIZE];
+  unsigned done = 0, length;
+  int outcome;
+
+  packet[0] = bmRequestType;
+  packet[1] = bRequest;
+  packet[2] = (uint8_t)wValue; packet[3] = (uint8_t)(wValue >> 8);
+  packet[4] = (uint8_t)wIndex; packet[5] = (uint8_t)(wIndex >> 8);
+  packet[6] = (uint8_t)wLength; packet[7] = (uint8_t)(wLength >> 8);
+
+  /* a SETUP is always accepted, and clears any stall left over from the previous control transfer */
+  hpcd.IN_ep[0].is_stall = hpcd.OUT_ep[0].is_stall = 0;
+  hpcd.IN_ep[0].xfer_armed = 0;
+  memcpy(hpcd.Setup, packet, 8);
+  PCD_Event(PCD_Setup, 0);
+
+  if (bmRequestType & 0x80)
+  {
+    /* data stage, until a short packet or wLength; the device answers each IN straight from the USB ISR */
+    while (done < wLength)
+    {
+      outcome = sim_usb_in(0x80, packet);
+      if (outcome < 0)
+        return outcome;
+      length = ((done + outcome) > wLength) ? (wLength - done) : (unsigned)outcome;
+      memcpy(data + done, packet, length);
+      done += length;
+      if ((unsigned)outcome < hpcd.IN_ep[0].maxpacket)
+        break;
+    }
+
+    /* status stage */
+    outcome = sim_usb_out(0x00, NULL, 0);
+  }
+  else
+  {
+    while (done < wLength)
+    {
+      length = ((wLength - done) > hpcd.OUT_ep[0].maxpacket) ? hpcd.OUT_ep[0].maxpacket : (wLength - done);
+      outcome = sim_usb_out(0x00, data + done, length);
+      if (outcome < 0)
+        return outcome;
+      done += length;
+    }
+
+    outcome = sim_usb_in(0x80, packet);
+  }
+
+  return (outcome < 0) ? outcome : (int)done;
+}
+
+uint64_t sim_usb_cost(unsigned length)
+{
+  /*
+  bus time for a transaction at 12Mbit/s, using the 13 bytes of protocol overhead that the USB specification allows
+  for a full-speed bulk transaction; this fits the usual 19 full-sized packets into a frame
+  */
+  return ((uint64_t)(length + 13) * 8 * 1000) / 12;
+}
@@ -0,0 +1,495 @@
+/*
+    mock STM32F0xx HAL for running the CDC data path on a host computer
+
+    Copyright (C) 2015,2016 Peter Lawrence
+
+    Permission is hereby granted, free of charge, to any person obtaining a
+    copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the
+    Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+    THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __STM32F0xx_HAL_H
+#define __STM32F0xx_HAL_H
+
+/*
+this stands in for ST's stm32f0xx_hal.h when the firmware in ../src is built for the host (see Makefile)
+
+only what the USB stack, usbd_conf.c and usbd_cdc.c use is provided; register layouts and bit positions follow the
+STM32F072, but the peripherals behind them are the models in sim_hal.c and sim_pcd.c
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define __IO volatile
+
+/* CMSIS / HAL basics */
+
+typedef enum
+{
+  HAL_OK       = 0x00,
+  HAL_ERROR    = 0x01,
+  HAL_BUSY     = 0x02,
+  HAL_TIMEOUT  = 0x03
+} HAL_StatusTypeDef;
+
+typedef enum
+{
+  HAL_UNLOCKED = 0x00,
+  HAL_LOCKED   = 0x01
+} HAL_LockTypeDef;
+
+typedef enum
+{
+  PendSV_IRQn                 = -2,
+  SysTick_IRQn                = -1,
+  DMA1_Channel1_IRQn          = 9,
+  DMA1_Channel2_3_IRQn        = 10,
+  DMA1_Channel4_5_6_7_IRQn    = 11,
+  USART1_IRQn                 = 27,
+  USART2_IRQn                 = 28,
+  USART3_4_IRQn               = 29,
+  USB_IRQn                    = 31,
+} IRQn_Type;
+
+void NVIC_EnableIRQ(IRQn_Type IRQn);
+void NVIC_DisableIRQ(IRQn_Type IRQn);
+void NVIC_SetPendingIRQ(IRQn_Type IRQn);
+void HAL_NVIC_SetPriority(IRQn_Type IRQn, uint32_t PreemptPriority, uint32_t SubPriority);
+void HAL_NVIC_EnableIRQ(IRQn_Type IRQn);
+void HAL_NVIC_DisableIRQ(IRQn_Type IRQn);
+
+/* a breakpoint on the target; here it ends the simulation with an error */
+void sim_fail(const char *reason);
+#define __BKPT(value)               sim_fail("breakpoint")
+
+uint32_t HAL_GetTick(void);
+void HAL_IncTick(void);
+void HAL_Delay(uint32_t Delay);
+
+typedef struct
+{
+  __IO uint32_t CTRL;
+  __IO uint32_t LOAD;
+  __IO uint32_t VAL;
+  __IO uint32_t CALIB;
+} SysTick_Type;
+
+extern SysTick_Type sim_systick;
+#define SysTick                     (&sim_systick)
+
+typedef struct
+{
+  __IO uint32_t ICSR;
+} SCB_Type;
+
+extern SCB_Type sim_scb;
+#define SCB                         (&sim_scb)
+
+/* reading ISER gives the IRQs that are enabled, which NVIC_EnableIRQ() and NVIC_DisableIRQ() keep up to date */
+typedef struct
+{
+  __IO uint32_t ISER[1];
+} NVIC_Type;
+
+extern NVIC_Type sim_nvic;
+#define NVIC                        (&sim_nvic)
+#define SCB_ICSR_PENDSVSET_Msk      (1UL << 28)
+
+/* RCC and GPIO, as far as usbd_conf.c needs them */
+
+#define __GPIOA_CLK_ENABLE()
+#define __USB_CLK_ENABLE()
+#define __USB_CLK_DISABLE()
+#define __DMA1_CLK_ENABLE()
+
+typedef struct
+{
+  __IO uint32_t MODER;
+} GPIO_TypeDef;
+
+typedef struct
+{
+  uint32_t Pin;
+  uint32_t Mode;
+  uint32_t Pull;
+  uint32_t Speed;
+  uint32_t Alternate;
+} GPIO_InitTypeDef;
+
+#define GPIO_PIN_11                 ((uint16_t)0x0800)
+#define GPIO_PIN_12                 ((uint16_t)0x1000)
+#define GPIO_MODE_AF_PP             ((uint32_t)0x00000002)
+#define GPIO_NOPULL                 ((uint32_t)0x00000000)
+#define GPIO_SPEED_HIGH             ((uint32_t)0x00000003)
+#define GPIO_AF2_USB                ((uint8_t)0x02)
+
+extern GPIO_TypeDef sim_gpio[6];
+#define GPIOA                       (&sim_gpio[0])
+
+void HAL_GPIO_Init(GPIO_TypeDef *GPIOx, GPIO_InitTypeDef *GPIO_Init);
+
+/* DMA */
+
+typedef struct
+{
+  __IO uint32_t CCR;
+  __IO uint32_t CNDTR;
+  __IO uint32_t CPAR;
+  __IO uint32_t CMAR;
+  uint32_t RESERVED;
+} DMA_Channel_TypeDef;
+
+typedef struct
+{
+  __IO uint32_t ISR;
+  __IO uint32_t IFCR;
+} DMA_TypeDef;
+
+#define DMA_CCR_EN                  ((uint32_t)0x00000001)
+#define DMA_CCR_TCIE                ((uint32_t)0x00000002)
+#define DMA_CCR_HTIE                ((uint32_t)0x00000004)
+#define DMA_CCR_TEIE                ((uint32_t)0x00000008)
+#define DMA_CCR_DIR                 ((uint32_t)0x00000010)
+#define DMA_CCR_CIRC                ((uint32_t)0x00000020)
+#define DMA_CCR_MINC                ((uint32_t)0x00000080)
+
+#define DMA_ISR_GIF1                ((uint32_t)0x00000001)
+#define DMA_ISR_TCIF1               ((uint32_t)0x00000002)
+#define DMA_ISR_HTIF1               ((uint32_t)0x00000004)
+#define DMA_ISR_TEIF1               ((uint32_t)0x00000008)
+#define DMA_IFCR_CGIF1              ((uint32_t)0x00000001)
+
+#define SIM_NUM_OF_DMA_CHANNELS     7
+
+extern DMA_TypeDef sim_dma;
+extern DMA_Channel_TypeDef sim_dma_channel[SIM_NUM_OF_DMA_CHANNELS];
+
+#define DMA1                        (&sim_dma)
+#define DMA1_Channel1               (&sim_dma_channel[0])
+#define DMA1_Channel2               (&sim_dma_channel[1])
+#define DMA1_Channel3               (&sim_dma_channel[2])
+#define DMA1_Channel4               (&sim_dma_channel[3])
+#define DMA1_Channel5               (&sim_dma_channel[4])
+#define DMA1_Channel6               (&sim_dma_channel[5])
+#define DMA1_Channel7               (&sim_dma_channel[6])
+
+/* usbd_cdc.c works out a channel's number from its address, so these must be spaced just as the real ones are */
+#define DMA1_Channel1_BASE          ((uint32_t)(uintptr_t)DMA1_Channel1)
+#define DMA1_Channel2_BASE          ((uint32_t)(uintptr_t)DMA1_Channel2)
+
+typedef enum
+{
+  HAL_DMA_STATE_RESET             = 0x00,
+  HAL_DMA_STATE_READY             = 0x01,
+  HAL_DMA_STATE_BUSY              = 0x02,
+  HAL_DMA_STATE_TIMEOUT           = 0x03,
+  HAL_DMA_STATE_ERROR             = 0x04,
+} HAL_DMA_StateTypeDef;
+
+typedef struct __DMA_HandleTypeDef
+{
+  DMA_Channel_TypeDef   *Instance;
+  HAL_LockTypeDef       Lock;
+  __IO HAL_DMA_StateTypeDef State;
+  void                  *Parent;
+  void                  (* XferCpltCallback)( struct __DMA_HandleTypeDef * hdma);
+  void                  (* XferHalfCpltCallback)( struct __DMA_HandleTypeDef * hdma);
+  void                  (* XferErrorCallback)( struct __DMA_HandleTypeDef * hdma);
+  __IO uint32_t         ErrorCode;
+} DMA_HandleTypeDef;
+
+HAL_StatusTypeDef HAL_DMA_Abort(DMA_HandleTypeDef *hdma);
+void HAL_DMA_IRQHandler(DMA_HandleTypeDef *hdma);
+
+#define __HAL_LINKDMA(__HANDLE__, __PPP_DMA_FIELD_, __DMA_HANDLE_)               \
+                        do{                                                      \
+                              (__HANDLE__)->__PPP_DMA_FIELD_ = &(__DMA_HANDLE_); \
+                              (__DMA_HANDLE_).Parent = (__HANDLE__);             \
+                          } while(0)
+
+/* USART */
+
+typedef struct
+{
+  __IO uint32_t CR1;
+  __IO uint32_t CR2;
+  __IO uint32_t CR3;
+  __IO uint32_t BRR;
+  __IO uint32_t GTPR;
+  __IO uint32_t RTOR;
+  __IO uint32_t RQR;
+  __IO uint32_t ISR;
+  __IO uint32_t ICR;
+  __IO uint32_t RDR;
+  __IO uint32_t TDR;
+} USART_TypeDef;
+
+#define USART_CR1_UE                ((uint32_t)0x00000001)
+#define USART_CR1_RE                ((uint32_t)0x00000004)
+#define USART_CR1_TE                ((uint32_t)0x00000008)
+#define USART_CR1_IDLEIE            ((uint32_t)0x00000010)
+#define USART_CR1_PEIE              ((uint32_t)0x00000100)
+#define USART_CR1_PS                ((uint32_t)0x00000200)
+#define USART_CR1_PCE               ((uint32_t)0x00000400)
+#define USART_CR1_M0                ((uint32_t)0x00001000)
+#define USART_CR2_STOP_1            ((uint32_t)0x00002000)
+#define USART_CR3_EIE               ((uint32_t)0x00000001)
+#define USART_CR3_DMAR              ((uint32_t)0x00000040)
+#define USART_CR3_DMAT              ((uint32_t)0x00000080)
+#define USART_CR3_RTSE              ((uint32_t)0x00000100)
+#define USART_CR3_CTSE              ((uint32_t)0x00000200)
+#define USART_ISR_PE                ((uint32_t)0x00000001)
+#define USART_ISR_FE                ((uint32_t)0x00000002)
+#define USART_ISR_NE                ((uint32_t)0x00000004)
+#define USART_ISR_ORE               ((uint32_t)0x00000008)
+#define USART_ISR_IDLE              ((uint32_t)0x00000010)
+#define USART_ISR_TC                ((uint32_t)0x00000040)
+
+#define SIM_NUM_OF_USARTS           4
+
+extern USART_TypeDef sim_usart[SIM_NUM_OF_USARTS];
+
+#define USART1                      (&sim_usart[0])
+#define USART2                      (&sim_usart[1])
+#define USART3                      (&sim_usart[2])
+#define USART4                      (&sim_usart[3])
+
+typedef struct
+{
+  uint32_t BaudRate;
+  uint32_t WordLength;
+  uint32_t StopBits;
+  uint32_t Parity;
+  uint32_t Mode;
+  uint32_t HwFlowCtl;
+  uint32_t OverSampling;
+} UART_InitTypeDef;
+
+typedef enum
+{
+  HAL_UART_STATE_RESET             = 0x00,
+  HAL_UART_STATE_READY             = 0x01,
+  HAL_UART_STATE_BUSY              = 0x02,
+  HAL_UART_STATE_BUSY_TX           = 0x12,
+  HAL_UART_STATE_BUSY_RX           = 0x22,
+  HAL_UART_STATE_BUSY_TX_RX        = 0x32,
+  HAL_UART_STATE_TIMEOUT           = 0x03,
+  HAL_UART_STATE_ERROR             = 0x04
+} HAL_UART_StateTypeDef;
+
+#define HAL_UART_ERROR_NONE         ((uint32_t)0x00)
+#define HAL_UART_ERROR_PE           ((uint32_t)0x01)
+#define HAL_UART_ERROR_NE           ((uint32_t)0x02)
+#define HAL_UART_ERROR_FE           ((uint32_t)0x04)
+#define HAL_UART_ERROR_ORE          ((uint32_t)0x08)
+#define HAL_UART_ERROR_DMA          ((uint32_t)0x10)
+
+typedef struct
+{
+  USART_TypeDef            *Instance;
+  UART_InitTypeDef         Init;
+  uint8_t                  *pTxBuffPtr;
+  uint16_t                 TxXferSize;
+  uint16_t                 TxXferCount;
+  uint8_t                  *pRxBuffPtr;
+  uint16_t                 RxXferSize;
+  uint16_t                 RxXferCount;
+  DMA_HandleTypeDef        *hdmatx;
+  DMA_HandleTypeDef        *hdmarx;
+  HAL_LockTypeDef          Lock;
+  __IO HAL_UART_StateTypeDef State;
+  __IO uint32_t            ErrorCode;
+} UART_HandleTypeDef;
+
+#define UART_WORDLENGTH_8B          ((uint32_t)0x00000000)
+#define UART_WORDLENGTH_9B          USART_CR1_M0
+#define UART_STOPBITS_1             ((uint32_t)0x00000000)
+#define UART_STOPBITS_2             USART_CR2_STOP_1
+#define UART_PARITY_NONE            ((uint32_t)0x00000000)
+#define UART_PARITY_EVEN            USART_CR1_PCE
+#define UART_PARITY_ODD             (USART_CR1_PCE | USART_CR1_PS)
+#define UART_MODE_RX                USART_CR1_RE
+#define UART_MODE_TX                USART_CR1_TE
+#define UART_MODE_TX_RX             (USART_CR1_TE | USART_CR1_RE)
+#define UART_HWCONTROL_NONE         ((uint32_t)0x00000000)
+#define UART_HWCONTROL_RTS          USART_CR3_RTSE
+#define UART_HWCONTROL_CTS          USART_CR3_CTSE
+#define UART_HWCONTROL_RTS_CTS      (USART_CR3_RTSE | USART_CR3_CTSE)
+
+#define UART_FLAG_PE                USART_ISR_PE
+#define UART_FLAG_FE                USART_ISR_FE
+#define UART_FLAG_NE                USART_ISR_NE
+#define UART_FLAG_ORE               USART_ISR_ORE
+#define UART_FLAG_IDLE              USART_ISR_IDLE
+#define UART_FLAG_TC                USART_ISR_TC
+
+/* the ICR bits are in the same positions as the ISR flags they clear */
+#define UART_CLEAR_PEF              USART_ISR_PE
+#define UART_CLEAR_FEF              USART_ISR_FE
+#define UART_CLEAR_NEF              USART_ISR_NE
+#define UART_CLEAR_OREF             USART_ISR_ORE
+#define UART_CLEAR_IDLEF            USART_ISR_IDLE
+
+/* as with ST's encoding, the upper bits say which register the enable bit lives in: 1 for CR1, 3 for CR3 */
+#define UART_IT_PE                  ((1UL << 28) | USART_CR1_PEIE)
+#define UART_IT_IDLE                ((1UL << 28) | USART_CR1_IDLEIE)
+#define UART_IT_ERR                 ((3UL << 28) | USART_CR3_EIE)
+
+#define UART_IT_MASK                0x0FFFFFFFUL
+#define UART_IT_REG(__IT__)         (((__IT__) >> 28) & 0x3)
+
+#define __HAL_UART_ENABLE_IT(__HANDLE__, __IT__)     ((1 == UART_IT_REG(__IT__)) ? ((__HANDLE__)->Instance->CR1 |= ((__IT__) & UART_IT_MASK)) : \
+                                                                                   ((__HANDLE__)->Instance->CR3 |= ((__IT__) & UART_IT_MASK)))
+#define __HAL_UART_DISABLE_IT(__HANDLE__, __IT__)    ((1 == UART_IT_REG(__IT__)) ? ((__HANDLE__)->Instance->CR1 &= ~((__IT__) & UART_IT_MASK)) : \
+                                                                                   ((__HANDLE__)->Instance->CR3 &= ~((__IT__) & UART_IT_MASK)))
+#define __HAL_UART_GET_IT_SOURCE(__HANDLE__, __IT__) ((1 == UART_IT_REG(__IT__)) ? ((__HANDLE__)->Instance->CR1 & ((__IT__) & UART_IT_MASK)) : \
+                                                                                   ((__HANDLE__)->Instance->CR3 & ((__IT__) & UART_IT_MASK)))
+/* only UART_IT_IDLE is ever asked about, and its flag sits in the same position in ISR as its enable bit does in CR1 */
+#define __HAL_UART_GET_FLAG(__HANDLE__, __FLAG__)    (((__HANDLE__)->Instance->ISR & (__FLAG__)) == (__FLAG__))
+#define __HAL_UART_GET_IT(__HANDLE__, __IT__)        ((__HANDLE__)->Instance->ISR & ((__IT__) & UART_IT_MASK))
+#define __HAL_UART_CLEAR_IT(__HANDLE__, __IT_CLEAR__) ((__HANDLE__)->Instance->ISR &= ~(uint32_t)(__IT_CLEAR__))
+
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef *huart);
+HAL_StatusTypeDef HAL_UART_DeInit (UART_HandleTypeDef *huart);
+void HAL_UART_MspInit(UART_HandleTypeDef *huart);
+void HAL_UART_MspDeInit(UART_HandleTypeDef *huart);
+HAL_StatusTypeDef HAL_UART_Receive_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size);
+void HAL_UART_RxHalfCpltCallback(UART_HandleTypeDef *huart);
+void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart);
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart);
+
+/* PCD (the USB device peripheral) */
+
+typedef struct
+{
+  __IO uint16_t CNTR;
+  __IO uint16_t EPR[8];       /* the endpoint registers, written with PCD_SET_ENDPOINT() */
+  __IO uint16_t TX_COUNT[8];  /* COUNTn_TX in BTABLE */
+  __IO uint16_t RX_COUNT[8];  /* COUNTn_RX in BTABLE */
+} PCD_TypeDef;
+
+extern PCD_TypeDef sim_usb;
+#define USB                         (&sim_usb)
+
+/*
+the endpoint registers and BTABLE, as far as usbd_bulk.c uses them; only the endpoints it claims are modelled at this
+level, and sim_usb_epr_write() gives writes the peripheral's semantics
+*/
+#define USB_EP_CTR_RX               ((uint16_t)0x8000U)
+#define USB_EP_DTOG_RX              ((uint16_t)0x4000U)
+#define USB_EPRX_STAT               ((uint16_t)0x3000U)
+#define USB_EP_SETUP                ((uint16_t)0x0800U)
+#define USB_EP_T_FIELD              ((uint16_t)0x0600U)
+#define USB_EP_KIND                 ((uint16_t)0x0100U)
+#define USB_EP_CTR_TX               ((uint16_t)0x0080U)
+#define USB_EP_DTOG_TX              ((uint16_t)0x0040U)
+#define USB_EPTX_STAT               ((uint16_t)0x0030U)
+#define USB_EPADDR_FIELD            ((uint16_t)0x000FU)
+#define USB_EP_BULK                 ((uint16_t)0x0000U)
+#define USB_EP_INTERRUPT            ((uint16_t)0x0600U)
+#define USB_EP_TX_DIS               ((uint16_t)0x0000U)
+#define USB_EP_TX_NAK               ((uint16_t)0x0020U)
+#define USB_EP_TX_VALID             ((uint16_t)0x0030U)
+#define USB_EP_RX_DIS               ((uint16_t)0x0000U)
+#define USB_EP_RX_NAK               ((uint16_t)0x2000U)
+#define USB_EP_RX_VALID             ((uint16_t)0x3000U)
+
+void sim_usb_epr_write(uint8_t num, uint16_t value);
+
+#define PCD_GET_ENDPOINT(USBx, bEpNum)              ((USBx)->EPR[bEpNum])
+#define PCD_SET_ENDPOINT(USBx, bEpNum, wRegValue)   sim_usb_epr_write((bEpNum), (wRegValue))
+#define PCD_EP_TX_CNT(USBx, bEpNum)                 (&(USBx)->TX_COUNT[bEpNum])
+#define PCD_EP_RX_CNT(USBx, bEpNum)                 (&(USBx)->RX_COUNT[bEpNum])
+#define PCD_SET_EP_TX_CNT(USBx, bEpNum, wCount)     (*PCD_EP_TX_CNT((USBx), (bEpNum)) = (wCount))
+#define PCD_GET_EP_TX_CNT(USBx, bEpNum)             ((uint16_t)(*PCD_EP_TX_CNT((USBx), (bEpNum))) & 0x3ff)
+#define PCD_GET_EP_RX_CNT(USBx, bEpNum)             ((uint16_t)(*PCD_EP_RX_CNT((USBx), (bEpNum))) & 0x3ff)
+
+#define PCD_SPEED_FULL              2
+#define PCD_PHY_EMBEDDED            2
+#define PCD_SNG_BUF                 0
+#define PCD_DBL_BUF                 1
+
+typedef struct
+{
+  uint32_t dev_endpoints;
+  uint32_t speed;
+  uint32_t ep0_mps;
+  uint32_t phy_itface;
+  uint32_t Sof_enable;
+  uint32_t low_power_enable;
+  uint32_t lpm_enable;
+  uint32_t battery_charging_enable;
+} PCD_InitTypeDef;
+
+typedef struct
+{
+  uint8_t   num;
+  uint8_t   is_in;
+  uint8_t   is_stall;
+  uint8_t   type;
+  uint16_t  pmaadress;
+  uint16_t  pmaaddr0;
+  uint16_t  pmaaddr1;
+  uint8_t   doublebuffer;
+  uint32_t  maxpacket;
+  uint8_t   *xfer_buff;
+  uint32_t  xfer_len;
+  uint32_t  xfer_count;
+  uint8_t   xfer_armed; /* a transfer has been handed to the endpoint and has not yet completed */
+  uint8_t   is_open;
+  uint8_t   bank;       /* the double-buffered bank the next packet goes through */
+} PCD_EPTypeDef;
+
+typedef struct
+{
+  PCD_TypeDef             *Instance;
+  PCD_InitTypeDef         Init;
+  __IO uint8_t            USB_Address;
+  PCD_EPTypeDef           IN_ep[8];
+  PCD_EPTypeDef           OUT_ep[8];
+  HAL_LockTypeDef         Lock;
+  uint32_t                Setup[12];
+  void                    *pData;
+} PCD_HandleTypeDef;
+
+HAL_StatusTypeDef HAL_PCD_Init(PCD_HandleTypeDef *hpcd);
+HAL_StatusTypeDef HAL_PCD_DeInit (PCD_HandleTypeDef *hpcd);
+void HAL_PCD_MspInit(PCD_HandleTypeDef *hpcd);
+void HAL_PCD_MspDeInit(PCD_HandleTypeDef *hpcd);
+HAL_StatusTypeDef HAL_PCD_Start(PCD_HandleTypeDef *hpcd);
+HAL_StatusTypeDef HAL_PCD_Stop(PCD_HandleTypeDef *hpcd);
+HAL_StatusTypeDef HAL_PCD_SetAddress(PCD_HandleTypeDef *hpcd, uint8_t address);
+HAL_StatusTypeDef HAL_PCD_EP_Open(PCD_HandleTypeDef *hpcd, uint8_t ep_addr, uint16_t ep_mps, uint8_t ep_type);
+HAL_StatusTypeDef HAL_PCD_EP_Close(PCD_HandleTypeDef *hpcd, uint8_t ep_addr);
+HAL_StatusTypeDef HAL_PCD_EP_Receive(PCD_HandleTypeDef *hpcd, uint8_t ep_addr, uint8_t *pBuf, uint32_t len);
+HAL_StatusTypeDef HAL_PCD_EP_Transmit(PCD_HandleTypeDef *hpcd, uint8_t ep_addr, uint8_t *pBuf, uint32_t len);
+uint16_t HAL_PCD_EP_GetRxCount(PCD_HandleTypeDef *hpcd, uint8_t ep_addr);
+HAL_StatusTypeDef HAL_PCD_EP_SetStall(PCD_HandleTypeDef *hpcd, uint8_t ep_addr);
+HAL_StatusTypeDef HAL_PCD_EP_ClrStall(PCD_HandleTypeDef *hpcd, uint8_t ep_addr);
+HAL_StatusTypeDef HAL_PCD_EP_Flush(PCD_HandleTypeDef *hpcd, uint8_t ep_addr);
+HAL_StatusTypeDef HAL_PCDEx_PMAConfig(PCD_HandleTypeDef *hpcd, uint16_t ep_addr, uint16_t ep_kind, uint32_t pmaadress);
+void PCD_WritePMA(PCD_TypeDef *USBx, uint8_t *pbUsrBuf, uint16_t wPMABufAddr, uint16_t wNBytes);
+void PCD_ReadPMA(PCD_TypeDef *USBx, uint8_t *pbUsrBuf, uint16_t wPMABufAddr, uint16_t wNBytes);
+
+void HAL_PCD_SetupStageCallback(PCD_HandleTypeDef *hpcd);
+void HAL_PCD_DataOutStageCallback(PCD_HandleTypeDef *hpcd, uint8_t epnum);
+void HAL_PCD_DataInStageCallback(PCD_HandleTypeDef *hpcd, uint8_t epnum);
+void HAL_PCD_SOFCallback(PCD_HandleTypeDef *hpcd);
+void HAL_PCD_ResetCallback(PCD_HandleTypeDef *hpcd);
+
+#endif /* __STM32F0xx_HAL_H */
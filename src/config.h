@@ -3,7 +3,50 @@
 
 /*
 adjust these to suit the application
+NUM_OF_CDC_UARTS can be up to 3 (the DMA channels run out after that), but 3 needs double buffering to be disabled
 */
 #define NUM_OF_CDC_UARTS                    2
 
+/*
+double-buffered bulk OUT endpoints let the USB peripheral accept the next packet into a second PMA bank whilst the 
+previous one is still being read; each such endpoint needs an endpoint register to itself, which limits the number of UARTs
+*/
+#define CDC_OUT_DOUBLE_BUFFERED             1
+
+/*
+double-buffered bulk IN endpoints let the next packet be copied into PMA whilst the previous one is on the wire;
+these also need an endpoint register to themselves
+*/
+#define CDC_IN_DOUBLE_BUFFERED              1
+
+#if (NUM_OF_CDC_UARTS > 2) && (CDC_OUT_DOUBLE_BUFFERED || CDC_IN_DOUBLE_BUFFERED)
+#error three UARTs need CDC_OUT_DOUBLE_BUFFERED and CDC_IN_DOUBLE_BUFFERED both set to 0
+#endif
+
+/*
+optionally have DMA1 channel 1 (which none of the UARTs use) copy packets between RAM and PMA for the double-buffered
+data endpoints, in place of the CPU in the USB ISR
+*/
+#define PCD_PMA_DMA                         0
+
+/*
+optionally have usbd_bulk.c move the packets of the CDC data endpoints by working on the endpoint registers directly,
+in place of the HAL's per-packet code; EP0 and the notification endpoints stay with the HAL, and so does opening,
+closing and stalling the data endpoints; this cannot be combined with PCD_PMA_DMA
+*/
+#define USB_BULK_FASTPATH                   1
+
+/*
+optionally give the second UART (USART3) CTS/RTS flow control, on the pins listed for it in UARTconfig in stm32f0xx_hal_msp.c;
+only enable this with both wired to the peer, as CTS has a pull-up and left unconnected would stop the transmitter
+*/
+#ifndef CDC_USART3_HW_FLOW_CONTROL
+#define CDC_USART3_HW_FLOW_CONTROL          0
+#endif
+
+/*
+optionally measure the time spent in each ISR (see isrprofile.h); the results are read with a vendor-specific request
+*/
+#define ISR_PROFILING                       0
+
 #endif /* __CONFIG_H */
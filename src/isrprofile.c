@@ -0,0 +1,68 @@
+/*
+    DMA-accelerated multi-UART USB CDC for STM32F072 microcontroller
+
+    Copyright (C) 2015,2016 Peter Lawrence
+
+    Permission is hereby granted, free of charge, to any person obtaining a 
+    copy of this software and associated documentation files (the "Software"), 
+    to deal in the Software without restriction, including without limitation 
+    the rights to use, copy, modify, merge, publish, distribute, sublicense, 
+    and/or sell copies of the Software, and to permit persons to whom the 
+    Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in 
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+    THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+    DEALINGS IN THE SOFTWARE.
+*/
+
+#include <string.h>
+#include "isrprofile.h"
+
+#if (ISR_PROFILING)
+
+static ISR_ProfileTypeDef profiles[ISR_NUM_OF_PROFILES];
+
+void ISR_Profile_Stop(unsigned id, uint32_t start)
+{
+  ISR_ProfileTypeDef *profile = &profiles[id];
+  uint32_t cycles = ISR_Profile_Now() - start;
+  uint32_t limit = ISR_PROFILE_FIRST_BUCKET;
+  unsigned bucket;
+
+  profile->Count++;
+
+  if ((cycles < profile->Min) || (1 == profile->Count))
+    profile->Min = cycles;
+  if (cycles > profile->Max)
+    profile->Max = cycles;
+
+  profile->TotalLow += cycles;
+  if (profile->TotalLow < cycles)
+    profile->TotalHigh++;
+
+  for (bucket = 0; bucket < (ISR_PROFILE_BUCKETS - 1); bucket++, limit <<= 1)
+    if (cycles < limit)
+      break;
+
+  profile->Histogram[bucket]++;
+}
+
+const ISR_ProfileTypeDef *ISR_Profile_Get(unsigned id)
+{
+  return (id < ISR_NUM_OF_PROFILES) ? &profiles[id] : NULL;
+}
+
+void ISR_Profile_Reset(void)
+{
+  /* a lower-priority ISR that is pre-empted part way through ISR_Profile_Stop() may leave a stray count behind */
+  memset(profiles, 0, sizeof(profiles));
+}
+
+#endif
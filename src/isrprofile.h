@@ -0,0 +1,91 @@
+/*
+    DMA-accelerated multi-UART USB CDC for STM32F072 microcontroller
+
+    Copyright (C) 2015,2016 Peter Lawrence
+
+    Permission is hereby granted, free of charge, to any person obtaining a 
+    copy of this software and associated documentation files (the "Software"), 
+    to deal in the Software without restriction, including without limitation 
+    the rights to use, copy, modify, merge, publish, distribute, sublicense, 
+    and/or sell copies of the Software, and to permit persons to whom the 
+    Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in 
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+    THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+    DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __ISRPROFILE_H_
+#define __ISRPROFILE_H_
+
+#include "stm32f0xx_hal.h"
+#include "config.h"
+
+/*
+optional profiling of the time spent in each ISR; the Cortex-M0 has no cycle counter, so time is measured in CPU 
+cycles by combining the millisecond tick with SysTick's current value (which counts down at the CPU clock)
+the time spent in any higher-priority ISR that pre-empts the one being measured is included in the latter's figures
+*/
+
+/* indices into the profiles, one for each ISR (or code path within one) being measured */
+#define ISR_PROFILE_USB                     0 /* USB_IRQHandler() */
+#define ISR_PROFILE_SOF                     1 /* USBD_CDC_Service(), the per-frame work run from PendSV */
+#define ISR_PROFILE_DMA_PMA                 2 /* DMA1_Channel1_IRQHandler(), if PCD_PMA_DMA is enabled */
+#define ISR_PROFILE_DMA_2_3                 3 /* DMA1_Channel2_3_IRQHandler() */
+#define ISR_PROFILE_DMA_4_7                 4 /* DMA1_Channel4_5_6_7_IRQHandler() */
+#define ISR_PROFILE_USART                   5 /* USART1_IRQHandler() and USART3_4_IRQHandler() */
+#define ISR_NUM_OF_PROFILES                 6
+
+/* histogram bucket n counts calls taking fewer than (ISR_PROFILE_FIRST_BUCKET << n) cycles; the last bucket counts the rest */
+#define ISR_PROFILE_BUCKETS                 8
+#define ISR_PROFILE_FIRST_BUCKET            128
+
+/* struct type used for each profile; this is also the layout returned by CDC_VENDOR_GET_ISR_PROFILE */
+typedef struct
+{
+  uint32_t Count;
+  uint32_t Min;       /* cycles */
+  uint32_t Max;       /* cycles */
+  uint32_t TotalLow;  /* cycles, as a 64-bit value split into two halves */
+  uint32_t TotalHigh;
+  uint32_t Histogram[ISR_PROFILE_BUCKETS];
+} ISR_ProfileTypeDef;
+
+#if (ISR_PROFILING)
+
+static inline uint32_t ISR_Profile_Now(void)
+{
+  uint32_t ms, remaining;
+
+  /* re-read if the tick moved on underneath us, as the two values would then not belong together */
+  do
+  {
+    ms = HAL_GetTick();
+    remaining = SysTick->VAL;
+  } while (ms != HAL_GetTick());
+
+  return ms * (SysTick->LOAD + 1) + (SysTick->LOAD - remaining);
+}
+
+void ISR_Profile_Stop(unsigned id, uint32_t start);
+const ISR_ProfileTypeDef *ISR_Profile_Get(unsigned id);
+void ISR_Profile_Reset(void);
+
+#define ISR_PROFILE_START()                 uint32_t isr_profile_start = ISR_Profile_Now()
+#define ISR_PROFILE_STOP(id)                ISR_Profile_Stop((id), isr_profile_start)
+
+#else
+
+#define ISR_PROFILE_START()
+#define ISR_PROFILE_STOP(id)
+
+#endif
+
+#endif /* __ISRPROFILE_H_ */
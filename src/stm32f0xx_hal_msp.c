@@ -23,6 +23,7 @@
 */
 
 #include "usbd_def.h"
+#include "usbd_cdc.h" /* for the CDC_SERIAL_STATE_* bits */
 
 /* Private typedef -----------------------------------------------------------*/
 typedef void (*do_function)(void);
@@ -35,11 +36,9 @@ static void enable_gpio_b(void) { __GPIOB_CLK_ENABLE(); }
 static void enable_gpio_c(void) { __GPIOC_CLK_ENABLE(); }
 static void enable_gpio_d(void) { __GPIOD_CLK_ENABLE(); }
 static void enable_usart1(void) { __USART1_CLK_ENABLE(); }
-static void enable_usart2(void) { __USART2_CLK_ENABLE(); }
 static void enable_usart3(void) { __USART3_CLK_ENABLE(); }
 static void enable_usart4(void) { __USART4_CLK_ENABLE(); }
 static void release_usart1(void) { __USART1_FORCE_RESET(); __USART1_RELEASE_RESET(); }
-static void release_usart2(void) { __USART2_FORCE_RESET(); __USART2_RELEASE_RESET(); }
 static void release_usart3(void) { __USART3_FORCE_RESET(); __USART3_RELEASE_RESET(); }
 static void release_usart4(void) { __USART4_FORCE_RESET(); __USART4_RELEASE_RESET(); }
 /* Private variables ---------------------------------------------------------*/
@@ -57,22 +56,74 @@ static const struct
   GPIO_TypeDef        *gpio_tx;
   uint32_t            pin_tx;
   uint32_t            af_tx;
+  do_function         enable_cts;
+  GPIO_TypeDef        *gpio_cts; /* NULL if the UART has no CTS pin */
+  uint32_t            pin_cts;
+  uint32_t            af_cts;
+  do_function         enable_rts;
+  GPIO_TypeDef        *gpio_rts; /* NULL if the UART has no RTS pin; this is driven as a GPIO rather than by the USART */
+  uint32_t            pin_rts;
+  do_function         enable_dcd;
+  GPIO_TypeDef        *gpio_dcd; /* NULL if the UART has no DCD input; likewise for DSR and RI, all of which are active low */
+  uint32_t            pin_dcd;
+  do_function         enable_dsr;
+  GPIO_TypeDef        *gpio_dsr;
+  uint32_t            pin_dsr;
+  do_function         enable_ri;
+  GPIO_TypeDef        *gpio_ri;
+  uint32_t            pin_ri;
   DMA_Channel_TypeDef *tx_channel;
   DMA_Channel_TypeDef *rx_channel;
+  uint32_t            dma_remap; /* SYSCFG_CFGR1 bits needed to route the UART's DMA requests to tx_channel and rx_channel */
   IRQn_Type           IRQn;
+  IRQn_Type           usart_IRQn;
 } UARTconfig[] = /* pin assignments for UARTs */
 {
+  /*
+  DMA1 has seven channels, so no more than three UARTs can have both RX and TX DMA at once; USART4 is hard-wired to 
+  channels 6 and 7, so when it is in use, USART3 is remapped to channels 2 and 3 and USART1 in turn to channels 4 and 5
+  */
   {
     USART1, enable_usart1, release_usart1, 
     enable_gpio_a, GPIOA, GPIO_PIN_10, GPIO_AF1_USART1, /* RX pin */
     enable_gpio_a, GPIOA, GPIO_PIN_9, GPIO_AF1_USART1,  /* TX pin */
-    DMA1_Channel2, DMA1_Channel3, DMA1_Channel2_3_IRQn
+    NULL, NULL, 0, 0,                                   /* CTS pin: PA11 is USB DM */
+    NULL, NULL, 0,                                      /* RTS pin: PA12 is USB DP */
+    NULL, NULL, 0,                                      /* DCD pin */
+    NULL, NULL, 0,                                      /* DSR pin */
+    NULL, NULL, 0,                                      /* RI pin */
+#if (NUM_OF_CDC_UARTS > 2)
+    DMA1_Channel4, DMA1_Channel5, SYSCFG_CFGR1_USART1TX_DMA_RMP | SYSCFG_CFGR1_USART1RX_DMA_RMP, DMA1_Channel4_5_6_7_IRQn, USART1_IRQn
+#else
+    DMA1_Channel2, DMA1_Channel3, 0, DMA1_Channel2_3_IRQn, USART1_IRQn
+#endif
   },
   {
     USART3, enable_usart3, release_usart3, 
     enable_gpio_c, GPIOC, GPIO_PIN_5, GPIO_AF1_USART3,  /* RX pin */ 
     enable_gpio_c, GPIOC, GPIO_PIN_4, GPIO_AF1_USART3,  /* TX pin */
-    DMA1_Channel7, DMA1_Channel6, DMA1_Channel4_5_6_7_IRQn
+    enable_gpio_a, GPIOA, GPIO_PIN_6, GPIO_AF4_USART3,  /* CTS pin */
+    enable_gpio_b, GPIOB, GPIO_PIN_1,                   /* RTS pin */
+    NULL, NULL, 0,                                      /* DCD pin */
+    NULL, NULL, 0,                                      /* DSR pin */
+    NULL, NULL, 0,                                      /* RI pin */
+#if (NUM_OF_CDC_UARTS > 2)
+    DMA1_Channel2, DMA1_Channel3, SYSCFG_CFGR1_USART3_DMA_RMP, DMA1_Channel2_3_IRQn, USART3_4_IRQn
+#else
+    DMA1_Channel7, DMA1_Channel6, 0, DMA1_Channel4_5_6_7_IRQn, USART3_4_IRQn
+#endif
+  },
+  {
+    /* on the STM32F072BDISCOVERY PCB, these pins share the user button's de-bouncing circuitry */
+    USART4, enable_usart4, release_usart4, 
+    enable_gpio_a, GPIOA, GPIO_PIN_1, GPIO_AF4_USART4,  /* RX pin */
+    enable_gpio_a, GPIOA, GPIO_PIN_0, GPIO_AF4_USART4,  /* TX pin */
+    enable_gpio_b, GPIOB, GPIO_PIN_7, GPIO_AF4_USART4,  /* CTS pin */
+    enable_gpio_a, GPIOA, GPIO_PIN_15,                  /* RTS pin */
+    NULL, NULL, 0,                                      /* DCD pin */
+    NULL, NULL, 0,                                      /* DSR pin */
+    NULL, NULL, 0,                                      /* RI pin */
+    DMA1_Channel7, DMA1_Channel6, 0, DMA1_Channel4_5_6_7_IRQn, USART3_4_IRQn
   },
 };
 
@@ -115,6 +166,58 @@ void HAL_UART_MspInit(UART_HandleTypeDef *huart)
       HAL_GPIO_Init(UARTconfig[index].gpio_rx, &GPIO_InitStruct);
     }
 
+    if (UART_HWCONTROL_NONE != huart->Init.HwFlowCtl)
+    {
+      /* UART CTS GPIO pin configuration  */
+      if (UARTconfig[index].gpio_cts)
+      {
+        UARTconfig[index].enable_cts();
+        GPIO_InitStruct.Pin       = UARTconfig[index].pin_cts;
+        GPIO_InitStruct.Alternate = UARTconfig[index].af_cts;
+        HAL_GPIO_Init(UARTconfig[index].gpio_cts, &GPIO_InitStruct);
+      }
+
+      /* UART RTS GPIO pin configuration; it starts off asserted (low), as the receive buffer is empty */
+      if (UARTconfig[index].gpio_rts)
+      {
+        UARTconfig[index].enable_rts();
+        HAL_GPIO_WritePin(UARTconfig[index].gpio_rts, UARTconfig[index].pin_rts, GPIO_PIN_RESET);
+        GPIO_InitStruct.Pin       = UARTconfig[index].pin_rts;
+        GPIO_InitStruct.Mode      = GPIO_MODE_OUTPUT_PP;
+        GPIO_InitStruct.Alternate = 0;
+        HAL_GPIO_Init(UARTconfig[index].gpio_rts, &GPIO_InitStruct);
+      }
+    }
+
+    /* modem status inputs, which are polled by HAL_UART_MspLines() */
+    GPIO_InitStruct.Mode      = GPIO_MODE_INPUT;
+    GPIO_InitStruct.Alternate = 0;
+    if (UARTconfig[index].gpio_dcd)
+    {
+      UARTconfig[index].enable_dcd();
+      GPIO_InitStruct.Pin       = UARTconfig[index].pin_dcd;
+      HAL_GPIO_Init(UARTconfig[index].gpio_dcd, &GPIO_InitStruct);
+    }
+    if (UARTconfig[index].gpio_dsr)
+    {
+      UARTconfig[index].enable_dsr();
+      GPIO_InitStruct.Pin       = UARTconfig[index].pin_dsr;
+      HAL_GPIO_Init(UARTconfig[index].gpio_dsr, &GPIO_InitStruct);
+    }
+    if (UARTconfig[index].gpio_ri)
+    {
+      UARTconfig[index].enable_ri();
+      GPIO_InitStruct.Pin       = UARTconfig[index].pin_ri;
+      HAL_GPIO_Init(UARTconfig[index].gpio_ri, &GPIO_InitStruct);
+    }
+
+    /* route the UART's DMA requests to the channels chosen above */
+    if (UARTconfig[index].dma_remap)
+    {
+      __SYSCFG_CLK_ENABLE();
+      SYSCFG->CFGR1 |= UARTconfig[index].dma_remap;
+    }
+
     huart->hdmatx->Instance                 = UARTconfig[index].tx_channel;
     huart->hdmatx->Init.Direction           = DMA_MEMORY_TO_PERIPH;
     huart->hdmatx->Init.PeriphInc           = DMA_PINC_DISABLE;
@@ -137,9 +240,16 @@ void HAL_UART_MspInit(UART_HandleTypeDef *huart)
 
     HAL_DMA_Init(huart->hdmarx);
 
-    /* NVIC configuration for DMA transfer complete interrupt */
-    HAL_NVIC_SetPriority(UARTconfig[index].IRQn, 5 /* hard-coded: customize if needed */, 0);
+    /*
+    NVIC configuration for DMA transfer complete interrupt; the Cortex-M0 has priorities 0 to 3 only, so this must be
+    no higher than 3, below the USB IRQ and level with PendSV (see HAL_PCD_MspInit())
+    */
+    HAL_NVIC_SetPriority(UARTconfig[index].IRQn, 3 /* hard-coded: customize if needed */, 0);
     HAL_NVIC_EnableIRQ(UARTconfig[index].IRQn);
+
+    /* NVIC configuration for the USART's own interrupt (used for IDLE line detection) */
+    HAL_NVIC_SetPriority(UARTconfig[index].usart_IRQn, 3 /* hard-coded: customize if needed */, 0);
+    HAL_NVIC_EnableIRQ(UARTconfig[index].usart_IRQn);
   }
 }
 
@@ -158,5 +268,48 @@ void HAL_UART_MspDeInit(UART_HandleTypeDef *huart)
       HAL_GPIO_DeInit(UARTconfig[index].gpio_tx, UARTconfig[index].pin_tx);
     if (UARTconfig[index].gpio_rx)
       HAL_GPIO_DeInit(UARTconfig[index].gpio_rx, UARTconfig[index].pin_rx);
+    if (UARTconfig[index].gpio_cts && (UART_HWCONTROL_NONE != huart->Init.HwFlowCtl))
+      HAL_GPIO_DeInit(UARTconfig[index].gpio_cts, UARTconfig[index].pin_cts);
+    if (UARTconfig[index].gpio_rts && (UART_HWCONTROL_NONE != huart->Init.HwFlowCtl))
+      HAL_GPIO_DeInit(UARTconfig[index].gpio_rts, UARTconfig[index].pin_rts);
+  }
+}
+
+uint8_t HAL_UART_MspLines(UART_HandleTypeDef *huart)
+{
+  unsigned index;
+  uint8_t lines = 0;
+
+  for (index = 0; index < (sizeof(UARTconfig) / sizeof(*UARTconfig)); index++)
+  {
+    if (UARTconfig[index].Instance != huart->Instance)
+      continue;
+
+    if (UARTconfig[index].gpio_dcd && (GPIO_PIN_RESET == HAL_GPIO_ReadPin(UARTconfig[index].gpio_dcd, UARTconfig[index].pin_dcd)))
+      lines |= CDC_SERIAL_STATE_DCD;
+    if (UARTconfig[index].gpio_dsr && (GPIO_PIN_RESET == HAL_GPIO_ReadPin(UARTconfig[index].gpio_dsr, UARTconfig[index].pin_dsr)))
+      lines |= CDC_SERIAL_STATE_DSR;
+    if (UARTconfig[index].gpio_ri && (GPIO_PIN_RESET == HAL_GPIO_ReadPin(UARTconfig[index].gpio_ri, UARTconfig[index].pin_ri)))
+      lines |= CDC_SERIAL_STATE_RING;
+  }
+
+  return lines;
+}
+
+void HAL_UART_MspRTS(UART_HandleTypeDef *huart, uint8_t ready)
+{
+  unsigned index;
+
+  if (UART_HWCONTROL_NONE == huart->Init.HwFlowCtl)
+    return;
+
+  for (index = 0; index < (sizeof(UARTconfig) / sizeof(*UARTconfig)); index++)
+  {
+    if (UARTconfig[index].Instance != huart->Instance)
+      continue;
+
+    /* RTS is active low */
+    if (UARTconfig[index].gpio_rts)
+      HAL_GPIO_WritePin(UARTconfig[index].gpio_rts, UARTconfig[index].pin_rts, ready ? GPIO_PIN_RESET : GPIO_PIN_SET);
   }
 }
@@ -73,6 +73,8 @@
 
 /* Includes ------------------------------------------------------------------*/
 #include "stm32f0xx_hal.h"
+#include "config.h"
+#include "usbd_bulk.h"
 
 #ifdef HAL_PCD_MODULE_ENABLED
 
@@ -99,14 +101,30 @@
   */ 
   
 /* Private macro -------------------------------------------------------------*/
+#if (PCD_PMA_DMA)
+#define PCD_DMA_CHANNEL         DMA1_Channel1
+#define PCD_DMA_IFCR_CGIF       DMA_IFCR_CGIF1
+/* dma_queue bit (and dma_active value) for an endpoint's copy: IN endpoints are 1 to 7, OUT endpoints 9 to 15 */
+#define PCD_DMA_JOB(ep)         ((ep)->num + ((ep)->is_in ? 0 : 8))
+#endif
 /* Private variables ---------------------------------------------------------*/
 /* Private function prototypes -----------------------------------------------*/
 /** @defgroup PCD_Private_Functions PCD Private Functions
   * @{
   */
 static HAL_StatusTypeDef PCD_EP_ISR_Handler(PCD_HandleTypeDef *hpcd);
-void PCD_WritePMA(USB_TypeDef  *USBx, uint8_t *pbUsrBuf, uint16_t wPMABufAddr, uint16_t wNBytes);
-void PCD_ReadPMA(USB_TypeDef  *USBx, uint8_t *pbUsrBuf, uint16_t wPMABufAddr, uint16_t wNBytes);
+static void PCD_EP_OUT_Complete(PCD_HandleTypeDef *hpcd, PCD_EPTypeDef *ep, uint16_t count);
+static void PCD_DBUF_OUT_Claim(PCD_HandleTypeDef *hpcd, PCD_EPTypeDef *ep);
+static void PCD_DBUF_OUT_Deferred(PCD_HandleTypeDef *hpcd);
+static void PCD_DBUF_IN_Stage(PCD_HandleTypeDef *hpcd, PCD_EPTypeDef *ep);
+static void PCD_DBUF_IN_Fill(PCD_HandleTypeDef *hpcd, PCD_EPTypeDef *ep);
+static void PCD_DBUF_IN_Acknowledge(PCD_HandleTypeDef *hpcd, PCD_EPTypeDef *ep);
+#if (PCD_PMA_DMA)
+static void PCD_DMA_Queue(PCD_HandleTypeDef *hpcd, PCD_EPTypeDef *ep, uint8_t *buff, uint16_t pmaaddr, uint16_t count);
+static void PCD_DMA_Start(PCD_HandleTypeDef *hpcd);
+static void PCD_DMA_Service(PCD_HandleTypeDef *hpcd);
+static void PCD_DMA_Cancel(PCD_HandleTypeDef *hpcd, PCD_EPTypeDef *ep);
+#endif
 /**
   * @}
   */ 
@@ -412,6 +430,14 @@ static HAL_StatusTypeDef PCD_EP_ISR_Handler(PCD_HandleTypeDef *hpcd)
       
       /* Decode and service non control endpoints interrupt  */
       
+#if (USB_BULK_FASTPATH)
+      /* the endpoints claimed by usbd_bulk.c are serviced there, straight from the endpoint register */
+      if (USBD_Bulk_CTR(hpcd, EPindex))
+      {
+        continue;
+      }
+#endif
+
       /* process related endpoint register */
       wEPVal = PCD_GET_ENDPOINT(hpcd->Instance, EPindex);
       if ((wEPVal & USB_EP_CTR_RX) != 0)
@@ -428,41 +454,19 @@ static HAL_StatusTypeDef PCD_EP_ISR_Handler(PCD_HandleTypeDef *hpcd)
           {
             PCD_ReadPMA(hpcd->Instance, ep->xfer_buff, ep->pmaadress, count);
           }
+          PCD_EP_OUT_Complete(hpcd, ep, count);
         }
-        else
-        {
-          if (PCD_GET_ENDPOINT(hpcd->Instance, ep->num) & USB_EP_DTOG_RX)
-          {
-            /*read from endpoint BUF0Addr buffer*/
-            count = PCD_GET_EP_DBUF0_CNT(hpcd->Instance, ep->num);
-            if (count != 0)
-            {
-              PCD_ReadPMA(hpcd->Instance, ep->xfer_buff, ep->pmaaddr0, count);
-            }
-          }
-          else
-          {
-            /*read from endpoint BUF1Addr buffer*/
-            count = PCD_GET_EP_DBUF1_CNT(hpcd->Instance, ep->num);
-            if (count != 0)
-            {
-              PCD_ReadPMA(hpcd->Instance, ep->xfer_buff, ep->pmaaddr1, count);
-            }
-          }
-          PCD_FreeUserBuffer(hpcd->Instance, ep->num, PCD_EP_DBUF_OUT);  
-        }
-        /*multi-packet on the NON control OUT endpoint*/
-        ep->xfer_count+=count;
-        ep->xfer_buff+=count;
-       
-        if ((ep->xfer_len == 0) || (count < ep->maxpacket))
+        else if (ep->xfer_armed)
         {
-          /* RX COMPLETE */
-          HAL_PCD_DataOutStageCallback(hpcd, ep->num);
+          PCD_DBUF_OUT_Claim(hpcd, ep);
         }
         else
         {
-          HAL_PCD_EP_Receive(hpcd, ep->num, ep->xfer_buff, ep->xfer_len);
+          /*
+          nowhere to put the packet yet: leave it in its PMA bank (the peripheral NAKs further packets until the bank is 
+          claimed) and let HAL_PCD_EP_Receive() arrange for it to be delivered
+          */
+          ep->dbuf_pending = 1;
         }
         
       } /* if((wEPVal & EP_CTR_RX) */
@@ -482,48 +486,362 @@ static HAL_StatusTypeDef PCD_EP_ISR_Handler(PCD_HandleTypeDef *hpcd)
           {
             PCD_WritePMA(hpcd->Instance, ep->xfer_buff, ep->pmaadress, ep->xfer_count);
           }
-        }
-        else
-        {
-          if (PCD_GET_ENDPOINT(hpcd->Instance, ep->num) & USB_EP_DTOG_TX)
+
+          /*multi-packet on the NON control IN endpoint*/
+          ep->xfer_count = PCD_GET_EP_TX_CNT(hpcd->Instance, ep->num);
+          ep->xfer_buff+=ep->xfer_count;
+         
+          /* Zero Length Packet? */
+          if (ep->xfer_len == 0)
           {
-            /*read from endpoint BUF0Addr buffer*/
-            ep->xfer_count = PCD_GET_EP_DBUF0_CNT(hpcd->Instance, ep->num);
-            if (ep->xfer_count != 0)
-            {
-              PCD_WritePMA(hpcd->Instance, ep->xfer_buff, ep->pmaaddr0, ep->xfer_count);
-            }
+            /* TX COMPLETE */
+            HAL_PCD_DataInStageCallback(hpcd, ep->num);
           }
           else
           {
-            /*read from endpoint BUF1Addr buffer*/
-            ep->xfer_count = PCD_GET_EP_DBUF1_CNT(hpcd->Instance, ep->num);
-            if (ep->xfer_count != 0)
-            {
-              PCD_WritePMA(hpcd->Instance, ep->xfer_buff, ep->pmaaddr1, ep->xfer_count);
-            }
+            HAL_PCD_EP_Transmit(hpcd, ep->num, ep->xfer_buff, ep->xfer_len);
           }
-          PCD_FreeUserBuffer(hpcd->Instance, ep->num, PCD_EP_DBUF_IN);  
-        }
-        /*multi-packet on the NON control IN endpoint*/
-        ep->xfer_count = PCD_GET_EP_TX_CNT(hpcd->Instance, ep->num);
-        ep->xfer_buff+=ep->xfer_count;
-       
-        /* Zero Length Packet? */
-        if (ep->xfer_len == 0)
-        {
-          /* TX COMPLETE */
-          HAL_PCD_DataInStageCallback(hpcd, ep->num);
         }
         else
         {
-          HAL_PCD_EP_Transmit(hpcd, ep->num, ep->xfer_buff, ep->xfer_len);
+          PCD_DBUF_IN_Acknowledge(hpcd, ep);
         }
       } 
     }
   }
   return HAL_OK;
 }
+
+/**
+  * @brief  Account for a packet read from a non-control OUT endpoint, and either complete or continue the transfer.
+  * @param  hpcd: PCD handle
+  * @param  ep: endpoint
+  * @param  count: size of the packet just read
+  * @retval None
+  */
+static void PCD_EP_OUT_Complete(PCD_HandleTypeDef *hpcd, PCD_EPTypeDef *ep, uint16_t count)
+{
+  /*multi-packet on the NON control OUT endpoint*/
+  ep->xfer_count+=count;
+  ep->xfer_buff+=count;
+ 
+  if ((ep->xfer_len == 0) || (count < ep->maxpacket))
+  {
+    /* RX COMPLETE */
+    HAL_PCD_DataOutStageCallback(hpcd, ep->num);
+  }
+  else
+  {
+    HAL_PCD_EP_Receive(hpcd, ep->num, ep->xfer_buff, ep->xfer_len);
+  }
+}
+
+/**
+  * @brief  Claim the PMA bank most recently filled on a double buffered OUT endpoint, copy it to the transfer buffer,
+  *         and complete or continue the transfer.
+  * @note   Ownership is handed over before the copy, so the peripheral can accept the next packet into the other bank
+  *         whilst this one is being read.  With PCD_PMA_DMA, the copy (and so the rest) may finish in PCD_DMA_Service().
+  * @param  hpcd: PCD handle
+  * @param  ep: endpoint
+  * @retval None
+  */
+static void PCD_DBUF_OUT_Claim(PCD_HandleTypeDef *hpcd, PCD_EPTypeDef *ep)
+{
+  uint16_t count, pmaaddr;
+
+  ep->xfer_armed = 0;
+  ep->dbuf_pending = 0;
+
+  /* toggle SW_BUF: the bank we had drained goes back to the peripheral, and the freshly filled one becomes ours */
+  PCD_FreeUserBuffer(hpcd->Instance, ep->num, PCD_EP_DBUF_OUT);
+
+  /* SW_BUF (DTOG_TX on an OUT endpoint) now identifies the bank holding the packet */
+  if (PCD_GET_ENDPOINT(hpcd->Instance, ep->num) & USB_EP_DTOG_TX)
+  {
+    /*read from endpoint BUF1Addr buffer*/
+    count = PCD_GET_EP_DBUF1_CNT(hpcd->Instance, ep->num);
+    pmaaddr = ep->pmaaddr1;
+  }
+  else
+  {
+    /*read from endpoint BUF0Addr buffer*/
+    count = PCD_GET_EP_DBUF0_CNT(hpcd->Instance, ep->num);
+    pmaaddr = ep->pmaaddr0;
+  }
+
+#if (PCD_PMA_DMA)
+  /* the channel moves halfwords, so it needs a halfword aligned buffer */
+  if ((count >= 2) && (0 == ((uint32_t)ep->xfer_buff & 1)))
+  {
+    PCD_DMA_Queue(hpcd, ep, ep->xfer_buff, pmaaddr, count);
+    return;
+  }
+#endif
+
+  if (count != 0)
+  {
+    PCD_ReadPMA(hpcd->Instance, ep->xfer_buff, pmaaddr, count);
+  }
+
+  PCD_EP_OUT_Complete(hpcd, ep, count);
+}
+
+/**
+  * @brief  Deliver packets that reached a double buffered OUT endpoint before a reception was requested.
+  * @param  hpcd: PCD handle
+  * @retval None
+  */
+static void PCD_DBUF_OUT_Deferred(PCD_HandleTypeDef *hpcd)
+{
+  PCD_EPTypeDef *ep;
+  uint8_t EPindex;
+
+  for (EPindex = 1; hpcd->dbuf_deferred; EPindex++)
+  {
+    if (0 == (hpcd->dbuf_deferred & (1UL << EPindex)))
+      continue;
+
+    hpcd->dbuf_deferred &= ~(1UL << EPindex);
+    ep = &hpcd->OUT_ep[EPindex];
+
+    if (ep->xfer_armed && ep->dbuf_pending)
+      PCD_DBUF_OUT_Claim(hpcd, ep);
+  }
+}
+
+/**
+  * @brief  Copy the next packet of an IN transfer into the PMA bank owned by firmware, ready to be handed over.
+  * @note   The caller must ensure that the bank is not already staged, and (with PCD_PMA_DMA) that no copy is still 
+  *         queued for the endpoint.
+  * @param  hpcd: PCD handle
+  * @param  ep: endpoint
+  * @retval None
+  */
+static void PCD_DBUF_IN_Stage(PCD_HandleTypeDef *hpcd, PCD_EPTypeDef *ep)
+{
+  uint16_t len, pmaaddr;
+
+  /*Multi packet transfer*/
+  if (ep->xfer_len > ep->maxpacket)
+  {
+    len = ep->maxpacket;
+  }
+  else
+  {
+    len = ep->xfer_len;
+  }
+  ep->xfer_len -= len;
+
+  /* SW_BUF (DTOG_RX on an IN endpoint) identifies the bank firmware may write */
+  if (PCD_GET_ENDPOINT(hpcd->Instance, ep->num) & USB_EP_DTOG_RX)
+  {
+    /*write to endpoint BUF1Addr buffer*/
+    pmaaddr = ep->pmaaddr1;
+    PCD_SET_EP_DBUF1_CNT(hpcd->Instance, ep->num, PCD_EP_DBUF_IN, len);
+  }
+  else
+  {
+    /*write to endpoint BUF0Addr buffer*/
+    pmaaddr = ep->pmaaddr0;
+    PCD_SET_EP_DBUF0_CNT(hpcd->Instance, ep->num, PCD_EP_DBUF_IN, len);
+  }
+
+#if (PCD_PMA_DMA)
+  /* the channel moves halfwords, so it needs a halfword aligned buffer; the bank is staged once it is done */
+  if ((len >= 2) && (0 == ((uint32_t)ep->xfer_buff & 1)))
+  {
+    PCD_DMA_Queue(hpcd, ep, ep->xfer_buff, pmaaddr, len);
+    ep->xfer_buff += len;
+    ep->xfer_count += len;
+    return;
+  }
+#endif
+
+  PCD_WritePMA(hpcd->Instance, ep->xfer_buff, pmaaddr, len);
+
+  ep->xfer_buff += len;
+  ep->xfer_count += len;
+
+  ep->dbuf_staged = 1;
+}
+
+/**
+  * @brief  Hand the staged bank to the peripheral if it has none, and stage the next packet in the other bank.
+  * @param  hpcd: PCD handle
+  * @param  ep: endpoint
+  * @retval None
+  */
+static void PCD_DBUF_IN_Fill(PCD_HandleTypeDef *hpcd, PCD_EPTypeDef *ep)
+{
+  /*
+  the peripheral NAKs whilst DTOG_TX equals SW_BUF, and sends the bank DTOG_TX selects otherwise; as it keeps no other
+  record of which banks are ready, only one can be handed over at a time (toggling SW_BUF twice would take both back),
+  so the next packet is only staged in PMA, and SW_BUF toggled for it once CTR_TX has returned the bank before it
+  */
+  for (;;)
+  {
+    if (ep->dbuf_staged && (0 == ep->dbuf_inflight))
+    {
+      /* toggle SW_BUF: the staged bank goes to the peripheral, and firmware may start on the other one */
+      PCD_FreeUserBuffer(hpcd->Instance, ep->num, PCD_EP_DBUF_IN);
+      ep->dbuf_staged = 0;
+      ep->dbuf_inflight = 1;
+    }
+
+    if ((0 == ep->xfer_len) || ep->dbuf_staged || ep->dma_count)
+    {
+      break;
+    }
+
+    PCD_DBUF_IN_Stage(hpcd, ep);
+  }
+}
+
+/**
+  * @brief  Service a CTR_TX on a double buffered IN endpoint: stage further packets and complete the transfer when done.
+  * @param  hpcd: PCD handle
+  * @param  ep: endpoint
+  * @retval None
+  */
+static void PCD_DBUF_IN_Acknowledge(PCD_HandleTypeDef *hpcd, PCD_EPTypeDef *ep)
+{
+  /* the peripheral only ever holds one bank, so CTR_TX means it has been sent */
+  ep->dbuf_inflight = 0;
+
+  PCD_DBUF_IN_Fill(hpcd, ep);
+
+  /* a bank still being filled by the DMA channel is part of the transfer all the same */
+  if (ep->xfer_armed && (0 == ep->dbuf_inflight) && (0 == ep->dma_count))
+  {
+    ep->xfer_armed = 0;
+
+    /* TX COMPLETE */
+    HAL_PCD_DataInStageCallback(hpcd, ep->num);
+  }
+}
+
+#if (PCD_PMA_DMA)
+/**
+  * @brief  Queue a copy between RAM and PMA for the DMA channel, starting it if the channel is idle.
+  * @note   The channel moves halfwords; an odd byte at the end is left to the CPU.
+  * @param  hpcd: PCD handle
+  * @param  ep: endpoint (an IN endpoint copies RAM to PMA, an OUT endpoint PMA to RAM)
+  * @param  buff: halfword aligned RAM buffer
+  * @param  pmaaddr: address into PMA
+  * @param  count: no. of bytes to be copied (at least two)
+  * @retval None
+  */
+static void PCD_DMA_Queue(PCD_HandleTypeDef *hpcd, PCD_EPTypeDef *ep, uint8_t *buff, uint16_t pmaaddr, uint16_t count)
+{
+  if (ep->is_in && (count & 1))
+  {
+    /* the last halfword of the packet is written now, as the channel will stop short of it */
+    PCD_WritePMA(hpcd->Instance, buff + count - 1, pmaaddr + count - 1, 1);
+  }
+
+  ep->dma_buff = buff;
+  ep->dma_pmaaddr = pmaaddr;
+  ep->dma_count = count;
+
+  hpcd->dma_queue |= (1UL << PCD_DMA_JOB(ep));
+
+  if (0 == hpcd->dma_active)
+  {
+    PCD_DMA_Start(hpcd);
+  }
+}
+
+/**
+  * @brief  Program the DMA channel with the next queued copy, if any.
+  * @param  hpcd: PCD handle
+  * @retval None
+  */
+static void PCD_DMA_Start(PCD_HandleTypeDef *hpcd)
+{
+  PCD_EPTypeDef *ep;
+  uint8_t job;
+
+  PCD_DMA_CHANNEL->CCR = 0;
+
+  if (0 == hpcd->dma_queue)
+  {
+    hpcd->dma_active = 0;
+    return;
+  }
+
+  for (job = 1; 0 == (hpcd->dma_queue & (1UL << job)); job++);
+
+  hpcd->dma_queue &= ~(1UL << job);
+  hpcd->dma_active = job;
+  ep = (job < 8) ? &hpcd->IN_ep[job] : &hpcd->OUT_ep[job - 8];
+
+  PCD_DMA_CHANNEL->CPAR = (uint32_t)hpcd->Instance + 0x400 + ep->dma_pmaaddr;
+  PCD_DMA_CHANNEL->CMAR = (uint32_t)ep->dma_buff;
+  PCD_DMA_CHANNEL->CNDTR = ep->dma_count >> 1;
+
+  /* memory to memory in halfwords, with the PMA as the "peripheral" side; DIR makes it the destination */
+  PCD_DMA_CHANNEL->CCR = DMA_CCR_MEM2MEM | DMA_CCR_PSIZE_0 | DMA_CCR_MSIZE_0 | DMA_CCR_PINC | DMA_CCR_MINC | 
+                         DMA_CCR_TCIE | ((ep->is_in) ? DMA_CCR_DIR : 0) | DMA_CCR_EN;
+}
+
+/**
+  * @brief  Finish the copy done by the DMA channel, if it is done: hand an IN bank to the peripheral, or deliver an
+  *         OUT packet, just as the CPU copy would have done.
+  * @param  hpcd: PCD handle
+  * @retval None
+  */
+static void PCD_DMA_Service(PCD_HandleTypeDef *hpcd)
+{
+  PCD_EPTypeDef *ep;
+  uint8_t job = hpcd->dma_active;
+  uint16_t count;
+
+  if ((0 == job) || (PCD_DMA_CHANNEL->CNDTR != 0))
+  {
+    return;
+  }
+
+  ep = (job < 8) ? &hpcd->IN_ep[job] : &hpcd->OUT_ep[job - 8];
+  count = ep->dma_count;
+  ep->dma_count = 0;
+
+  /* get the channel going on the next copy before finishing off this one */
+  PCD_DMA_Start(hpcd);
+
+  if (ep->is_in)
+  {
+    /* the bank the channel has just filled goes to the peripheral now, or once CTR_TX has returned the other one */
+    ep->dbuf_staged = 1;
+    PCD_DBUF_IN_Fill(hpcd, ep);
+  }
+  else
+  {
+    if (count & 1)
+    {
+      PCD_ReadPMA(hpcd->Instance, ep->dma_buff + count - 1, ep->dma_pmaaddr + count - 1, 1);
+    }
+    PCD_EP_OUT_Complete(hpcd, ep, count);
+  }
+}
+
+/**
+  * @brief  Discard any copy queued for (or being done on behalf of) an endpoint that is being closed.
+  * @param  hpcd: PCD handle
+  * @param  ep: endpoint
+  * @retval None
+  */
+static void PCD_DMA_Cancel(PCD_HandleTypeDef *hpcd, PCD_EPTypeDef *ep)
+{
+  hpcd->dma_queue &= ~(1UL << PCD_DMA_JOB(ep));
+
+  if (hpcd->dma_active == PCD_DMA_JOB(ep))
+  {
+    PCD_DMA_Start(hpcd);
+  }
+
+  ep->dma_count = 0;
+}
+#endif
 /**
   * @}
   */
@@ -545,6 +863,22 @@ void HAL_PCD_IRQHandler(PCD_HandleTypeDef *hpcd)
 {
   uint32_t wInterrupt_Mask = 0;
   
+#if (PCD_PMA_DMA)
+  /* HAL_PCD_DMA_IRQHandler() pends this interrupt when the channel finishes a copy */
+  PCD_DMA_Service(hpcd);
+#endif
+
+  if (hpcd->dbuf_deferred)
+  {
+    /* packets left waiting in PMA for HAL_PCD_EP_Receive(), which pended this interrupt to have them delivered */
+    PCD_DBUF_OUT_Deferred(hpcd);
+  }
+
+#if (USB_BULK_FASTPATH)
+  /* likewise for the endpoints that usbd_bulk.c looks after */
+  USBD_Bulk_Deferred(hpcd);
+#endif
+
   if (__HAL_PCD_GET_FLAG (hpcd, USB_ISTR_CTR))
   {
     /* servicing of the endpoint correct transfer interrupt */
@@ -614,6 +948,20 @@ void HAL_PCD_IRQHandler(PCD_HandleTypeDef *hpcd)
   }
 }
 
+/**
+  * @brief  This function handles the interrupt of the DMA channel used by PCD_PMA_DMA.
+  * @note   Finished copies are dealt with by HAL_PCD_IRQHandler(), which owns all of the endpoint state.
+  * @param  hpcd: PCD handle
+  * @retval None
+  */
+void HAL_PCD_DMA_IRQHandler(PCD_HandleTypeDef *hpcd)
+{
+#if (PCD_PMA_DMA)
+  DMA1->IFCR = PCD_DMA_IFCR_CGIF;
+  NVIC_SetPendingIRQ(USB_IRQn);
+#endif
+}
+
 /**
   * @brief  Data out stage callbacks
   * @param  hpcd: PCD handle
@@ -901,6 +1249,12 @@ HAL_StatusTypeDef HAL_PCD_EP_Open(PCD_HandleTypeDef *hpcd, uint8_t ep_addr, uint
     
     if (ep->is_in==0)
     {
+      /* both banks receive up to a full packet */
+      PCD_SET_EP_DBUF_CNT(hpcd->Instance, ep->num, PCD_EP_DBUF_OUT, ep->maxpacket);
+      ep->xfer_armed = 0;
+      ep->dbuf_pending = 0;
+      hpcd->dbuf_deferred &= ~(1UL << ep->num);
+
       /* Clear the data toggle bits for the endpoint IN/OUT*/
       PCD_CLEAR_RX_DTOG(hpcd->Instance, ep->num);
       PCD_CLEAR_TX_DTOG(hpcd->Instance, ep->num);
@@ -913,12 +1267,17 @@ HAL_StatusTypeDef HAL_PCD_EP_Open(PCD_HandleTypeDef *hpcd, uint8_t ep_addr, uint
     }
     else
     {
-      /* Clear the data toggle bits for the endpoint IN/OUT*/
+      ep->xfer_armed = 0;
+      ep->dbuf_inflight = 0;
+      ep->dbuf_staged = 0;
+
+      /*
+      Clear the data toggle bits for the endpoint IN/OUT; with DTOG_TX equal to SW_BUF, firmware owns the bank the 
+      peripheral would send next, so the endpoint can be VALID and still NAK until HAL_PCD_EP_Transmit() hands a bank over
+      */
       PCD_CLEAR_RX_DTOG(hpcd->Instance, ep->num);
       PCD_CLEAR_TX_DTOG(hpcd->Instance, ep->num);
-      PCD_RX_DTOG(hpcd->Instance, ep->num);
-      /* Configure DISABLE status for the Endpoint*/
-      PCD_SET_EP_TX_STATUS(hpcd->Instance, ep->num, USB_EP_TX_DIS);
+      PCD_SET_EP_TX_STATUS(hpcd->Instance, ep->num, USB_EP_TX_VALID);
       PCD_SET_EP_RX_STATUS(hpcd->Instance, ep->num, USB_EP_RX_DIS);
     }
   } 
@@ -976,6 +1335,14 @@ HAL_StatusTypeDef HAL_PCD_EP_Close(PCD_HandleTypeDef *hpcd, uint8_t ep_addr)
       PCD_CLEAR_RX_DTOG(hpcd->Instance, ep->num);
       PCD_CLEAR_TX_DTOG(hpcd->Instance, ep->num);
       
+      /* forget any packet left waiting in PMA */
+#if (PCD_PMA_DMA)
+      PCD_DMA_Cancel(hpcd, ep);
+#endif
+      ep->xfer_armed = 0;
+      ep->dbuf_pending = 0;
+      hpcd->dbuf_deferred &= ~(1UL << ep->num);
+
       /* Reset value of the data toggle bits for the endpoint out*/
       PCD_TX_DTOG(hpcd->Instance, ep->num);
       
@@ -984,10 +1351,17 @@ HAL_StatusTypeDef HAL_PCD_EP_Close(PCD_HandleTypeDef *hpcd, uint8_t ep_addr)
     }
     else
     {
+      /* abandon any transmission still under way */
+#if (PCD_PMA_DMA)
+      PCD_DMA_Cancel(hpcd, ep);
+#endif
+      ep->xfer_armed = 0;
+      ep->dbuf_inflight = 0;
+      ep->dbuf_staged = 0;
+
       /* Clear the data toggle bits for the endpoint IN/OUT*/
       PCD_CLEAR_RX_DTOG(hpcd->Instance, ep->num);
       PCD_CLEAR_TX_DTOG(hpcd->Instance, ep->num);
-      PCD_RX_DTOG(hpcd->Instance, ep->num);
       /* Configure DISABLE status for the Endpoint*/
       PCD_SET_EP_TX_STATUS(hpcd->Instance, ep->num, USB_EP_TX_DIS);
       PCD_SET_EP_RX_STATUS(hpcd->Instance, ep->num, USB_EP_RX_DIS);
@@ -1040,15 +1414,24 @@ HAL_StatusTypeDef HAL_PCD_EP_Receive(PCD_HandleTypeDef *hpcd, uint8_t ep_addr, u
   {
     /*Set RX buffer count*/
     PCD_SET_EP_RX_CNT(hpcd->Instance, ep->num, len);
+    PCD_SET_EP_RX_STATUS(hpcd->Instance, ep->num, USB_EP_RX_VALID);
   }
   else
   {
-    /*Set the Double buffer counter*/
-    PCD_SET_EP_DBUF1_CNT(hpcd->Instance, ep->num, ep->is_in, len);
+    /*
+    both bank counters were set by HAL_PCD_EP_Open() and the endpoint stays VALID, with flow control done by
+    SW_BUF ownership; all that is needed is to note that there is now somewhere to put the next packet
+    */
+    ep->xfer_armed = 1;
+
+    if (ep->dbuf_pending)
+    {
+      /* a packet is already waiting in PMA; have the USB ISR deliver it, as the upper layer expects */
+      hpcd->dbuf_deferred |= (1UL << ep->num);
+      NVIC_SetPendingIRQ(USB_IRQn);
+    }
   } 
   
-  PCD_SET_EP_RX_STATUS(hpcd->Instance, ep->num, USB_EP_RX_VALID);
-  
   __HAL_UNLOCK(hpcd); 
   
   return HAL_OK;
@@ -1075,7 +1458,6 @@ uint16_t HAL_PCD_EP_GetRxCount(PCD_HandleTypeDef *hpcd, uint8_t ep_addr)
 HAL_StatusTypeDef HAL_PCD_EP_Transmit(PCD_HandleTypeDef *hpcd, uint8_t ep_addr, uint8_t *pBuf, uint32_t len)
 {
   PCD_EPTypeDef *ep;
-  uint16_t pmabuffer = 0;
     
   ep = &hpcd->IN_ep[ep_addr & 0x7F];
   
@@ -1088,44 +1470,37 @@ HAL_StatusTypeDef HAL_PCD_EP_Transmit(PCD_HandleTypeDef *hpcd, uint8_t ep_addr,
   
   __HAL_LOCK(hpcd); 
   
-  /*Multi packet transfer*/
-  if (ep->xfer_len > ep->maxpacket)
-  {
-    len=ep->maxpacket;
-    ep->xfer_len-=len; 
-  }
-  else
-  {  
-    len=ep->xfer_len;
-    ep->xfer_len =0;
-  }
-  
   /* configure and validate Tx endpoint */
   if (ep->doublebuffer == 0) 
   {
+    /*Multi packet transfer*/
+    if (ep->xfer_len > ep->maxpacket)
+    {
+      len=ep->maxpacket;
+      ep->xfer_len-=len; 
+    }
+    else
+    {  
+      len=ep->xfer_len;
+      ep->xfer_len =0;
+    }
+
     PCD_WritePMA(hpcd->Instance, ep->xfer_buff, ep->pmaadress, len);
     PCD_SET_EP_TX_CNT(hpcd->Instance, ep->num, len);
+    PCD_SET_EP_TX_STATUS(hpcd->Instance, ep->num, USB_EP_TX_VALID);
   }
   else
   {
-    /*Set the Double buffer counter*/
-    PCD_SET_EP_DBUF1_CNT(hpcd->Instance, ep->num, ep->is_in, len);
-    
-    /*Write the data to the USB endpoint*/
-    if (PCD_GET_ENDPOINT(hpcd->Instance, ep->num)& USB_EP_DTOG_TX)
-    {
-      pmabuffer = ep->pmaaddr1;
-    }
-    else
-    {
-      pmabuffer = ep->pmaaddr0;
-    }
-    PCD_WritePMA(hpcd->Instance, ep->xfer_buff, pmabuffer, len);
-    PCD_FreeUserBuffer(hpcd->Instance, ep->num, ep->is_in);
+    /*
+    the endpoint was left VALID by HAL_PCD_EP_Open(), with flow control done by SW_BUF ownership; stage the first 
+    packet (which may be zero length) and hand it over and, if there is more, stage the second one too, so that it is
+    already in PMA whilst the first is on the wire; PCD_DBUF_IN_Acknowledge() keeps this going until the transfer is done
+    */
+    ep->xfer_armed = 1;
+    PCD_DBUF_IN_Stage(hpcd, ep);
+    PCD_DBUF_IN_Fill(hpcd, ep);
   }
 
-  PCD_SET_EP_TX_STATUS(hpcd->Instance, ep->num, USB_EP_TX_VALID);
-  
   __HAL_UNLOCK(hpcd);
      
   return HAL_OK;
@@ -1202,7 +1577,35 @@ HAL_StatusTypeDef HAL_PCD_EP_ClrStall(PCD_HandleTypeDef *hpcd, uint8_t ep_addr)
   
   __HAL_LOCK(hpcd); 
   
-  if (ep->is_in)
+  if (ep->doublebuffer)
+  {
+    /*
+    the data toggle goes back to DATA0, and on a double buffered endpoint DTOG also picks the bank the peripheral uses
+    next, so SW_BUF has to go back with it: both are left just as HAL_PCD_EP_Open() leaves them, and with them goes any
+    transfer under way, as the host has discarded it along with the halt
+    */
+    ep->xfer_armed = 0;
+    PCD_CLEAR_RX_DTOG(hpcd->Instance, ep->num);
+    PCD_CLEAR_TX_DTOG(hpcd->Instance, ep->num);
+
+    if (ep->is_in)
+    {
+#if (PCD_PMA_DMA)
+      PCD_DMA_Cancel(hpcd, ep);
+#endif
+      ep->dbuf_inflight = 0;
+      ep->dbuf_staged = 0;
+      PCD_SET_EP_TX_STATUS(hpcd->Instance, ep->num, USB_EP_TX_VALID);
+    }
+    else
+    {
+      ep->dbuf_pending = 0;
+      hpcd->dbuf_deferred &= ~(1UL << ep->num);
+      PCD_TX_DTOG(hpcd->Instance, ep->num);
+      PCD_SET_EP_RX_STATUS(hpcd->Instance, ep->num, USB_EP_RX_VALID);
+    }
+  }
+  else if (ep->is_in)
   {
     PCD_CLEAR_TX_DTOG(hpcd->Instance, ep->num);
     PCD_SET_EP_TX_STATUS(hpcd->Instance, ep->num, USB_EP_TX_VALID);
@@ -1270,19 +1673,56 @@ HAL_StatusTypeDef HAL_PCD_DeActiveRemoteWakeup(PCD_HandleTypeDef *hpcd)
   */
 void PCD_WritePMA(USB_TypeDef  *USBx, uint8_t *pbUsrBuf, uint16_t wPMABufAddr, uint16_t wNBytes)
 {
-  uint32_t n = (wNBytes + 1) >> 1; 
-  uint32_t i;
-  uint16_t temp1, temp2;
-  uint16_t *pdwVal;
-  pdwVal = (uint16_t *)(wPMABufAddr + (uint32_t)USBx + 0x400);
-  
-  for (i = n; i != 0; i--)
+  uint32_t n = wNBytes >> 1;
+  uint32_t temp;
+  uint32_t *pSrc32;
+  uint16_t *pSrc16;
+  __IO uint16_t *pdwVal; /* volatile, so that the compiler cannot merge halfword stores into word stores the PMA does not support */
+  pdwVal = (__IO uint16_t *)(wPMABufAddr + (uint32_t)USBx + 0x400);
+
+  if (0 == ((uint32_t)pbUsrBuf & 3))
+  {
+    /* word aligned source: each word load feeds two halfword stores, unrolled four words at a time */
+    pSrc32 = (uint32_t *)pbUsrBuf;
+    for (; n >= 8; n -= 8)
+    {
+      temp = pSrc32[0]; pdwVal[0] = (uint16_t)temp; pdwVal[1] = (uint16_t)(temp >> 16);
+      temp = pSrc32[1]; pdwVal[2] = (uint16_t)temp; pdwVal[3] = (uint16_t)(temp >> 16);
+      temp = pSrc32[2]; pdwVal[4] = (uint16_t)temp; pdwVal[5] = (uint16_t)(temp >> 16);
+      temp = pSrc32[3]; pdwVal[6] = (uint16_t)temp; pdwVal[7] = (uint16_t)(temp >> 16);
+      pSrc32 += 4;
+      pdwVal += 8;
+    }
+    for (; n >= 2; n -= 2)
+    {
+      temp = *pSrc32++;
+      *pdwVal++ = (uint16_t)temp;
+      *pdwVal++ = (uint16_t)(temp >> 16);
+    }
+    pbUsrBuf = (uint8_t *)pSrc32;
+  }
+  else if (0 == ((uint32_t)pbUsrBuf & 1))
+  {
+    /* halfword aligned source */
+    pSrc16 = (uint16_t *)pbUsrBuf;
+    for (; n != 0; n--)
+    {
+      *pdwVal++ = *pSrc16++;
+    }
+    pbUsrBuf = (uint8_t *)pSrc16;
+  }
+
+  /* unaligned source (or what little the word loop left): assemble halfwords from byte loads */
+  for (; n != 0; n--)
   {
-    temp1 = (uint16_t) * pbUsrBuf;
-    pbUsrBuf++;
-    temp2 = temp1 | (uint16_t) * pbUsrBuf << 8;
-    *pdwVal++ = temp2;
-    pbUsrBuf++;
+    *pdwVal++ = (uint16_t)(pbUsrBuf[0] | (pbUsrBuf[1] << 8));
+    pbUsrBuf += 2;
+  }
+
+  /* odd-length tail */
+  if (wNBytes & 1)
+  {
+    *pdwVal = *pbUsrBuf;
   }
 }
 
@@ -1296,14 +1736,57 @@ void PCD_WritePMA(USB_TypeDef  *USBx, uint8_t *pbUsrBuf, uint16_t wPMABufAddr, u
   */
 void PCD_ReadPMA(USB_TypeDef  *USBx, uint8_t *pbUsrBuf, uint16_t wPMABufAddr, uint16_t wNBytes)
 {
-  uint32_t n = (wNBytes + 1) >> 1;
-  uint32_t i;
-  uint16_t *pdwVal;
-  pdwVal = (uint16_t *)(wPMABufAddr + (uint32_t)USBx + 0x400);
-  for (i = n; i != 0; i--)
+  uint32_t n = wNBytes >> 1;
+  uint32_t temp;
+  uint32_t *pDst32;
+  uint16_t *pDst16;
+  __IO uint16_t *pdwVal; /* volatile, so that the compiler cannot merge halfword loads into word loads the PMA does not support */
+  pdwVal = (__IO uint16_t *)(wPMABufAddr + (uint32_t)USBx + 0x400);
+
+  if (0 == ((uint32_t)pbUsrBuf & 3))
+  {
+    /* word aligned destination: two halfword loads make each word store, unrolled four words at a time */
+    pDst32 = (uint32_t *)pbUsrBuf;
+    for (; n >= 8; n -= 8)
+    {
+      pDst32[0] = pdwVal[0] | ((uint32_t)pdwVal[1] << 16);
+      pDst32[1] = pdwVal[2] | ((uint32_t)pdwVal[3] << 16);
+      pDst32[2] = pdwVal[4] | ((uint32_t)pdwVal[5] << 16);
+      pDst32[3] = pdwVal[6] | ((uint32_t)pdwVal[7] << 16);
+      pDst32 += 4;
+      pdwVal += 8;
+    }
+    for (; n >= 2; n -= 2)
+    {
+      temp = *pdwVal++;
+      *pDst32++ = temp | ((uint32_t)*pdwVal++ << 16);
+    }
+    pbUsrBuf = (uint8_t *)pDst32;
+  }
+  else if (0 == ((uint32_t)pbUsrBuf & 1))
+  {
+    /* halfword aligned destination */
+    pDst16 = (uint16_t *)pbUsrBuf;
+    for (; n != 0; n--)
+    {
+      *pDst16++ = *pdwVal++;
+    }
+    pbUsrBuf = (uint8_t *)pDst16;
+  }
+
+  /* unaligned destination (or what little the word loop left): split halfwords into byte stores */
+  for (; n != 0; n--)
+  {
+    temp = *pdwVal++;
+    pbUsrBuf[0] = (uint8_t)temp;
+    pbUsrBuf[1] = (uint8_t)(temp >> 8);
+    pbUsrBuf += 2;
+  }
+
+  /* odd-length tail; unlike the original, this writes no further than wNBytes into the user buffer */
+  if (wNBytes & 1)
   {
-    *(uint16_t*)pbUsrBuf++ = *pdwVal++;
-    pbUsrBuf++;
+    *pbUsrBuf = (uint8_t)*pdwVal;
   }
 }
 /**
@@ -144,6 +144,21 @@ typedef struct
   
   uint8_t   doublebuffer;    /*!< Double buffer enable
                                  This parameter can be 0 or 1                                             */    
+
+  __IO uint8_t xfer_armed;   /*!< Double buffer OUT: a reception has been requested by the upper layer     
+                                 Double buffer IN: a transmission is under way and not yet completed      */
+
+  __IO uint8_t dbuf_pending; /*!< Double buffer OUT: a received packet is waiting in PMA to be claimed     */
+
+  __IO uint8_t dbuf_inflight; /*!< Double buffer IN: a bank has been handed to the peripheral and not yet sent */
+
+  __IO uint8_t dbuf_staged;  /*!< Double buffer IN: the other bank holds the next packet, not yet handed over  */
+
+  uint8_t   *dma_buff;       /*!< PMA DMA: RAM end of the copy queued for this endpoint                    */
+
+  uint16_t  dma_pmaaddr;     /*!< PMA DMA: PMA end of the copy queued for this endpoint                    */
+
+  __IO uint16_t dma_count;   /*!< PMA DMA: size of the copy queued for this endpoint (0 if there is none)  */
                                 
   uint32_t  maxpacket;      /*!< Endpoint Max packet size
                                  This parameter must be a number between Min_Data = 0 and Max_Data = 64KB */
@@ -172,6 +187,9 @@ typedef struct
   HAL_LockTypeDef         Lock;       /*!< PCD peripheral status              */
   __IO PCD_StateTypeDef   State;      /*!< PCD communication state            */
   uint32_t                Setup[12];  /*!< Setup packet buffer                */
+  __IO uint32_t           dbuf_deferred; /*!< Double buffer OUT endpoints with a packet to deliver from the ISR */
+  __IO uint32_t           dma_queue;  /*!< PMA DMA: copies waiting for the channel      */
+  __IO uint8_t            dma_active; /*!< PMA DMA: copy the channel is doing (0 if idle) */
   void                    *pData;      /*!< Pointer to upper stack Handler     */    
   
 } PCD_HandleTypeDef;
@@ -707,6 +725,7 @@ void HAL_PCD_MspDeInit(PCD_HandleTypeDef *hpcd);
 HAL_StatusTypeDef HAL_PCD_Start(PCD_HandleTypeDef *hpcd);
 HAL_StatusTypeDef HAL_PCD_Stop(PCD_HandleTypeDef *hpcd);
 void HAL_PCD_IRQHandler(PCD_HandleTypeDef *hpcd);
+void HAL_PCD_DMA_IRQHandler(PCD_HandleTypeDef *hpcd);
 
 void HAL_PCD_DataOutStageCallback(PCD_HandleTypeDef *hpcd, uint8_t epnum);
 void HAL_PCD_DataInStageCallback(PCD_HandleTypeDef *hpcd, uint8_t epnum);
@@ -741,6 +760,10 @@ HAL_StatusTypeDef HAL_PCD_EP_ClrStall(PCD_HandleTypeDef *hpcd, uint8_t ep_addr);
 HAL_StatusTypeDef HAL_PCD_EP_Flush(PCD_HandleTypeDef *hpcd, uint8_t ep_addr);
 HAL_StatusTypeDef HAL_PCD_ActiveRemoteWakeup(PCD_HandleTypeDef *hpcd);
 HAL_StatusTypeDef HAL_PCD_DeActiveRemoteWakeup(PCD_HandleTypeDef *hpcd);
+
+/* PMA copies, also used by usbd_bulk.c */
+void PCD_WritePMA(USB_TypeDef  *USBx, uint8_t *pbUsrBuf, uint16_t wPMABufAddr, uint16_t wNBytes);
+void PCD_ReadPMA(USB_TypeDef  *USBx, uint8_t *pbUsrBuf, uint16_t wPMABufAddr, uint16_t wNBytes);
 /**
   * @}
   */
@@ -1571,9 +1571,12 @@ static void UART_DMATxHalfCplt(DMA_HandleTypeDef *hdma)
   */
 static void UART_DMAReceiveCplt(DMA_HandleTypeDef *hdma)  
 {
-  /* MODIFIED: if we are in circular mode, executing the stuff below would be counterproductive */
+  /* MODIFIED: if we are in circular mode, executing the stuff below would be counterproductive; just report the wrap */
   if (hdma->Instance->CCR & DMA_CCR_CIRC)
+  {
+    HAL_UART_RxCpltCallback((UART_HandleTypeDef *)hdma->Parent);
     return;
+  }
 
   UART_HandleTypeDef* huart = ( UART_HandleTypeDef* )((DMA_HandleTypeDef* )hdma)->Parent;
   huart->RxXferCount = 0;
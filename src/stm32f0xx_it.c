@@ -29,7 +29,9 @@
 
 /* Includes ------------------------------------------------------------------*/
 #include "usbd_core.h"
+#include "usbd_cdc.h"
 #include "stm32f0xx_it.h"
+#include "isrprofile.h"
 
 /* Private typedef -----------------------------------------------------------*/
 /* Private define ------------------------------------------------------------*/
@@ -85,6 +87,7 @@ void SVC_Handler(void)
   */
 void PendSV_Handler(void)
 {
+  USBD_CDC_Service();
 }
 
 /**
@@ -111,7 +114,23 @@ void SysTick_Handler(void)
   */
 void USB_IRQHandler(void)
 {
+  ISR_PROFILE_START();
   HAL_PCD_IRQHandler(&hpcd);
+  ISR_PROFILE_STOP(ISR_PROFILE_USB);
 }
 
+#if (PCD_PMA_DMA)
+/**
+  * @brief  This function handles the DMA channel that copies USB packets to and from PMA.
+  * @param  None
+  * @retval None
+  */
+void DMA1_Channel1_IRQHandler(void)
+{
+  ISR_PROFILE_START();
+  HAL_PCD_DMA_IRQHandler(&hpcd);
+  ISR_PROFILE_STOP(ISR_PROFILE_DMA_PMA);
+}
+#endif
+
 /************************ (C) COPYRIGHT STMicroelectronics *****END OF FILE****/
@@ -0,0 +1,361 @@
+/*
+    DMA-accelerated multi-UART USB CDC for STM32F072 microcontroller
+
+    Copyright (C) 2015,2016 Peter Lawrence
+
+    Permission is hereby granted, free of charge, to any person obtaining a
+    copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the
+    Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+    THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+*/
+
+/*
+HAL_PCD_EP_Transmit() and HAL_PCD_EP_Receive() take the PCD lock and rewrite the endpoint's bookkeeping on every call,
+and PCD_EP_ISR_Handler() reads the endpoint register afresh for every step of a transaction, each of which is then a
+read-modify-write of its own; with several busy ports, that per-packet cost is what limits throughput
+
+this moves the packets of the endpoints claimed with USBD_Bulk_Claim() by working on the endpoint register and BTABLE
+directly: the register's fixed fields are read once, when the endpoint is opened, so that handing a bank over, making
+the endpoint VALID again and acknowledging the interrupt are a single write that needs no read before it; writing 1 to
+a CTR bit leaves it alone, as does writing 0 to a DTOG or STAT bit, so such a write changes nothing else
+
+double buffering works as in the HAL: the endpoint stays VALID and flow control is done by which bank SW_BUF (DTOG_RX
+on an IN endpoint, DTOG_TX on an OUT endpoint) gives to firmware; the peripheral NAKs whilst DTOG equals SW_BUF, so an
+IN endpoint is handed one bank at a time, with the next packet staged in the other
+
+an endpoint register is handed over as a whole, so any other endpoint with the same number must be claimed as well
+*/
+
+#include "usbd_bulk.h"
+#include "usbd_core.h"
+
+#if (USB_BULK_FASTPATH)
+
+/* the fields of an endpoint register that are written back unchanged; none of them changes once the endpoint is open */
+#define EP_FIXED        (USB_EP_T_FIELD | USB_EP_KIND | USB_EPADDR_FIELD)
+
+/* both CTR bits, to be written as 1 where they are to be left alone */
+#define EP_CTR          (USB_EP_CTR_RX | USB_EP_CTR_TX)
+
+typedef struct
+{
+  uint8_t  *buff;          /* where the next packet is read from or written to */
+  uint16_t remaining;      /* IN: bytes still to be staged; OUT: room left in the buffer */
+  uint16_t count;          /* OUT: bytes received so far */
+  uint16_t maxpacket;
+  uint16_t pmaaddr[2];     /* bank 0 and bank 1 (both the same if single-buffered) */
+  uint16_t epr;            /* the EP_FIXED fields of the endpoint register */
+  uint8_t  doublebuffer;
+  uint8_t  bank;           /* double-buffered IN: the bank firmware writes next, as SW_BUF */
+  __IO uint8_t armed;      /* a transfer is under way */
+  __IO uint8_t staged;     /* double-buffered IN: the bank firmware has holds the next packet */
+  __IO uint8_t pending;    /* OUT: a packet arrived before a transfer was armed, and waits in PMA */
+} USBD_Bulk_EPTypeDef;
+
+static USBD_Bulk_EPTypeDef in_ep[8], out_ep[8];
+
+/* bitmasks of the claimed endpoints, by number, and of the OUT endpoints with a packet for USBD_Bulk_Deferred() */
+static uint8_t claimed_in, claimed_out;
+static __IO uint8_t deferred;
+
+static USBD_Bulk_EPTypeDef *Bulk_Endpoint(uint8_t ep_addr)
+{
+  return (ep_addr & 0x80) ? &in_ep[ep_addr & 0x7] : &out_ep[ep_addr & 0x7];
+}
+
+/*
+copy the next packet of an IN transfer into PMA; a single-buffered endpoint is made VALID for it, acknowledging the CTR
+bit given by clear, whilst a double-buffered one keeps it staged for Bulk_Give()
+*/
+static void Bulk_Stage(PCD_HandleTypeDef *hpcd, uint8_t num, uint16_t wEPVal, uint16_t clear)
+{
+  USBD_Bulk_EPTypeDef *ep = &in_ep[num];
+  uint16_t len;
+
+  len = (ep->remaining > ep->maxpacket) ? ep->maxpacket : ep->remaining;
+  PCD_WritePMA(hpcd->Instance, ep->buff, ep->pmaaddr[ep->bank], len);
+  ep->buff += len;
+  ep->remaining -= len;
+
+  if (!ep->doublebuffer)
+  {
+    PCD_SET_EP_TX_CNT(hpcd->Instance, num, len);
+    PCD_SET_ENDPOINT(hpcd->Instance, num, ep->epr | (EP_CTR & ~clear) | ((wEPVal ^ USB_EP_TX_VALID) & USB_EPTX_STAT));
+    return;
+  }
+
+  /* an IN endpoint keeps the count of bank 1 where a single-buffered one has its RX count */
+  if (ep->bank)
+    *PCD_EP_RX_CNT(hpcd->Instance, num) = len;
+  else
+    PCD_SET_EP_TX_CNT(hpcd->Instance, num, len);
+
+  ep->staged = 1;
+}
+
+/*
+hand the staged bank of a double-buffered IN endpoint to the peripheral, acknowledging the CTR bit given by clear; the
+peripheral must have sent the bank it had, as toggling SW_BUF whilst it holds one would take that back instead
+*/
+static void Bulk_Give(PCD_HandleTypeDef *hpcd, uint8_t num, uint16_t clear)
+{
+  USBD_Bulk_EPTypeDef *ep = &in_ep[num];
+
+  /* toggle SW_BUF: the staged bank goes to the peripheral, and firmware may start on the other one */
+  ep->bank ^= 1;
+  ep->staged = 0;
+  PCD_SET_ENDPOINT(hpcd->Instance, num, ep->epr | (EP_CTR & ~clear) | USB_EP_DTOG_RX);
+}
+
+static void Bulk_In(PCD_HandleTypeDef *hpcd, uint8_t num, uint16_t wEPVal)
+{
+  USBD_Bulk_EPTypeDef *ep = &in_ep[num];
+
+  if (!ep->doublebuffer)
+  {
+    /* the peripheral NAKs until the endpoint is made VALID again, so the next packet can go into the same buffer */
+    if (ep->armed && ep->remaining)
+    {
+      Bulk_Stage(hpcd, num, wEPVal, USB_EP_CTR_TX);
+      return;
+    }
+
+    PCD_SET_ENDPOINT(hpcd->Instance, num, ep->epr | USB_EP_CTR_RX);
+  }
+  else
+  {
+    /*
+    the peripheral only ever holds one bank, so CTR_TX means it has been sent: the staged bank goes next, in the write
+    that acknowledges it, and the packet after that is staged whilst it is on the wire
+    */
+    if (ep->staged)
+    {
+      Bulk_Give(hpcd, num, USB_EP_CTR_TX);
+      if (ep->armed && ep->remaining)
+        Bulk_Stage(hpcd, num, wEPVal, 0);
+      return;
+    }
+
+    PCD_SET_ENDPOINT(hpcd->Instance, num, ep->epr | USB_EP_CTR_RX);
+  }
+
+  if (ep->armed)
+  {
+    ep->armed = 0;
+    USBD_LL_DataInStage(hpcd->pData, num, ep->buff);
+  }
+}
+
+/* read the packet waiting on an OUT endpoint, and complete or continue the transfer; clear is the CTR bit to acknowledge */
+static void Bulk_Out(PCD_HandleTypeDef *hpcd, uint8_t num, uint16_t wEPVal, uint16_t clear)
+{
+  USBD_Bulk_EPTypeDef *ep = &out_ep[num];
+  uint16_t count, complete;
+
+  ep->pending = 0;
+
+  if (ep->doublebuffer)
+  {
+    /*
+    toggle SW_BUF before the copy: the bank drained last time goes back to the peripheral, which can fill it whilst
+    this one is being read; the bank now owned by firmware is the one SW_BUF did not point at
+    */
+    PCD_SET_ENDPOINT(hpcd->Instance, num, ep->epr | (EP_CTR & ~clear) | USB_EP_DTOG_TX);
+
+    if (wEPVal & USB_EP_DTOG_TX)
+    {
+      count = PCD_GET_EP_TX_CNT(hpcd->Instance, num);
+      PCD_ReadPMA(hpcd->Instance, ep->buff, ep->pmaaddr[0], count);
+    }
+    else
+    {
+      count = PCD_GET_EP_RX_CNT(hpcd->Instance, num);
+      PCD_ReadPMA(hpcd->Instance, ep->buff, ep->pmaaddr[1], count);
+    }
+  }
+  else
+  {
+    count = PCD_GET_EP_RX_CNT(hpcd->Instance, num);
+    PCD_ReadPMA(hpcd->Instance, ep->buff, ep->pmaaddr[0], count);
+  }
+
+  ep->buff += count;
+  ep->count += count;
+  ep->remaining -= count;
+
+  /* a short packet ends the transfer, as does running out of room for another full one */
+  complete = (count < ep->maxpacket) || (ep->remaining < ep->maxpacket);
+
+  if (!ep->doublebuffer && (clear || !complete))
+  {
+    /* the buffer has been read, so the peripheral may have it back if there is more to come */
+    PCD_SET_ENDPOINT(hpcd->Instance, num, ep->epr | (EP_CTR & ~clear) | (complete ? 0 : ((wEPVal ^ USB_EP_RX_VALID) & USB_EPRX_STAT)));
+  }
+
+  if (complete)
+  {
+    ep->armed = 0;
+    USBD_LL_DataOutStage(hpcd->pData, num, ep->buff);
+  }
+}
+
+void USBD_Bulk_Claim(uint8_t ep_addr)
+{
+  if (ep_addr & 0x80)
+    claimed_in |= 1U << (ep_addr & 0x7);
+  else
+    claimed_out |= 1U << (ep_addr & 0x7);
+}
+
+uint8_t USBD_Bulk_Claimed(uint8_t ep_addr)
+{
+  return ((ep_addr & 0x80) ? claimed_in : claimed_out) & (1U << (ep_addr & 0x7));
+}
+
+void USBD_Bulk_Open(PCD_HandleTypeDef *hpcd, uint8_t ep_addr)
+{
+  USBD_Bulk_EPTypeDef *ep = Bulk_Endpoint(ep_addr);
+  PCD_EPTypeDef *pep = (ep_addr & 0x80) ? &hpcd->IN_ep[ep_addr & 0x7] : &hpcd->OUT_ep[ep_addr & 0x7];
+
+  /* HAL_PCD_EP_Open() has just set up the register and BTABLE from what HAL_PCDEx_PMAConfig() was given */
+  ep->maxpacket = pep->maxpacket;
+  ep->doublebuffer = pep->doublebuffer;
+  ep->pmaaddr[0] = pep->doublebuffer ? pep->pmaaddr0 : pep->pmaadress;
+  ep->pmaaddr[1] = pep->doublebuffer ? pep->pmaaddr1 : pep->pmaadress;
+  ep->epr = PCD_GET_ENDPOINT(hpcd->Instance, ep_addr & 0x7) & EP_FIXED;
+
+  USBD_Bulk_Close(hpcd, ep_addr);
+}
+
+void USBD_Bulk_Close(PCD_HandleTypeDef *hpcd, uint8_t ep_addr)
+{
+  USBD_Bulk_EPTypeDef *ep = Bulk_Endpoint(ep_addr);
+
+  /* the HAL clears SW_BUF on opening and closing an IN endpoint, and forgets any packet left in PMA */
+  ep->armed = 0;
+  ep->staged = 0;
+  ep->pending = 0;
+  ep->bank = 0;
+  if (!(ep_addr & 0x80))
+    deferred &= ~(1U << (ep_addr & 0x7));
+}
+
+void USBD_Bulk_Transmit(PCD_HandleTypeDef *hpcd, uint8_t ep_addr, uint8_t *pbuf, uint16_t size)
+{
+  USBD_Bulk_EPTypeDef *ep = &in_ep[ep_addr & 0x7];
+  uint8_t num = ep_addr & 0x7;
+
+  ep->buff = pbuf;
+  ep->remaining = size;
+  ep->armed = 1;
+
+  /* only a single-buffered endpoint needs the register read, to work out the write that makes it VALID */
+  if (!ep->doublebuffer)
+  {
+    Bulk_Stage(hpcd, num, PCD_GET_ENDPOINT(hpcd->Instance, num), 0);
+    return;
+  }
+
+  /* the first packet may be zero length; if there is more, the second is staged whilst the first is on the wire */
+  Bulk_Stage(hpcd, num, 0, 0);
+  Bulk_Give(hpcd, num, 0);
+  if (ep->remaining)
+    Bulk_Stage(hpcd, num, 0, 0);
+}
+
+void USBD_Bulk_Receive(PCD_HandleTypeDef *hpcd, uint8_t ep_addr, uint8_t *pbuf, uint16_t size)
+{
+  USBD_Bulk_EPTypeDef *ep = &out_ep[ep_addr & 0x7];
+  uint8_t num = ep_addr & 0x7;
+  uint16_t wEPVal;
+
+  ep->buff = pbuf;
+  ep->remaining = size;
+  ep->count = 0;
+  ep->armed = 1;
+
+  if (ep->pending)
+  {
+    /* a packet is already waiting in PMA; have the USB ISR deliver it, as the upper layer expects */
+    deferred |= 1U << num;
+    NVIC_SetPendingIRQ(USB_IRQn);
+  }
+  else if (!ep->doublebuffer)
+  {
+    /* the allocation in BTABLE is left at the full packet HAL_PCD_EP_Open() set, as the peripheral only updates the count */
+    wEPVal = PCD_GET_ENDPOINT(hpcd->Instance, num);
+    PCD_SET_ENDPOINT(hpcd->Instance, num, ep->epr | EP_CTR | ((wEPVal ^ USB_EP_RX_VALID) & USB_EPRX_STAT));
+  }
+}
+
+uint16_t USBD_Bulk_RxCount(uint8_t ep_addr)
+{
+  return out_ep[ep_addr & 0x7].count;
+}
+
+uint8_t USBD_Bulk_CTR(PCD_HandleTypeDef *hpcd, uint8_t epnum)
+{
+  USBD_Bulk_EPTypeDef *ep;
+  uint16_t wEPVal;
+
+  if (0 == ((claimed_in | claimed_out) & (1U << epnum)))
+    return 0;
+
+  wEPVal = PCD_GET_ENDPOINT(hpcd->Instance, epnum);
+
+  if (wEPVal & USB_EP_CTR_RX)
+  {
+    ep = &out_ep[epnum];
+
+    if (ep->armed)
+    {
+      Bulk_Out(hpcd, epnum, wEPVal, USB_EP_CTR_RX);
+    }
+    else
+    {
+      /* nowhere to put the packet yet: leave it in PMA (the peripheral NAKs any more) for USBD_Bulk_Receive() */
+      ep->pending = 1;
+      PCD_SET_ENDPOINT(hpcd->Instance, epnum, ep->epr | USB_EP_CTR_TX);
+    }
+  }
+
+  if (wEPVal & USB_EP_CTR_TX)
+  {
+    Bulk_In(hpcd, epnum, wEPVal);
+  }
+
+  return 1;
+}
+
+void USBD_Bulk_Deferred(PCD_HandleTypeDef *hpcd)
+{
+  USBD_Bulk_EPTypeDef *ep;
+  uint8_t epnum;
+
+  for (epnum = 1; deferred; epnum++)
+  {
+    if (0 == (deferred & (1U << epnum)))
+      continue;
+
+    deferred &= ~(1U << epnum);
+    ep = &out_ep[epnum];
+
+    if (ep->armed && ep->pending)
+      Bulk_Out(hpcd, epnum, PCD_GET_ENDPOINT(hpcd->Instance, epnum), 0);
+  }
+}
+
+#endif
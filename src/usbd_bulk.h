@@ -0,0 +1,54 @@
+/*
+    DMA-accelerated multi-UART USB CDC for STM32F072 microcontroller
+
+    Copyright (C) 2015,2016 Peter Lawrence
+
+    Permission is hereby granted, free of charge, to any person obtaining a
+    copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the
+    Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+    THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __USBD_BULK_H_
+#define __USBD_BULK_H_
+
+#include "stm32f0xx_hal.h"
+#include "config.h"
+
+/*
+register-level driver for bulk endpoints (see usbd_bulk.c)
+
+an endpoint is claimed once, before the USB stack starts; from then on, usbd_conf.c routes its USBD_LL_Transmit(),
+USBD_LL_PrepareReceive() and USBD_LL_GetRxDataSize() calls here, and PCD_EP_ISR_Handler() hands over its endpoint
+register's CTR interrupts; opening, closing and stalling it are still done by the HAL, with USBD_Bulk_Open() and
+USBD_Bulk_Close() called afterwards
+*/
+
+#if (USB_BULK_FASTPATH) && (PCD_PMA_DMA)
+#error USB_BULK_FASTPATH copies packets with the CPU, and cannot be used with PCD_PMA_DMA
+#endif
+
+void USBD_Bulk_Claim(uint8_t ep_addr);
+uint8_t USBD_Bulk_Claimed(uint8_t ep_addr);
+void USBD_Bulk_Open(PCD_HandleTypeDef *hpcd, uint8_t ep_addr);
+void USBD_Bulk_Close(PCD_HandleTypeDef *hpcd, uint8_t ep_addr);
+void USBD_Bulk_Transmit(PCD_HandleTypeDef *hpcd, uint8_t ep_addr, uint8_t *pbuf, uint16_t size);
+void USBD_Bulk_Receive(PCD_HandleTypeDef *hpcd, uint8_t ep_addr, uint8_t *pbuf, uint16_t size); /* size must be at least a full packet */
+uint16_t USBD_Bulk_RxCount(uint8_t ep_addr);
+uint8_t USBD_Bulk_CTR(PCD_HandleTypeDef *hpcd, uint8_t epnum); /* non-zero if the endpoint register was dealt with */
+void USBD_Bulk_Deferred(PCD_HandleTypeDef *hpcd);
+
+#endif  // __USBD_BULK_H_
@@ -22,10 +22,15 @@
     DEALINGS IN THE SOFTWARE.
 */
 
+#include <string.h>
+#include <stddef.h>
 #include "usbd_cdc.h"
+#include "usbd_pma.h"
 #include "usbd_desc.h"
 #include "usbd_composite.h"
 #include "config.h"
+#include "isrprofile.h"
+#include "usbd_bulk.h"
 
 /* USB handle declared in main.c */
 extern USBD_HandleTypeDef USBD_Device;
@@ -35,19 +40,44 @@ extern USBD_HandleTypeDef USBD_Device;
 static uint8_t USBD_CDC_Init (USBD_HandleTypeDef *pdev, uint8_t cfgidx);
 static uint8_t USBD_CDC_DeInit (USBD_HandleTypeDef *pdev, uint8_t cfgidx);
 static uint8_t USBD_CDC_Setup (USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req);
+static void USBD_CDC_ClearHalt (USBD_HandleTypeDef *pdev, uint8_t ep_addr);
 static uint8_t USBD_CDC_DataIn (USBD_HandleTypeDef *pdev, uint8_t epnum);
 static uint8_t USBD_CDC_DataOut (USBD_HandleTypeDef *pdev, uint8_t epnum);
 static uint8_t USBD_CDC_EP0_RxReady (USBD_HandleTypeDef *pdev);
 static uint8_t USBD_CDC_SOF (struct _USBD_HandleTypeDef *pdev);
 static void USBD_CDC_PMAConfig(PCD_HandleTypeDef *hpcd, uint32_t *pma_address);
+static void USBD_CDC_Claim (void);
 
 static USBD_StatusTypeDef USBD_CDC_ReceivePacket (USBD_HandleTypeDef *pdev, unsigned index);
 static USBD_StatusTypeDef USBD_CDC_TransmitPacket (USBD_HandleTypeDef *pdev, unsigned index, uint16_t offset, uint16_t length);
+static void USBD_CDC_TransmitInbound (USBD_HandleTypeDef *pdev, unsigned index, uint8_t force);
+static void USBD_CDC_SerialState (USBD_HandleTypeDef *pdev, unsigned index);
 
 static int8_t CDC_Itf_Control (USBD_CDC_HandleTypeDef *hcdc, uint8_t cmd, uint8_t* pbuf, uint16_t length);
+static uint8_t CDC_Vendor_Control (USBD_HandleTypeDef *pdev, USBD_CDC_HandleTypeDef *hcdc, USBD_SetupReqTypedef *req);
+static uint8_t CDC_Vendor_IsGet (uint8_t bRequest);
 static void Error_Handler (void);
+static void CDC_Build_Lookup (void);
 static void ComPort_Config (USBD_CDC_HandleTypeDef *hcdc);
+static unsigned ComPort_Index (UART_HandleTypeDef *huart);
 static void ComPort_Anneal (USBD_CDC_HandleTypeDef *hcdc);
+static void ComPort_Transmit (USBD_CDC_HandleTypeDef *hcdc);
+static void ComPort_TxStop (USBD_CDC_HandleTypeDef *hcdc);
+static void ComPort_Reconfigure (USBD_CDC_HandleTypeDef *hcdc, uint8_t action);
+static void ComPort_Settle (USBD_CDC_HandleTypeDef *hcdc, unsigned frames);
+static void ComPort_TxIRQHandler (USBD_CDC_HandleTypeDef *hcdc, uint32_t flags);
+static void ComPort_Flush (UART_HandleTypeDef *huart, uint8_t force);
+static void ComPort_Throttle (USBD_CDC_HandleTypeDef *hcdc);
+static uint32_t ComPort_Occupancy (USBD_CDC_HandleTypeDef *hcdc);
+static uint32_t ComPort_WriteIndex (USBD_CDC_HandleTypeDef *hcdc);
+static void ComPort_Loopback (USBD_CDC_HandleTypeDef *hcdc, uint8_t enable);
+static void ComPort_LoopbackCopy (USBD_CDC_HandleTypeDef *hcdc, const uint8_t *data, uint32_t length);
+static void ComPort_Error (USBD_CDC_HandleTypeDef *hcdc, uint32_t errors);
+static void ComPort_Recover (USBD_CDC_HandleTypeDef *hcdc);
+static void ComPort_IRQHandler (void);
+static unsigned ComPort_DMA_Channel (DMA_Channel_TypeDef *instance);
+static void ComPort_DMA_Register (USBD_CDC_HandleTypeDef *hcdc);
+static void ComPort_DMA_IRQHandler (unsigned first, unsigned last);
 
 /* CDC interface class callbacks structure that is used by main.c */
 const USBD_CompClassTypeDef USBD_CDC = 
@@ -61,6 +91,7 @@ const USBD_CompClassTypeDef USBD_CDC =
   .DataOut               = USBD_CDC_DataOut,
   .SOF                   = USBD_CDC_SOF,
   .PMAConfig             = USBD_CDC_PMAConfig,
+  .Claim                 = USBD_CDC_Claim,
 };
 
 /*
@@ -76,36 +107,80 @@ static const USBD_CDC_LineCodingTypeDef defaultLineCoding =
   .datatype   = 0x08    /* nb. of bits 8 */
 };
 
-/* endpoint numbers and "instance" (base register address) for each UART */
+/*
+endpoint numbers and "instance" (base register address) for each UART
+hw_flow_control enables CTS/RTS, which needs the pins to be listed for that UART in UARTconfig in stm32f0xx_hal_msp.c
+*/
 static const struct
 {
   USART_TypeDef *Instance;
-  uint8_t data_in_ep, data_out_ep, command_ep, command_itf;
+  uint8_t data_in_ep, data_out_ep, command_ep, command_itf, data_itf;
+  uint8_t hw_flow_control;
 } parameters[NUM_OF_CDC_UARTS] = 
 {
 #if (NUM_OF_CDC_UARTS > 0)
   {
     .Instance = USART1,
-    .data_in_ep  = 0x81,
-    .data_out_ep = 0x01,
-    .command_ep  = 0x82,
-    .command_itf = 0x00,
+    .data_in_ep  = CDC_DATA_IN_EP(0),
+    .data_out_ep = CDC_DATA_OUT_EP(0),
+    .command_ep  = CDC_CMD_EP(0),
+    .command_itf = CDC_CMD_ITF(0),
+    .data_itf    = CDC_DATA_ITF(0),
+    .hw_flow_control = 0, /* USART1's CTS and RTS pins are the USB pins */
   },
 #endif
 #if (NUM_OF_CDC_UARTS > 1)
   {
     .Instance = USART3,
-    .data_in_ep  = 0x83,
-    .data_out_ep = 0x03,
-    .command_ep  = 0x84,
-    .command_itf = 0x02,
+    .data_in_ep  = CDC_DATA_IN_EP(1),
+    .data_out_ep = CDC_DATA_OUT_EP(1),
+    .command_ep  = CDC_CMD_EP(1),
+    .command_itf = CDC_CMD_ITF(1),
+    .data_itf    = CDC_DATA_ITF(1),
+    .hw_flow_control = CDC_USART3_HW_FLOW_CONTROL,
+  },
+#endif
+#if (NUM_OF_CDC_UARTS > 2)
+  {
+    .Instance = USART4,
+    .data_in_ep  = CDC_DATA_IN_EP(2),
+    .data_out_ep = CDC_DATA_OUT_EP(2),
+    .command_ep  = CDC_CMD_EP(2),
+    .command_itf = CDC_CMD_ITF(2),
+    .data_itf    = CDC_DATA_ITF(2),
+    .hw_flow_control = 0,
   },
 #endif
 };
 
+/* DMA1 has seven channels, and each UART needs two (see UARTconfig in stm32f0xx_hal_msp.c) */
+#if (NUM_OF_CDC_UARTS > 3)
+#error the STM32F072 only has enough DMA channels for three UARTs
+#endif
+
 /* context for each and every UART managed by this CDC implementation */
 static USBD_CDC_HandleTypeDef context[NUM_OF_CDC_UARTS];
 
+/* 
+endpoint number (IN and OUT separately, as they can share a number) and command interface number to port index;
+CDC_NO_PORT where there is none, and filled in by CDC_Build_Lookup() at start-up so that the USB ISR needn't search parameters[]
+*/
+#define CDC_NO_PORT 0xFF
+static uint8_t port_by_in_ep[16], port_by_out_ep[16], port_by_itf[USBD_MAX_NUM_INTERFACES];
+
+/* what ComPort_Reconfigure() leaves ComPort_Settle() to do to the USART once it has finished sending */
+#define CDC_RECONFIGURE_NONE   0
+#define CDC_RECONFIGURE_INIT   1 /* initialize it afresh from LineCoding and LoopbackRequest */
+#define CDC_RECONFIGURE_DEINIT 2 /* leave it de-initialized */
+
+/* frames since USBD_CDC_Service() last ran; counted by USBD_CDC_SOF(), in case PendSV is held off for more than one */
+static volatile uint8_t sof_frames;
+
+/* DMA1 channel number (less one) to the UART RX DMA handle or TX port using it; filled in by ComPort_Config() */
+#define NUM_OF_DMA_CHANNELS 7
+static DMA_HandleTypeDef *dma_channel_table[NUM_OF_DMA_CHANNELS];
+static USBD_CDC_HandleTypeDef *dma_tx_table[NUM_OF_DMA_CHANNELS];
+
 static uint8_t USBD_CDC_Init (USBD_HandleTypeDef *pdev, uint8_t cfgidx)
 {
   USBD_CDC_HandleTypeDef *hcdc = context;
@@ -127,8 +202,15 @@ static uint8_t USBD_CDC_Init (USBD_HandleTypeDef *pdev, uint8_t cfgidx)
     hcdc->LineCoding = defaultLineCoding;
     __HAL_LINKDMA(&hcdc->UartHandle, hdmatx, hcdc->hdma_tx);
     __HAL_LINKDMA(&hcdc->UartHandle, hdmarx, hcdc->hdma_rx);
+    hcdc->OutboundReadIndex = hcdc->OutboundWriteIndex = 0; /* discard anything left over from a previous configuration */
+    hcdc->OutboundRetries = 0;
+    hcdc->InboundLatency = CDC_DEFAULT_LATENCY_TIMER;
+    hcdc->InboundWatermark = CDC_DEFAULT_WATERMARK;
+    hcdc->NotifyInProgress = 0;
+    hcdc->SerialStateEvents = hcdc->SerialStateLines = hcdc->SerialStateSent = 0;
+    hcdc->NotifyAge = CDC_SERIAL_STATE_INTERVAL; /* no need to wait before the first notification */
+    ComPort_Reconfigure(hcdc, CDC_RECONFIGURE_INIT);
     ComPort_Anneal(hcdc);
-    ComPort_Config(hcdc);
   }
 
   return USBD_OK;
@@ -150,13 +232,9 @@ static uint8_t USBD_CDC_DeInit (USBD_HandleTypeDef *pdev, uint8_t cfgidx)
     /* Close Command IN EP */
     USBD_LL_CloseEP(pdev, parameters[index].command_ep);
 
-    /* DeInitialize the UART peripheral */
+    /* DeInitialize the UART peripheral, once it has finished sending */
     if (hcdc->UartHandle.Instance)
-      if(HAL_UART_DeInit(&hcdc->UartHandle) != HAL_OK)
-      {
-        /* Initialization Error */
-        Error_Handler();
-      }
+      ComPort_Reconfigure(hcdc, CDC_RECONFIGURE_DEINIT);
   }
   
   return USBD_OK;
@@ -164,13 +242,23 @@ static uint8_t USBD_CDC_DeInit (USBD_HandleTypeDef *pdev, uint8_t cfgidx)
 
 static uint8_t USBD_CDC_Setup (USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req)
 {
-  USBD_CDC_HandleTypeDef *hcdc = context;
+  USBD_CDC_HandleTypeDef *hcdc;
   unsigned index;
+  uint8_t ret = USBD_OK;
 
-  for (index = 0; index < NUM_OF_CDC_UARTS; index++,hcdc++)
+  /* wIndex is an endpoint address here, not an interface */
+  if (USB_REQ_RECIPIENT_ENDPOINT == (req->bmRequest & USB_REQ_RECIPIENT_MASK))
   {
-    if (parameters[index].command_itf != req->wIndex)
-      continue;
+    if (USB_REQ_CLEAR_FEATURE == req->bRequest)
+      USBD_CDC_ClearHalt(pdev, LOBYTE(req->wIndex));
+    return USBD_OK;
+  }
+
+  index = (req->wIndex < USBD_MAX_NUM_INTERFACES) ? port_by_itf[req->wIndex] : CDC_NO_PORT;
+
+  if (CDC_NO_PORT != index)
+  {
+    hcdc = &context[index];
 
     switch (req->bmRequest & USB_REQ_TYPE_MASK)
     {
@@ -195,29 +283,87 @@ static uint8_t USBD_CDC_Setup (USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *r
           CDC_Itf_Control(hcdc, req->bRequest, NULL, 0);
       }
       break;
+
+    case USB_REQ_TYPE_VENDOR :
+      ret = CDC_Vendor_Control(pdev, hcdc, req);
+      break;
  
     default: 
       break;
     }
-
-    break;
   }
 
-  return USBD_OK;
+  return ret;
+}
+
+/*
+clearing a halt resets the endpoint's data toggle, and the driver abandons whatever transfer it had under way (the host
+has discarded it along with the halt), so the port's side of that transfer is resynchronized and a new one started
+*/
+static void USBD_CDC_ClearHalt (USBD_HandleTypeDef *pdev, uint8_t ep_addr)
+{
+  USBD_CDC_HandleTypeDef *hcdc;
+  unsigned index;
+
+  index = (ep_addr & 0x80) ? port_by_in_ep[ep_addr & 0x0F] : port_by_out_ep[ep_addr & 0x0F];
+
+  /* a SERIAL_STATE notification still in PMA is simply sent again */
+  if ((CDC_NO_PORT == index) || (ep_addr == parameters[index].command_ep))
+    return;
+
+  hcdc = &context[index];
+
+  if (ep_addr & 0x80)
+  {
+    hcdc->InboundTransferInProgress = 0;
+    hcdc->InboundTransferNeedsZLP = 0;
+    hcdc->InboundInFlight = 0;
+    USBD_CDC_TransmitInbound(pdev, index, 0);
+  }
+  else
+  {
+    USBD_CDC_ReceivePacket(pdev, index);
+  }
 }
 
 static uint8_t USBD_CDC_DataIn (USBD_HandleTypeDef *pdev, uint8_t epnum)
 {
-  USBD_CDC_HandleTypeDef *hcdc = context;
+  USBD_CDC_HandleTypeDef *hcdc;
   unsigned index;
 
-  for (index = 0; index < NUM_OF_CDC_UARTS; index++,hcdc++)
+  index = port_by_in_ep[epnum & 0x0F];
+
+  if (CDC_NO_PORT != index)
   {
-    if (parameters[index].data_in_ep == (epnum | 0x80))
+    hcdc = &context[index];
+
+    if ((epnum | 0x80) == parameters[index].command_ep)
     {
-      hcdc->InboundTransferInProgress = 0;
-      break;
+      /* the host has taken the last SERIAL_STATE notification */
+      hcdc->NotifyInProgress = 0;
+      return USBD_OK;
     }
+
+    hcdc->InboundTransferInProgress = 0;
+    hcdc->Stats.InPackets += hcdc->InboundInFlight ? (hcdc->InboundInFlight + USB_FS_MAX_PACKET_SIZE - 1) / USB_FS_MAX_PACKET_SIZE : 1;
+    hcdc->InboundInFlight = 0;
+
+    /* anything that arrived whilst the last transfer was on the wire can go straight away (if it is due) */
+    USBD_CDC_TransmitInbound(pdev, index, 0);
+
+    /* 
+    a transfer that ended on a full packet leaves the host waiting for more; unless more data followed on above,
+    a zero-length packet is needed to tell it that the transfer is over
+    */
+    if (!hcdc->InboundTransferInProgress && hcdc->InboundTransferNeedsZLP)
+      USBD_CDC_TransmitPacket(pdev, index, 0, 0);
+
+    /* the host has taken data, so the UART may be able to resume */
+    ComPort_Throttle(hcdc);
+
+    /* in loopback, it is room in InboundBuffer that the OUT endpoint may have been waiting on */
+    if (hcdc->Loopback && hcdc->OutboundTransferNeedsRenewal)
+      USBD_CDC_ReceivePacket(pdev, index);
   }
 
   return USBD_OK;
@@ -225,22 +371,37 @@ static uint8_t USBD_CDC_DataIn (USBD_HandleTypeDef *pdev, uint8_t epnum)
 
 static uint8_t USBD_CDC_DataOut (USBD_HandleTypeDef *pdev, uint8_t epnum)
 {      
-  USBD_CDC_HandleTypeDef *hcdc = context;
+  USBD_CDC_HandleTypeDef *hcdc;
   uint32_t RxLength;
   unsigned index;
 
-  for (index = 0; index < NUM_OF_CDC_UARTS; index++,hcdc++)
+  index = port_by_out_ep[epnum & 0x0F];
+
+  if (CDC_NO_PORT != index)
   {
-    if (parameters[index].data_out_ep == epnum)
-    {
-      /* Get the received data length */
-      RxLength = USBD_LL_GetRxDataSize (pdev, epnum);
+    hcdc = &context[index];
 
-      /* hand the data to the HAL */
-      HAL_UART_Transmit_DMA(&hcdc->UartHandle, (uint8_t *)hcdc->OutboundBuffer, RxLength);
+    /* Get the received data length */
+    RxLength = USBD_LL_GetRxDataSize (pdev, epnum);
+    hcdc->Stats.OutPackets++;
+    hcdc->Stats.TxBytes += RxLength;
 
-      break;
+    if (RxLength && hcdc->Loopback)
+    {
+      /* hand the packet back to the host by way of InboundBuffer, just as if the UART had received it */
+      ComPort_LoopbackCopy(hcdc, (uint8_t *)hcdc->OutboundBuffer[hcdc->OutboundWriteIndex % OUTBOUND_BUFFER_PACKETS], RxLength);
+      USBD_CDC_TransmitInbound(pdev, index, 0);
     }
+    else if (RxLength)
+    {
+      /* commit the slot just filled by the USB stack to the ring, and make sure the UART is draining it */
+      hcdc->OutboundLength[hcdc->OutboundWriteIndex % OUTBOUND_BUFFER_PACKETS] = RxLength;
+      hcdc->OutboundWriteIndex++;
+      ComPort_Transmit(hcdc);
+    }
+
+    /* re-arm the OUT endpoint straight away (provided there is a free slot) rather than waiting on the UART */
+    USBD_CDC_ReceivePacket(pdev, index);
   }
 
   return USBD_OK;
@@ -248,66 +409,188 @@ static uint8_t USBD_CDC_DataOut (USBD_HandleTypeDef *pdev, uint8_t epnum)
 
 static uint8_t USBD_CDC_SOF (struct _USBD_HandleTypeDef *pdev)
 {
-  uint32_t buffsize, write_index;
+  /* the per-port work is left to USBD_CDC_Service(), so that it doesn't hold up the USB ISR */
+  if (sof_frames < 0xFF)
+    sof_frames++;
+  SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+
+  return USBD_OK;
+}
+
+void USBD_CDC_Service (void)
+{
+  USBD_HandleTypeDef *pdev = &USBD_Device;
   USBD_CDC_HandleTypeDef *hcdc = context;
-  unsigned index;
+  unsigned index, frames;
+  ISR_PROFILE_START();
+
+  NVIC_DisableIRQ(USB_IRQn);
+  frames = sof_frames;
+  sof_frames = 0;
+  NVIC_EnableIRQ(USB_IRQn);
 
   for (index = 0; index < NUM_OF_CDC_UARTS; index++,hcdc++)
   {
-    write_index = INBOUND_BUFFER_SIZE - hcdc->hdma_rx.Instance->CNDTR;
+    /*
+    this runs in PendSV, which the USB ISR pre-empts and which shares its priority with the UART and DMA ISRs;
+    the USB IRQ is masked whilst each port is serviced, just as in ComPort_Flush()
+    */
+    NVIC_DisableIRQ(USB_IRQn);
 
-    /* the circular DMA should reset CNDTR when it reaches zero, but just in case it is briefly zero, we fix the value */
-    if (INBOUND_BUFFER_SIZE == write_index)
-      write_index = 0;
+    /* a change to the USART waits on it to finish sending, whether or not the device is still configured */
+    ComPort_Settle(hcdc, frames);
 
-    if(hcdc->InboundBufferReadIndex != write_index)
+    if (USBD_STATE_CONFIGURED != pdev->dev_state)
     {
-      if(hcdc->InboundBufferReadIndex > write_index)
-      {
-        /* write index has looped around, so send partial data from the write index to the end of the buffer */
-        buffsize = INBOUND_BUFFER_SIZE - hcdc->InboundBufferReadIndex;
-      }
-      else 
-      {
-        /* send all data between read index and write index */
-        buffsize = write_index - hcdc->InboundBufferReadIndex;
-      }
-
-      if(USBD_CDC_TransmitPacket(pdev, index, hcdc->InboundBufferReadIndex, buffsize) == USBD_OK)
-      {
-        hcdc->InboundBufferReadIndex += buffsize;
-        /* if we've reached the end of the buffer, loop around to the beginning */
-        if (hcdc->InboundBufferReadIndex == INBOUND_BUFFER_SIZE)
-        {
-          hcdc->InboundBufferReadIndex = 0;
-        }
-      }
+      NVIC_EnableIRQ(USB_IRQn);
+      continue;
     }
 
+    /* age any unsent data by the frames since last time; the latency timer is measured in these */
+    hcdc->InboundAge = ((hcdc->InboundAge + frames) < 0xFF) ? (hcdc->InboundAge + frames) : 0xFF;
+    hcdc->NotifyAge = ((hcdc->NotifyAge + frames) < 0xFF) ? (hcdc->NotifyAge + frames) : 0xFF;
+
+    /* the UART events in ComPort_Flush() normally get here first; this catches a trickle that never goes idle */
+    USBD_CDC_TransmitInbound(pdev, index, 0);
+
+    /* likewise, this catches the ring filling up between UART events */
+    ComPort_Throttle(hcdc);
+
+    /* tell the host about any UART errors or modem status changes since the last notification */
+    USBD_CDC_SerialState(pdev, index);
+
     if (hcdc->OutboundTransferNeedsRenewal) /* if there is a lingering request needed due to a HAL_BUSY, retry it */
       USBD_CDC_ReceivePacket(pdev, index);
+
+    /* belt-and-braces: restart the UART if it is idle but the ring still holds data */
+    ComPort_Transmit(hcdc);
+
+    NVIC_EnableIRQ(USB_IRQn);
   }
 
-  return USBD_OK;
+  ISR_PROFILE_STOP(ISR_PROFILE_SOF);
+}
+
+static void USBD_CDC_TransmitInbound(USBD_HandleTypeDef *pdev, unsigned index, uint8_t force)
+{
+  uint32_t buffsize, write_index, pending, borrow;
+  USBD_CDC_HandleTypeDef *hcdc = &context[index];
+
+  write_index = ComPort_WriteIndex(hcdc);
+
+  pending = (write_index + INBOUND_BUFFER_SIZE - hcdc->InboundBufferReadIndex) % INBOUND_BUFFER_SIZE;
+
+  if ((pending + hcdc->InboundInFlight) > hcdc->Stats.HighWater)
+    hcdc->Stats.HighWater = pending + hcdc->InboundInFlight;
+
+  if (0 == pending)
+  {
+    /* nothing waiting, so the latency timer starts afresh with the next byte */
+    hcdc->InboundAge = 0;
+    return;
+  }
+
+  /* unless told otherwise, hold data back until either the watermark or the latency timer is reached */
+  if (!force && (pending < hcdc->InboundWatermark) && (hcdc->InboundAge < hcdc->InboundLatency))
+    return;
+
+  /* the transfer in progress may be sending from the slack, so nothing can be borrowed into it until that is done */
+  if (hcdc->InboundTransferInProgress)
+  {
+    hcdc->Stats.BusyRetries++;
+    return;
+  }
+
+  if(hcdc->InboundBufferReadIndex > write_index)
+  {
+    /* write index has looped around, so send partial data from the write index to the end of the buffer */
+    buffsize = INBOUND_BUFFER_SIZE - hcdc->InboundBufferReadIndex;
+
+    /*
+    rather than end the transfer on a short packet at the wrap point, copy enough of the start of the ring into the 
+    slack after its end to complete the last packet; the transfer then carries on from there
+    */
+    borrow = (USB_FS_MAX_PACKET_SIZE - (buffsize % USB_FS_MAX_PACKET_SIZE)) % USB_FS_MAX_PACKET_SIZE;
+    if (borrow > write_index)
+      borrow = write_index;
+    memcpy((uint8_t *)hcdc->InboundBuffer + INBOUND_BUFFER_SIZE, hcdc->InboundBuffer, borrow);
+    buffsize += borrow;
+  }
+  else 
+  {
+    /* send all data between read index and write index */
+    buffsize = write_index - hcdc->InboundBufferReadIndex;
+  }
+
+  if(USBD_CDC_TransmitPacket(pdev, index, hcdc->InboundBufferReadIndex, buffsize) == USBD_OK)
+  {
+    /* a transfer that stops short at the end of the buffer leaves the remainder still waiting */
+    if (buffsize == pending)
+      hcdc->InboundAge = 0;
+    hcdc->Stats.RxBytes += buffsize;
+    hcdc->InboundBufferReadIndex += buffsize;
+    /* if we've reached (or, by way of the slack, gone past) the end of the buffer, loop around to the beginning */
+    if (hcdc->InboundBufferReadIndex >= INBOUND_BUFFER_SIZE)
+    {
+      hcdc->InboundBufferReadIndex -= INBOUND_BUFFER_SIZE;
+    }
+  }
+}
+
+static void USBD_CDC_SerialState(USBD_HandleTypeDef *pdev, unsigned index)
+{
+  USBD_CDC_HandleTypeDef *hcdc = &context[index];
+  uint8_t *notification = (uint8_t *)hcdc->NotifyBuffer;
+  uint8_t lines, state;
+
+  /* the inputs are sampled every frame, so that a ring is not missed whilst waiting to send */
+  lines = HAL_UART_MspLines(&hcdc->UartHandle);
+  if (lines & ~hcdc->SerialStateLines & CDC_SERIAL_STATE_RING)
+    hcdc->SerialStateEvents |= CDC_SERIAL_STATE_RING;
+  hcdc->SerialStateLines = lines;
+
+  /* at most one notification per interval; anything happening in the meantime is gathered into the next one */
+  if (hcdc->NotifyInProgress || (hcdc->NotifyAge < CDC_SERIAL_STATE_INTERVAL))
+    return;
+
+  state = (lines & CDC_SERIAL_STATE_LINES) | hcdc->SerialStateEvents;
+
+  if (state == hcdc->SerialStateSent)
+    return;
+
+  notification[0] = 0xA1; /* bmRequestType: class, interface, device-to-host */
+  notification[1] = CDC_SERIAL_STATE;
+  notification[2] = 0; notification[3] = 0; /* wValue */
+  notification[4] = parameters[index].command_itf; notification[5] = 0; /* wIndex */
+  notification[6] = 2; notification[7] = 0; /* wLength */
+  notification[8] = state; notification[9] = 0;
+
+  if (USBD_OK == USBD_LL_Transmit(pdev, parameters[index].command_ep, notification, CDC_SERIAL_STATE_SIZE))
+  {
+    hcdc->NotifyInProgress = 1;
+    hcdc->NotifyAge = 0;
+    /* this runs in PendSV, which the UART ISR cannot pre-empt, so it is safe to clear the events here */
+    hcdc->SerialStateEvents = 0;
+    hcdc->SerialStateSent = state & CDC_SERIAL_STATE_LINES;
+  }
 }
 
 static uint8_t USBD_CDC_EP0_RxReady (USBD_HandleTypeDef *pdev)
 { 
-  USBD_CDC_HandleTypeDef *hcdc = context;
+  USBD_CDC_HandleTypeDef *hcdc;
   unsigned index;
 
-  for (index = 0; index < NUM_OF_CDC_UARTS; index++,hcdc++)
+  index = (pdev->request.wIndex < USBD_MAX_NUM_INTERFACES) ? port_by_itf[pdev->request.wIndex] : CDC_NO_PORT;
+
+  if (CDC_NO_PORT != index)
   {
-    if (parameters[index].command_itf != pdev->request.wIndex)
-      continue;
+    hcdc = &context[index];
 
     if (hcdc->CmdOpCode != 0xFF)
     {
       CDC_Itf_Control(hcdc, hcdc->CmdOpCode, (uint8_t *)hcdc->SetupBuffer, hcdc->CmdLength);
       hcdc->CmdOpCode = 0xFF; 
     }
-
-    break;
   }
 
   return USBD_OK;
@@ -318,7 +601,10 @@ static uint8_t USBD_CDC_TransmitPacket(USBD_HandleTypeDef *pdev, unsigned index,
   USBD_StatusTypeDef outcome;
 
   if (context[index].InboundTransferInProgress)
+  {
+    context[index].Stats.BusyRetries++;
     return USBD_BUSY;
+  }
 
   /* Transmit next packet */
   outcome = USBD_LL_Transmit(pdev, parameters[index].data_in_ep, (uint8_t *)(context[index].InboundBuffer) + offset, length);
@@ -327,6 +613,8 @@ static uint8_t USBD_CDC_TransmitPacket(USBD_HandleTypeDef *pdev, unsigned index,
   {
     /* Tx Transfer in progress */
     context[index].InboundTransferInProgress = 1;
+    context[index].InboundTransferNeedsZLP = (length && (0 == (length % USB_FS_MAX_PACKET_SIZE)));
+    context[index].InboundInFlight = length;
   }
 
   return outcome;
@@ -334,11 +622,18 @@ static uint8_t USBD_CDC_TransmitPacket(USBD_HandleTypeDef *pdev, unsigned index,
 
 static uint8_t USBD_CDC_ReceivePacket(USBD_HandleTypeDef *pdev, unsigned index)
 {
-  USBD_StatusTypeDef outcome;
+  USBD_CDC_HandleTypeDef *hcdc = &context[index];
+  USBD_StatusTypeDef outcome = USBD_BUSY;
+
+  /* only arm the endpoint when the ring has a free slot; until then, the host is NAKed */
+  if ( ((hcdc->OutboundWriteIndex - hcdc->OutboundReadIndex) < OUTBOUND_BUFFER_PACKETS) &&
+       (!hcdc->Loopback || ((ComPort_Occupancy(hcdc) + CDC_DATA_OUT_MAX_PACKET_SIZE) < INBOUND_BUFFER_SIZE)) )
+    outcome = USBD_LL_PrepareReceive(pdev, parameters[index].data_out_ep, (uint8_t *)hcdc->OutboundBuffer[hcdc->OutboundWriteIndex % OUTBOUND_BUFFER_PACKETS], CDC_DATA_OUT_MAX_PACKET_SIZE);
 
-  outcome = USBD_LL_PrepareReceive(pdev, parameters[index].data_out_ep, (uint8_t *)context[index].OutboundBuffer, CDC_DATA_OUT_MAX_PACKET_SIZE);
+  if (hcdc->OutboundTransferNeedsRenewal && (USBD_OK == outcome))
+    hcdc->Stats.Renewals++;
 
-  context[index].OutboundTransferNeedsRenewal = (USBD_OK != outcome); /* set if the HAL was busy so that we know to retry it */
+  hcdc->OutboundTransferNeedsRenewal = (USBD_OK != outcome); /* set if the HAL was busy or the ring full so that we know to retry it */
 
   return outcome;
 }
@@ -373,8 +668,8 @@ static int8_t CDC_Itf_Control (USBD_CDC_HandleTypeDef *hcdc, uint8_t cmd, uint8_
     hcdc->LineCoding.paritytype = pbuf[5];
     hcdc->LineCoding.datatype   = pbuf[6];
     
-    /* Set the new configuration */
-    ComPort_Config(hcdc);
+    /* Set the new configuration, once the USART has sent what it already has */
+    ComPort_Reconfigure(hcdc, CDC_RECONFIGURE_INIT);
     break;
 
   case CDC_GET_LINE_CODING:
@@ -413,32 +708,437 @@ static int8_t CDC_Itf_Control (USBD_CDC_HandleTypeDef *hcdc, uint8_t cmd, uint8_
   return USBD_OK;
 }
 
-void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart)
+/* non-zero for the vendor requests that return data to the host */
+static uint8_t CDC_Vendor_IsGet(uint8_t bRequest)
 {
-  USBD_CDC_HandleTypeDef *hcdc = context;
-  unsigned index;
+  switch (bRequest)
+  {
+  case CDC_VENDOR_GET_LATENCY_TIMER:
+  case CDC_VENDOR_GET_WATERMARK:
+  case CDC_VENDOR_GET_STATISTICS:
+  case CDC_VENDOR_GET_LOOPBACK:
+#if (ISR_PROFILING)
+  case CDC_VENDOR_GET_ISR_PROFILE:
+#endif
+    return 1;
 
-  for (index = 0; index < NUM_OF_CDC_UARTS; index++,hcdc++)
+  default:
+    return 0;
+  }
+}
+
+static uint8_t CDC_Vendor_Control(USBD_HandleTypeDef *pdev, USBD_CDC_HandleTypeDef *hcdc, USBD_SetupReqTypedef *req)
+{
+  uint8_t *pbuf = (uint8_t *)hcdc->SetupBuffer;
+  uint16_t length = 0;
+
+  /*
+  a GET must be device-to-host, and any other request has no data stage; neither mismatch would get the data stage
+  the host expects, so it is stalled, and USBD_FAIL stops USBD_StdItfReq() completing the status stage regardless
+  */
+  if (CDC_Vendor_IsGet(req->bRequest) ? !(req->bmRequest & 0x80) : (0 != req->wLength))
   {
-    if (&hcdc->UartHandle != huart)
-      continue;
+    USBD_CtlError(pdev, req);
+    return USBD_FAIL;
+  }
+
+  /*
+  USBD_StdItfReq() completes the status stage of requests without a data stage, so out-of-range values are clamped 
+  rather than stalled
+  */
+  switch (req->bRequest)
+  {
+  case CDC_VENDOR_SET_LATENCY_TIMER:
+    hcdc->InboundLatency = (req->wValue > 0xFF) ? 0xFF : req->wValue;
+    break;
+
+  case CDC_VENDOR_GET_LATENCY_TIMER:
+    pbuf[0] = hcdc->InboundLatency;
+    length = 1;
+    break;
 
-    /* Initiate next USB packet transfer once UART completes transfer (transmitting data over Tx line) */
-    USBD_CDC_ReceivePacket(&USBD_Device, index);
+  case CDC_VENDOR_SET_WATERMARK:
+    if (0 == req->wValue)
+      hcdc->InboundWatermark = 1;
+    else
+      hcdc->InboundWatermark = (req->wValue > CDC_MAX_WATERMARK) ? CDC_MAX_WATERMARK : req->wValue;
+    break;
+
+  case CDC_VENDOR_GET_WATERMARK:
+    pbuf[0] = (uint8_t)(hcdc->InboundWatermark);
+    pbuf[1] = (uint8_t)(hcdc->InboundWatermark >> 8);
+    length = 2;
+    break;
+
+  case CDC_VENDOR_GET_STATISTICS:
+    /* the Cortex-M0 is little endian, so the struct can be sent as it is; it is copied to PMA before this returns */
+    pbuf = (uint8_t *)&hcdc->Stats;
+    length = sizeof(hcdc->Stats);
+    break;
+
+  case CDC_VENDOR_RESET_STATISTICS:
+    /* an error counted by a UART ISR that this pre-empts may survive the reset; that is close enough */
+    memset(&hcdc->Stats, 0, sizeof(hcdc->Stats));
+    break;
+
+  case CDC_VENDOR_SET_LOOPBACK:
+    ComPort_Loopback(hcdc, req->wValue ? 1 : 0);
+    break;
 
+  case CDC_VENDOR_GET_LOOPBACK:
+    pbuf[0] = hcdc->LoopbackRequest;
+    length = 1;
     break;
+
+#if (ISR_PROFILING)
+  case CDC_VENDOR_GET_ISR_PROFILE:
+    pbuf = (uint8_t *)ISR_Profile_Get(req->wValue);
+    if (!pbuf)
+    {
+      USBD_CtlError(pdev, req);
+      return USBD_FAIL;
+    }
+    length = sizeof(ISR_ProfileTypeDef);
+    break;
+
+  case CDC_VENDOR_RESET_ISR_PROFILE:
+    ISR_Profile_Reset();
+    break;
+#endif
+
+  default:
+    return USBD_OK;
   }
+
+  if (req->wLength)
+    USBD_CtlSendData(pdev, pbuf, (req->wLength < length) ? req->wLength : length);
+
+  return USBD_OK;
 }
 
-static void ComPort_Config(USBD_CDC_HandleTypeDef *hcdc)
+static void ComPort_TxIRQHandler(USBD_CDC_HandleTypeDef *hcdc, uint32_t flags)
+{
+  /* a stale flag from a transfer that ComPort_TxStop() cut short */
+  if (!hcdc->OutboundTransferInProgress)
+    return;
+
+  /*
+  this runs in the DMA ISR, which the USB ISR pre-empts;
+  the USB IRQ is masked whilst we touch the ring state that is shared with USBD_CDC_DataOut()
+  */
+  NVIC_DisableIRQ(USB_IRQn);
+
+  /*
+  the DMA has moved the last byte into TDR, so the slot can be handed back to the ring and the next one started now,
+  whilst the USART is still sending; after a transfer error (which disables the channel), the slot is sent again, but
+  only CDC_TX_RETRIES times, so that a slot that always fails cannot hold up the ring for good
+  */
+  if (flags & DMA_ISR_TEIF1)
+  {
+    hcdc->Stats.Errors[CDC_ERROR_DMA]++;
+    if (++hcdc->OutboundRetries >= CDC_TX_RETRIES)
+    {
+      hcdc->OutboundReadIndex++;
+      hcdc->OutboundRetries = 0;
+    }
+  }
+  else
+  {
+    hcdc->OutboundReadIndex++;
+    hcdc->OutboundRetries = 0;
+  }
+  hcdc->OutboundTransferInProgress = 0;
+  ComPort_Transmit(hcdc);
+
+  /* if the OUT endpoint was parked because the ring was full, there is now room to re-arm it */
+  if (hcdc->OutboundTransferNeedsRenewal)
+    USBD_CDC_ReceivePacket(&USBD_Device, hcdc - context);
+
+  NVIC_EnableIRQ(USB_IRQn);
+}
+
+void HAL_UART_RxHalfCpltCallback(UART_HandleTypeDef *huart)
+{
+  /* the circular RX DMA has filled the first half of InboundBuffer; send it whatever the latency timer says */
+  ComPort_Flush(huart, 1);
+}
+
+void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart)
+{
+  /* the circular RX DMA has filled the second half of InboundBuffer and wrapped; likewise */
+  ComPort_Flush(huart, 1);
+}
+
+static void ComPort_Flush(UART_HandleTypeDef *huart, uint8_t force)
+{
+  unsigned index;
+
+  index = ComPort_Index(huart);
+
+  if (CDC_NO_PORT != index)
+  {
+    /*
+    this runs in a UART or DMA ISR, which the USB ISR pre-empts;
+    the USB IRQ is masked whilst we start an IN transfer, just as USBD_CDC_Service() would have done a frame later
+    */
+    NVIC_DisableIRQ(USB_IRQn);
+
+    /* 
+    a forced flush means the RX DMA has just moved on into the other half of the ring; if more than half is still in 
+    use, the oldest of that data is in the half now being overwritten
+    */
+    if (force && (ComPort_Occupancy(&context[index]) > (INBOUND_BUFFER_SIZE / 2)))
+      context[index].Stats.Overflows++;
+
+    if (USBD_STATE_CONFIGURED == USBD_Device.dev_state)
+      USBD_CDC_TransmitInbound(&USBD_Device, index, force);
+
+    /* whatever the host is doing, stop the peer before it overruns the ring */
+    ComPort_Throttle(&context[index]);
+
+    NVIC_EnableIRQ(USB_IRQn);
+  }
+}
+
+static void ComPort_Throttle(USBD_CDC_HandleTypeDef *hcdc)
+{
+  if (UART_HWCONTROL_NONE == hcdc->UartHandle.Init.HwFlowCtl)
+    return;
+
+  HAL_UART_MspRTS(&hcdc->UartHandle, ComPort_Occupancy(hcdc) < hcdc->RtsThreshold);
+}
+
+static uint32_t ComPort_Occupancy(USBD_CDC_HandleTypeDef *hcdc)
+{
+  uint32_t write_index = ComPort_WriteIndex(hcdc);
+
+  /* data that is still being sent to the host occupies the ring just as much as data yet to be sent */
+  return (write_index + INBOUND_BUFFER_SIZE - hcdc->InboundBufferReadIndex) % INBOUND_BUFFER_SIZE + hcdc->InboundInFlight;
+}
+
+static uint32_t ComPort_WriteIndex(USBD_CDC_HandleTypeDef *hcdc)
+{
+  uint32_t write_index;
+
+  if (hcdc->Loopback)
+    return hcdc->LoopbackWriteIndex;
+
+  write_index = INBOUND_BUFFER_SIZE - hcdc->hdma_rx.Instance->CNDTR;
+
+  /* the circular DMA should reset CNDTR when it reaches zero, but just in case it is briefly zero, we fix the value */
+  if (INBOUND_BUFFER_SIZE == write_index)
+    write_index = 0;
+
+  return write_index;
+}
+
+static void ComPort_Loopback(USBD_CDC_HandleTypeDef *hcdc, uint8_t enable)
+{
+  if (enable == hcdc->LoopbackRequest)
+    return;
+
+  /* re-configure the UART with or without its receiver; whatever was waiting to go to the host is discarded */
+  hcdc->LoopbackRequest = enable;
+  ComPort_Reconfigure(hcdc, CDC_RECONFIGURE_INIT);
+}
+
+static void ComPort_LoopbackCopy(USBD_CDC_HandleTypeDef *hcdc, const uint8_t *data, uint32_t length)
+{
+  uint32_t first = INBOUND_BUFFER_SIZE - hcdc->LoopbackWriteIndex;
+
+  /* USBD_CDC_ReceivePacket() only armed the endpoint if there was room for a whole packet, so this cannot overflow */
+  if (first > length)
+    first = length;
+
+  memcpy((uint8_t *)hcdc->InboundBuffer + hcdc->LoopbackWriteIndex, data, first);
+  memcpy(hcdc->InboundBuffer, data + first, length - first);
+
+  hcdc->LoopbackWriteIndex = (hcdc->LoopbackWriteIndex + length) % INBOUND_BUFFER_SIZE;
+}
+
+static void ComPort_Error(USBD_CDC_HandleTypeDef *hcdc, uint32_t errors)
+{
+  uint32_t write_index;
+  uint8_t events = 0;
+
+  if (errors & UART_FLAG_PE)
+  {
+    events |= CDC_SERIAL_STATE_PARITY;
+    hcdc->Stats.Errors[CDC_ERROR_PARITY]++;
+  }
+  if (errors & UART_FLAG_NE)
+    hcdc->Stats.Errors[CDC_ERROR_NOISE]++; /* the data is still good, but the host has no way of being told anyway */
+  if (errors & UART_FLAG_ORE)
+  {
+    events |= CDC_SERIAL_STATE_OVERRUN;
+    hcdc->Stats.Errors[CDC_ERROR_OVERRUN]++;
+  }
+  if (errors & UART_FLAG_FE)
+  {
+    /* a break looks to the USART like a zero byte without a stop bit, and the DMA will already have stored the zero */
+    write_index = ComPort_WriteIndex(hcdc);
+    if (0 == ((uint8_t *)hcdc->InboundBuffer)[(write_index + INBOUND_BUFFER_SIZE - 1) % INBOUND_BUFFER_SIZE])
+    {
+      events |= CDC_SERIAL_STATE_BREAK;
+      hcdc->Stats.Errors[CDC_ERROR_BREAK]++;
+    }
+    else
+    {
+      events |= CDC_SERIAL_STATE_FRAMING;
+      hcdc->Stats.Errors[CDC_ERROR_FRAMING]++;
+    }
+  }
+
+  /*
+  the events are cleared by USBD_CDC_SerialState() in PendSV, which shares this UART ISR's priority, so neither can
+  pre-empt the other and no masking is needed; USBD_CDC_Init() also zeroes them, but anything that loses is from before
+  the port was (re)configured
+  */
+  hcdc->SerialStateEvents |= events;
+
+  /* the flags have been cleared, which is normally all it takes, but make sure the DMA is still running */
+  ComPort_Recover(hcdc);
+}
+
+static void ComPort_Recover(USBD_CDC_HandleTypeDef *hcdc)
+{
+  /*
+  the USB ISR shares the ring state, so it is masked whilst that is put right; a caller may already have masked it, 
+  in which case it is left that way
+  */
+  uint32_t usb_enabled = NVIC->ISER[0] & (1UL << USB_IRQn);
+
+  NVIC_DisableIRQ(USB_IRQn);
+
+  /* the circular RX DMA should never stop; if it has, start it again from the beginning of InboundBuffer */
+  if (!hcdc->Loopback && !(hcdc->hdma_rx.Instance->CCR & DMA_CCR_EN))
+  {
+    HAL_DMA_Abort(&hcdc->hdma_rx);
+    /* the HAL only knows about the receiver, as ComPort_Transmit() drives the TX DMA itself */
+    hcdc->UartHandle.State = HAL_UART_STATE_READY;
+    HAL_UART_Receive_DMA(&hcdc->UartHandle, (uint8_t *)(hcdc->InboundBuffer), INBOUND_BUFFER_SIZE);
+
+    /* whatever was waiting to go to the host is lost; any IN transfer in progress is left to finish */
+    hcdc->InboundBufferReadIndex = 0;
+    hcdc->InboundAge = 0;
+  }
+
+  if (usb_enabled)
+    NVIC_EnableIRQ(USB_IRQn);
+}
+
+static unsigned ComPort_Index(UART_HandleTypeDef *huart)
 {
+  /* every UART handle the HAL passes back is embedded in context[], so its port index follows from its address */
+  uintptr_t offset = (uintptr_t)huart - offsetof(USBD_CDC_HandleTypeDef, UartHandle) - (uintptr_t)context;
+
+  if ( (offset % sizeof(context[0])) || (offset >= sizeof(context)) )
+    return CDC_NO_PORT;
+
+  return offset / sizeof(context[0]);
+}
+
+static void CDC_Build_Lookup(void)
+{
+  unsigned index;
+
+  memset(port_by_in_ep, CDC_NO_PORT, sizeof(port_by_in_ep));
+  memset(port_by_out_ep, CDC_NO_PORT, sizeof(port_by_out_ep));
+  memset(port_by_itf, CDC_NO_PORT, sizeof(port_by_itf));
+
+  for (index = 0; index < NUM_OF_CDC_UARTS; index++)
+  {
+    port_by_in_ep[parameters[index].data_in_ep & 0x0F] = index;
+    port_by_in_ep[parameters[index].command_ep & 0x0F] = index;
+    port_by_out_ep[parameters[index].data_out_ep & 0x0F] = index;
+    port_by_itf[parameters[index].command_itf] = index;
+  }
+}
+
+static void ComPort_Transmit(USBD_CDC_HandleTypeDef *hcdc)
+{
+  DMA_Channel_TypeDef *channel = hcdc->hdma_tx.Instance;
+  uint32_t slot;
+
+  /* the USART is left to finish sending whilst ComPort_Settle() waits to reconfigure it */
+  if (hcdc->OutboundTransferInProgress || (hcdc->OutboundReadIndex == hcdc->OutboundWriteIndex) ||
+      (CDC_RECONFIGURE_NONE != hcdc->Reconfigure))
+    return;
+
+  slot = hcdc->OutboundReadIndex % OUTBOUND_BUFFER_PACKETS;
+
+  /*
+  rather than go through HAL_UART_Transmit_DMA() for every packet, the channel is programmed directly: HAL_DMA_Init()
+  has set its direction, increments and priority, and ComPort_Config() has pointed it at TDR, so only the slot's
+  address and length change; CMAR and CNDTR can only be written whilst the channel is disabled
+  */
+  channel->CCR &= ~DMA_CCR_EN;
+  channel->CMAR = (uint32_t)hcdc->OutboundBuffer[slot];
+  channel->CNDTR = hcdc->OutboundLength[slot];
+  channel->CCR |= DMA_CCR_TCIE | DMA_CCR_TEIE | DMA_CCR_EN;
+  hcdc->OutboundTransferInProgress = 1;
+}
+
+static void ComPort_TxStop(USBD_CDC_HandleTypeDef *hcdc)
+{
+  DMA_Channel_TypeDef *channel = hcdc->hdma_tx.Instance;
+
+  channel->CCR &= ~(DMA_CCR_EN | DMA_CCR_TCIE | DMA_CCR_TEIE);
+  DMA1->IFCR = DMA_IFCR_CGIF1 << (4 * ComPort_DMA_Channel(channel));
+  hcdc->OutboundTransferInProgress = 0;
+}
+
+static void ComPort_Reconfigure(USBD_CDC_HandleTypeDef *hcdc, uint8_t action)
+{
+  /* a DMA transfer cut short here leaves its slot in the ring, to be sent again afterwards */
+  if (hcdc->OutboundTransferInProgress)
+    ComPort_TxStop(hcdc);
+
+  hcdc->Reconfigure = action;
+  hcdc->ReconfigureAge = 0;
+  ComPort_Settle(hcdc, 0);
+}
+
+static void ComPort_Settle(USBD_CDC_HandleTypeDef *hcdc, unsigned frames)
+{
+  uint8_t action = hcdc->Reconfigure;
+
+  if (CDC_RECONFIGURE_NONE == action)
+    return;
+
   if (hcdc->UartHandle.State != HAL_UART_STATE_RESET)
+  {
+    /*
+    the TX DMA is done once the last byte is in TDR, so up to two characters can still be going out, which
+    HAL_UART_DeInit() would cut off mid-character; rather than wait in an ISR, USBD_CDC_Service() comes back every
+    frame until the USART's TC is set, but (as CTS may be holding it off) for no longer than two 12-bit characters
+    take at the current baud rate
+    */
+    hcdc->ReconfigureAge = ((hcdc->ReconfigureAge + frames) < 0xFF) ? (hcdc->ReconfigureAge + frames) : 0xFF;
+    if (!__HAL_UART_GET_FLAG(&hcdc->UartHandle, UART_FLAG_TC) && 
+        (hcdc->ReconfigureAge <= (2 * 12 * 1000) / hcdc->UartHandle.Init.BaudRate))
+      return;
+
     if (HAL_UART_DeInit(&hcdc->UartHandle) != HAL_OK)
     {
       /* Initialization Error */
       Error_Handler();
     }
-  
+  }
+
+  hcdc->Reconfigure = CDC_RECONFIGURE_NONE;
+
+  if (CDC_RECONFIGURE_INIT == action)
+    ComPort_Config(hcdc);
+}
+
+static void ComPort_Config(USBD_CDC_HandleTypeDef *hcdc)
+{
+  uint32_t unseen;
+
+  /* ComPort_Settle() has de-initialized the USART, so it can only now change mode */
+  hcdc->Loopback = hcdc->LoopbackRequest;
+
   /* set the Stop bit */
   switch (hcdc->LineCoding.format)
   {
@@ -494,8 +1194,19 @@ static void ComPort_Config(USBD_CDC_HandleTypeDef *hcdc)
   }
   
   hcdc->UartHandle.Init.BaudRate = hcdc->LineCoding.bitrate;
-  hcdc->UartHandle.Init.HwFlowCtl  = UART_HWCONTROL_NONE;
-  hcdc->UartHandle.Init.Mode       = UART_MODE_TX_RX;
+
+  /*
+  ComPort_Throttle() runs at least every millisecond and on each RX DMA half/full event, so no more than a millisecond's 
+  worth (at 9 bits a character, the shortest there is) or half the ring arrives unseen
+  */
+  unseen = hcdc->UartHandle.Init.BaudRate / (9 * 1000) + 1;
+  if (unseen > (INBOUND_BUFFER_SIZE / 2))
+    unseen = INBOUND_BUFFER_SIZE / 2;
+  hcdc->RtsThreshold = INBOUND_BUFFER_SIZE - CDC_RTS_HEADROOM - unseen;
+
+  /* CTS is left to the USART, but RTS is driven by ComPort_Throttle() as the USART only knows about its own data register */
+  hcdc->UartHandle.Init.HwFlowCtl  = parameters[hcdc - context].hw_flow_control ? UART_HWCONTROL_CTS : UART_HWCONTROL_NONE;
+  hcdc->UartHandle.Init.Mode       = hcdc->Loopback ? UART_MODE_TX : UART_MODE_TX_RX;
   
   if(HAL_UART_Init(&hcdc->UartHandle) != HAL_OK)
   {
@@ -503,26 +1214,68 @@ static void ComPort_Config(USBD_CDC_HandleTypeDef *hcdc)
     Error_Handler();
   }
 
-  /* Start reception */
-  HAL_UART_Receive_DMA(&hcdc->UartHandle, (uint8_t *)(hcdc->InboundBuffer), INBOUND_BUFFER_SIZE);
+  /* UARTconfig in stm32f0xx_hal_msp.c has just chosen the DMA channels, so note them before any can interrupt */
+  ComPort_DMA_Register(hcdc);
+
+  /* the TX DMA channel only ever feeds TDR, and the USART's requests for it are left on */
+  hcdc->hdma_tx.Instance->CPAR = (uint32_t)&hcdc->UartHandle.Instance->TDR;
+  hcdc->UartHandle.Instance->CR3 |= USART_CR3_DMAT;
+
+  if (hcdc->Loopback)
+  {
+    /* the UART's receiver takes no part in loopback, and InboundBuffer starts off empty */
+    hcdc->LoopbackWriteIndex = hcdc->InboundBufferReadIndex;
+  }
+  else
+  {
+    /* Start reception */
+    HAL_UART_Receive_DMA(&hcdc->UartHandle, (uint8_t *)(hcdc->InboundBuffer), INBOUND_BUFFER_SIZE);
+
+    /* the DMA starts again at the beginning of InboundBuffer, so whatever was waiting to go to the host is discarded */
+    hcdc->InboundBufferReadIndex = 0;
+
+    /* an idle line marks the end of a burst, which is the moment to send it to the host */
+    __HAL_UART_ENABLE_IT(&hcdc->UartHandle, UART_IT_IDLE);
+
+    /* receive errors are passed on to the host in SERIAL_STATE notifications */
+    __HAL_UART_ENABLE_IT(&hcdc->UartHandle, UART_IT_ERR);
+    __HAL_UART_ENABLE_IT(&hcdc->UartHandle, UART_IT_PE);
+  }
+  hcdc->InboundAge = 0;
+
+  /* resume draining the outbound ring */
+  ComPort_Transmit(hcdc);
 }
 
 static void ComPort_Anneal(USBD_CDC_HandleTypeDef *hcdc)
 {
-  uint32_t current_pos = hcdc->hdma_rx.Instance->CNDTR;
-
   /* init InboundBufferReadIndex to the DMA's current position (skipping over any previously received data) */
-  hcdc->InboundBufferReadIndex = (current_pos < INBOUND_BUFFER_SIZE) ? (INBOUND_BUFFER_SIZE - current_pos) : 0;
+  hcdc->InboundBufferReadIndex = ComPort_WriteIndex(hcdc);
 
   /* the PC driver may not ACK all IN/OUT packets when closing the port, so it behooves us to re-init these */
   hcdc->InboundTransferInProgress = 0;
+  hcdc->InboundTransferNeedsZLP = 0;
+  hcdc->InboundInFlight = 0;
   hcdc->OutboundTransferNeedsRenewal = 1;
 }
 
 void HAL_UART_ErrorCallback(UART_HandleTypeDef *UartHandle)
 {
-  /* Transfer error occurred in reception and/or transmission process */
-  Error_Handler();
+  USBD_CDC_HandleTypeDef *hcdc;
+  unsigned index;
+
+  /* the HAL is only given the RX DMA (see ComPort_Transmit()), so this is a transfer error on it; only this port is affected */
+  index = ComPort_Index(UartHandle);
+
+  if (CDC_NO_PORT == index)
+    return;
+
+  hcdc = &context[index];
+  hcdc->Stats.Errors[CDC_ERROR_DMA]++;
+
+  ComPort_Recover(hcdc);
+
+  UartHandle->ErrorCode = HAL_UART_ERROR_NONE;
 }
 
 static void Error_Handler(void)
@@ -534,32 +1287,155 @@ static void USBD_CDC_PMAConfig(PCD_HandleTypeDef *hpcd, uint32_t *pma_address)
 {
   unsigned index;
 
-  /* allocate PMA memory for all endpoints associated with CDC */
+  /* allocate PMA memory for all endpoints associated with CDC, at the addresses planned in usbd_pma.h */
   for (index = 0; index < NUM_OF_CDC_UARTS; index++)
   {
-    HAL_PCDEx_PMAConfig(hpcd, parameters[index].data_in_ep,  PCD_SNG_BUF, *pma_address);
-    *pma_address += CDC_DATA_IN_MAX_PACKET_SIZE;
-    HAL_PCDEx_PMAConfig(hpcd, parameters[index].data_out_ep, PCD_SNG_BUF, *pma_address);
-    *pma_address += CDC_DATA_OUT_MAX_PACKET_SIZE;
-    HAL_PCDEx_PMAConfig(hpcd, parameters[index].command_ep,  PCD_SNG_BUF, *pma_address);
-    *pma_address += CDC_CMD_PACKET_SIZE;
+#if (CDC_IN_DOUBLE_BUFFERED)
+    /* two banks: the first address goes in the lower 16 bits, the second in the upper 16 bits */
+    HAL_PCDEx_PMAConfig(hpcd, parameters[index].data_in_ep,  PCD_DBL_BUF, PMA_CDC_DATA_IN_ADDR(index) | ((PMA_CDC_DATA_IN_ADDR(index) + USB_FS_MAX_PACKET_SIZE) << 16));
+#else
+    HAL_PCDEx_PMAConfig(hpcd, parameters[index].data_in_ep,  PCD_SNG_BUF, PMA_CDC_DATA_IN_ADDR(index));
+#endif
+#if (CDC_OUT_DOUBLE_BUFFERED)
+    HAL_PCDEx_PMAConfig(hpcd, parameters[index].data_out_ep, PCD_DBL_BUF, PMA_CDC_DATA_OUT_ADDR(index) | ((PMA_CDC_DATA_OUT_ADDR(index) + CDC_DATA_OUT_MAX_PACKET_SIZE) << 16));
+#else
+    HAL_PCDEx_PMAConfig(hpcd, parameters[index].data_out_ep, PCD_SNG_BUF, PMA_CDC_DATA_OUT_ADDR(index));
+#endif
+    HAL_PCDEx_PMAConfig(hpcd, parameters[index].command_ep,  PCD_SNG_BUF, PMA_CDC_CMD_ADDR(index));
   }
+
+  /* leave the running address past the CDC region, for the benefit of any class that follows */
+  *pma_address = PMA_END;
 }
 
-void DMA1_Channel2_3_IRQHandler(void)
+static void USBD_CDC_Claim(void)
 {
-  /* FIXME: the array index is manually coded */
-#if (NUM_OF_CDC_UARTS > 0)
-  HAL_DMA_IRQHandler(context[0].UartHandle.hdmatx);
-  HAL_DMA_IRQHandler(context[0].UartHandle.hdmarx);
+  unsigned index;
+
+  /* this runs once, as the USB stack starts up, and so before any event needs the lookup tables */
+  CDC_Build_Lookup();
+
+  for (index = 0; index < NUM_OF_CDC_UARTS; index++)
+  {
+    USBD_Composite_ClaimInterface(parameters[index].command_itf);
+    USBD_Composite_ClaimInterface(parameters[index].data_itf);
+    USBD_Composite_ClaimEndpoint(parameters[index].data_in_ep);
+    USBD_Composite_ClaimEndpoint(parameters[index].data_out_ep);
+    USBD_Composite_ClaimEndpoint(parameters[index].command_ep);
+#if (USB_BULK_FASTPATH)
+    /* the data endpoints' packets are moved by usbd_bulk.c; the notifications are few enough to leave to the HAL */
+    USBD_Bulk_Claim(parameters[index].data_in_ep);
+    USBD_Bulk_Claim(parameters[index].data_out_ep);
 #endif
+  }
+}
+
+static void ComPort_IRQHandler(void)
+{
+  USBD_CDC_HandleTypeDef *hcdc = context;
+  uint32_t errors;
+  unsigned index;
+
+  /* USART3 and USART4 share an IRQ, so rather than work out which one fired, check them all */
+  for (index = 0; index < NUM_OF_CDC_UARTS; index++,hcdc++)
+  {
+    if (HAL_UART_STATE_RESET == hcdc->UartHandle.State)
+      continue;
+
+    if (__HAL_UART_GET_IT(&hcdc->UartHandle, UART_IT_IDLE) && __HAL_UART_GET_IT_SOURCE(&hcdc->UartHandle, UART_IT_IDLE))
+    {
+      __HAL_UART_CLEAR_IT(&hcdc->UartHandle, UART_CLEAR_IDLEF);
+      ComPort_Flush(&hcdc->UartHandle, 0);
+    }
+
+    errors = hcdc->UartHandle.Instance->ISR & (UART_FLAG_PE | UART_FLAG_FE | UART_FLAG_NE | UART_FLAG_ORE);
+    if (errors)
+    {
+      __HAL_UART_CLEAR_IT(&hcdc->UartHandle, UART_CLEAR_PEF | UART_CLEAR_FEF | UART_CLEAR_NEF | UART_CLEAR_OREF);
+      ComPort_Error(hcdc, errors);
+    }
+  }
+}
+
+void USART1_IRQHandler(void)
+{
+  ISR_PROFILE_START();
+  ComPort_IRQHandler();
+  ISR_PROFILE_STOP(ISR_PROFILE_USART);
+}
+
+void USART3_4_IRQHandler(void)
+{
+  ISR_PROFILE_START();
+  ComPort_IRQHandler();
+  ISR_PROFILE_STOP(ISR_PROFILE_USART);
+}
+
+static unsigned ComPort_DMA_Channel(DMA_Channel_TypeDef *instance)
+{
+  return ((uint32_t)instance - DMA1_Channel1_BASE) / (DMA1_Channel2_BASE - DMA1_Channel1_BASE);
+}
+
+static void ComPort_DMA_Register(USBD_CDC_HandleTypeDef *hcdc)
+{
+  unsigned channel;
+
+  channel = ComPort_DMA_Channel(hcdc->hdma_tx.Instance);
+  if (channel < NUM_OF_DMA_CHANNELS)
+    dma_tx_table[channel] = hcdc;
+
+  channel = ComPort_DMA_Channel(hcdc->hdma_rx.Instance);
+  if (channel < NUM_OF_DMA_CHANNELS)
+    dma_channel_table[channel] = &hcdc->hdma_rx;
+}
+
+static void ComPort_DMA_IRQHandler(unsigned first, unsigned last)
+{
+  /*
+  each channel has four flags in DMA1->ISR; the lowest (GIF) is only cleared along with all the others, so it can be
+  left set by a channel whose flags are cleared one at a time, and the other three are looked at instead
+  */
+  uint32_t pending = DMA1->ISR >> (4 * first);
+  uint32_t flags;
+  unsigned channel;
+
+  for (channel = first; pending && (channel <= last); channel++, pending >>= 4)
+  {
+    if (!(pending & (DMA_ISR_TCIF1 | DMA_ISR_HTIF1 | DMA_ISR_TEIF1)))
+      continue;
+
+    /* the TX engines bypass HAL_DMA_IRQHandler() and its callbacks; only the circular RX channels still use the HAL */
+    if (dma_tx_table[channel])
+    {
+      /*
+      HTIF gets set (without interrupting) halfway through every packet, so only the end of the transfer counts; once it
+      has ended, nothing more can be flagged until ComPort_Transmit() starts the channel again, so every flag (HTIF and
+      GIF included) is cleared, whereas a transfer still under way is left alone in case it completes after the read
+      */
+      flags = pending & (DMA_ISR_TCIF1 | DMA_ISR_TEIF1);
+      if (flags)
+      {
+        DMA1->IFCR = DMA_IFCR_CGIF1 << (4 * channel);
+        ComPort_TxIRQHandler(dma_tx_table[channel], flags);
+      }
+    }
+    else if (dma_channel_table[channel])
+    {
+      HAL_DMA_IRQHandler(dma_channel_table[channel]);
+    }
+  }
+}
+
+void DMA1_Channel2_3_IRQHandler(void)
+{
+  ISR_PROFILE_START();
+  ComPort_DMA_IRQHandler(1, 2);
+  ISR_PROFILE_STOP(ISR_PROFILE_DMA_2_3);
 }
 
 void DMA1_Channel4_5_6_7_IRQHandler(void)
 {
-  /* FIXME: the array index is manually coded */
-#if (NUM_OF_CDC_UARTS > 1)
-  HAL_DMA_IRQHandler(context[1].UartHandle.hdmatx);
-  HAL_DMA_IRQHandler(context[1].UartHandle.hdmarx);
-#endif
+  ISR_PROFILE_START();
+  ComPort_DMA_IRQHandler(3, 6);
+  ISR_PROFILE_STOP(ISR_PROFILE_DMA_4_7);
 }
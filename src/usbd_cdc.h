@@ -32,7 +32,7 @@
 
 #define CDC_DATA_OUT_MAX_PACKET_SIZE        USB_FS_MAX_PACKET_SIZE /* don't exceed USB_FS_MAX_PACKET_SIZE; Linux data loss happens otherwise */
 #define CDC_DATA_IN_MAX_PACKET_SIZE         256
-#define CDC_CMD_PACKET_SIZE                 8 /* this may need to be enlarged for advanced CDC commands */
+#define CDC_CMD_PACKET_SIZE                 16 /* large enough for a SERIAL_STATE notification in one packet */
 
 /*
 INBOUND_BUFFER_SIZE should be 2x or more (bigger is better) of CDC_DATA_IN_MAX_PACKET_SIZE to ensure 
@@ -40,6 +40,103 @@ adequate time for the service routine to copy the data to the relevant USB IN en
 */
 #define INBOUND_BUFFER_SIZE                 (4*CDC_DATA_IN_MAX_PACKET_SIZE)
 
+/*
+the RX DMA only ever writes the first INBOUND_BUFFER_SIZE bytes of InboundBuffer; the packet-sized slack after that is 
+where the start of the ring is copied so that a transfer can run on past the wrap point to a packet boundary
+*/
+#define INBOUND_BUFFER_SLACK                USB_FS_MAX_PACKET_SIZE
+
+/*
+OUTBOUND_BUFFER_PACKETS is the number of CDC_DATA_OUT_MAX_PACKET_SIZE slots in the USB-to-UART ring;
+the OUT endpoint is re-armed into the next free slot as soon as a packet arrives, so the host is only NAKed once every slot
+is waiting on the UART.  It must be a power of two, as the free-running ring indices are reduced with a modulo.
+*/
+#define OUTBOUND_BUFFER_PACKETS             8
+
+#if (OUTBOUND_BUFFER_PACKETS & (OUTBOUND_BUFFER_PACKETS - 1))
+#error OUTBOUND_BUFFER_PACKETS must be a power of two
+#endif
+
+/*
+interface and endpoint numbering for each CDC UART; both usbd_desc.c and the parameters array in usbd_cdc.c are derived from these
+a double-buffered endpoint monopolizes its endpoint register, so the data IN and OUT endpoints must then be numbered separately
+*/
+#define CDC_CMD_ITF(port)                   (2 * (port))
+#define CDC_DATA_ITF(port)                  (2 * (port) + 1)
+#if (CDC_OUT_DOUBLE_BUFFERED || CDC_IN_DOUBLE_BUFFERED)
+#define CDC_DATA_OUT_EP(port)               (3 * (port) + 1)
+#define CDC_DATA_IN_EP(port)                (0x80 | (3 * (port) + 2))
+#define CDC_CMD_EP(port)                    (0x80 | (3 * (port) + 3))
+#else
+#define CDC_DATA_OUT_EP(port)               (2 * (port) + 1)
+#define CDC_DATA_IN_EP(port)                (0x80 | (2 * (port) + 1))
+#define CDC_CMD_EP(port)                    (0x80 | (2 * (port) + 2))
+#endif
+
+/* the USB peripheral has eight endpoint registers, one of which is taken by EP0 */
+#if ((CDC_CMD_EP(NUM_OF_CDC_UARTS - 1) & 0x7F) > 7)
+#error NUM_OF_CDC_UARTS needs more endpoints than the USB peripheral has; reduce it or disable double buffering
+#endif
+
+/*
+IN scheduling defaults; a latency timer of zero sends received data as soon as possible (at the end of each burst),
+whilst a non-zero value holds data back for up to that many milliseconds unless the watermark is reached first
+*/
+#define CDC_DEFAULT_LATENCY_TIMER           0
+#define CDC_DEFAULT_WATERMARK               CDC_DATA_IN_MAX_PACKET_SIZE
+#define CDC_MAX_WATERMARK                   (INBOUND_BUFFER_SIZE / 2) /* RX DMA half/full events always send regardless */
+
+/*
+with hardware flow control, RTS is withdrawn whilst the free space in InboundBuffer is no more than what can arrive 
+before it is next looked at (see ComPort_Config) plus this many bytes, which covers the peer's reaction time
+*/
+#define CDC_RTS_HEADROOM                    16
+
+/* a UART TX DMA transfer error has the slot sent again; after this many errors in a row, the slot is dropped instead */
+#define CDC_TX_RETRIES                      3
+
+/*
+listing vendor-specific requests handled by switch statement in usbd_cdc.c
+these are directed at the interface (bmRequestType 0x41 or 0xC1) with wIndex set to the port's command interface
+*/
+#define CDC_VENDOR_SET_LATENCY_TIMER        0x01 /* wValue = milliseconds (0 to 255) */
+#define CDC_VENDOR_GET_LATENCY_TIMER        0x02 /* returns one byte */
+#define CDC_VENDOR_SET_WATERMARK            0x03 /* wValue = bytes (1 to CDC_MAX_WATERMARK) */
+#define CDC_VENDOR_GET_WATERMARK            0x04 /* returns two bytes, little endian */
+#define CDC_VENDOR_GET_STATISTICS           0x05 /* returns USBD_CDC_StatsTypeDef, as 32-bit little endian values */
+#define CDC_VENDOR_RESET_STATISTICS         0x06 /* zeroes the statistics */
+#define CDC_VENDOR_GET_ISR_PROFILE          0x07 /* wValue = ISR_PROFILE_*; returns ISR_ProfileTypeDef (only if ISR_PROFILING) */
+#define CDC_VENDOR_RESET_ISR_PROFILE        0x08 /* zeroes all the ISR profiles (only if ISR_PROFILING) */
+#define CDC_VENDOR_SET_LOOPBACK             0x09 /* wValue = 1 to send data from the host straight back, bypassing the UART */
+#define CDC_VENDOR_GET_LOOPBACK             0x0A /* returns one byte */
+
+/*
+SERIAL_STATE notification, sent on the command endpoint; events arriving within CDC_SERIAL_STATE_INTERVAL frames of 
+the last notification are gathered into the next one
+*/
+#define CDC_SERIAL_STATE                    0x20
+#define CDC_SERIAL_STATE_SIZE               10 /* 8 byte header followed by the 16-bit UART state bitmap */
+#define CDC_SERIAL_STATE_INTERVAL           16 /* frames; matches the command endpoint's bInterval */
+
+/* UART state bitmap; DCD and DSR are reported as levels, whilst the others are events reported once each */
+#define CDC_SERIAL_STATE_DCD                0x01 /* bRxCarrier */
+#define CDC_SERIAL_STATE_DSR                0x02 /* bTxCarrier */
+#define CDC_SERIAL_STATE_BREAK              0x04
+#define CDC_SERIAL_STATE_RING               0x08
+#define CDC_SERIAL_STATE_FRAMING            0x10
+#define CDC_SERIAL_STATE_PARITY             0x20
+#define CDC_SERIAL_STATE_OVERRUN            0x40
+#define CDC_SERIAL_STATE_LINES              (CDC_SERIAL_STATE_DCD | CDC_SERIAL_STATE_DSR)
+
+/* indices into Errors[] in USBD_CDC_StatsTypeDef, one for each class of error that a port recovers from */
+#define CDC_ERROR_PARITY                    0
+#define CDC_ERROR_FRAMING                   1
+#define CDC_ERROR_NOISE                     2
+#define CDC_ERROR_OVERRUN                   3
+#define CDC_ERROR_BREAK                     4
+#define CDC_ERROR_DMA                       5 /* a DMA transfer error */
+#define CDC_NUM_OF_ERRORS                   6
+
 /* listing CDC commands handled by switch statement in usbd_cdc.c */
 #define CDC_SEND_ENCAPSULATED_COMMAND       0x00
 #define CDC_GET_ENCAPSULATED_RESPONSE       0x01
@@ -60,6 +157,20 @@ typedef struct
   uint8_t  datatype;
 } USBD_CDC_LineCodingTypeDef;
 
+/* struct type used to keep statistics for each CDC UART; this is also the layout returned by CDC_VENDOR_GET_STATISTICS */
+typedef struct
+{
+  uint32_t RxBytes;     /* bytes received by the UART and sent on to the host */
+  uint32_t TxBytes;     /* bytes received from the host for the UART to transmit */
+  uint32_t InPackets;   /* bulk IN packets sent to the host, including zero-length ones */
+  uint32_t OutPackets;  /* bulk OUT packets received from the host */
+  uint32_t HighWater;   /* most of InboundBuffer seen in use at once */
+  uint32_t Overflows;   /* times the RX DMA was found to be overwriting data not yet sent to the host */
+  uint32_t BusyRetries; /* IN transfers put off because the previous one was still in progress */
+  uint32_t Renewals;    /* OUT transfers armed late, having been held back by a full ring or a busy HAL */
+  uint32_t Errors[CDC_NUM_OF_ERRORS];
+} USBD_CDC_StatsTypeDef;
+
 /* struct type used for each instance of a CDC UART */
 typedef struct
 {
@@ -68,13 +179,36 @@ typedef struct
   word alignment is relevant for DMA, so this practice was used (albeit in a more consistent manner) in this struct
   */
   uint32_t                   SetupBuffer[(CDC_CMD_PACKET_SIZE)/sizeof(uint32_t)];
-  uint32_t                   OutboundBuffer[(CDC_DATA_OUT_MAX_PACKET_SIZE)/sizeof(uint32_t)];
-  uint32_t                   InboundBuffer[(INBOUND_BUFFER_SIZE)/sizeof(uint32_t)];
+  uint32_t                   OutboundBuffer[OUTBOUND_BUFFER_PACKETS][(CDC_DATA_OUT_MAX_PACKET_SIZE)/sizeof(uint32_t)];
+  uint32_t                   InboundBuffer[(INBOUND_BUFFER_SIZE + INBOUND_BUFFER_SLACK)/sizeof(uint32_t)];
+  uint32_t                   NotifyBuffer[(CDC_SERIAL_STATE_SIZE + sizeof(uint32_t) - 1)/sizeof(uint32_t)];
+  uint16_t                   OutboundLength[OUTBOUND_BUFFER_PACKETS];
   uint8_t                    CmdOpCode;
   uint8_t                    CmdLength;
   uint32_t                   InboundBufferReadIndex;
+  uint32_t                   LoopbackWriteIndex; /* in loopback, takes the place of the RX DMA's position in InboundBuffer */
+  uint8_t                    Loopback;
+  uint8_t                    LoopbackRequest;   /* Loopback as last set by the host, in effect once the USART is reconfigured */
+  uint8_t                    Reconfigure;       /* CDC_RECONFIGURE_* change waiting on the USART to finish sending */
+  uint8_t                    ReconfigureAge;    /* frames it has been waiting */
+  uint16_t                   InboundWatermark;  /* bytes that are sent without waiting for the latency timer */
+  uint8_t                    InboundLatency;    /* milliseconds that received data may be held back */
+  uint8_t                    InboundAge;        /* frames that the oldest unsent data has been waiting */
+  uint16_t                   RtsThreshold;      /* bytes of InboundBuffer in use at which RTS is withdrawn */
   volatile uint32_t          InboundTransferInProgress;
+  uint32_t                   InboundTransferNeedsZLP; /* the last transfer ended on a full packet */
+  uint32_t                   InboundInFlight;   /* bytes of InboundBuffer still being sent by the IN transfer in progress */
   volatile uint32_t          OutboundTransferNeedsRenewal;
+  volatile uint32_t          NotifyInProgress;
+  volatile uint8_t           SerialStateEvents; /* CDC_SERIAL_STATE_* events not yet sent to the host */
+  uint8_t                    SerialStateLines;  /* DCD, DSR and RI as last seen */
+  uint8_t                    SerialStateSent;   /* DCD and DSR as last sent to the host */
+  uint8_t                    NotifyAge;         /* frames since the last notification */
+  USBD_CDC_StatsTypeDef      Stats; /* running totals since power-up or the last CDC_VENDOR_RESET_STATISTICS */
+  volatile uint32_t          OutboundTransferInProgress;
+  volatile uint32_t          OutboundWriteIndex; /* free-running count of packets received from USB */
+  volatile uint32_t          OutboundReadIndex;  /* free-running count of packets handed back by the UART */
+  uint8_t                    OutboundRetries;    /* TX DMA transfer errors in a row on the slot being sent */
   UART_HandleTypeDef         UartHandle;
   USBD_CDC_LineCodingTypeDef LineCoding;
   DMA_HandleTypeDef          hdma_tx;
@@ -83,4 +217,12 @@ typedef struct
 
 extern const USBD_CompClassTypeDef USBD_CDC;
 
+/* the work due every frame, pended by the SOF callback; called by PendSV_Handler() */
+void USBD_CDC_Service(void);
+
+/* implemented in stm32f0xx_hal_msp.c; drives the UART's RTS pin (if it has one), ready being non-zero to assert it */
+void HAL_UART_MspRTS(UART_HandleTypeDef *huart, uint8_t ready);
+/* likewise; returns the UART's modem status inputs as CDC_SERIAL_STATE_DCD, _DSR and _RING bits */
+uint8_t HAL_UART_MspLines(UART_HandleTypeDef *huart);
+
 #endif  // __USB_CDC_H_
@@ -73,6 +73,27 @@ static const struct composite_list_struct composite_list[] =
   { &USBD_CDC }, /* in this particular code, there is only CDC */
 };
 
+/*
+each member's Claim() callback fills in these tables at start-up, so that interface and endpoint events can be passed
+straight to the member that owns them, rather than to every member in turn; NULL means nobody has claimed it
+*/
+static const USBD_CompClassTypeDef *itf_owner[USBD_MAX_NUM_INTERFACES];
+static const USBD_CompClassTypeDef *in_ep_owner[16], *out_ep_owner[16];
+static const USBD_CompClassTypeDef *claimant;
+
+static const USBD_CompClassTypeDef *USBD_Composite_Owner (USBD_SetupReqTypedef *req)
+{
+  switch (req->bmRequest & USB_REQ_RECIPIENT_MASK)
+  {
+  case USB_REQ_RECIPIENT_INTERFACE:
+    return (LOBYTE(req->wIndex) < USBD_MAX_NUM_INTERFACES) ? itf_owner[LOBYTE(req->wIndex)] : NULL;
+  case USB_REQ_RECIPIENT_ENDPOINT:
+    return (req->wIndex & 0x80) ? in_ep_owner[req->wIndex & 0x0F] : out_ep_owner[req->wIndex & 0x0F];
+  default:
+    return NULL;
+  }
+}
+
 static uint8_t USBD_Composite_Init (USBD_HandleTypeDef *pdev, uint8_t cfgidx)
 {
   unsigned index;
@@ -101,12 +122,33 @@ static uint8_t USBD_Composite_DeInit (USBD_HandleTypeDef *pdev, uint8_t cfgidx)
 
 static uint8_t USBD_Composite_Setup (USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req)
 {
+  const USBD_CompClassTypeDef *owner;
   unsigned index;
 
-  for (index = 0; index < (sizeof(composite_list) / sizeof(*composite_list)); index++)
+  /* the only device requests passed on by ST's stack are the remote wakeup features, which concern every member */
+  if (USB_REQ_RECIPIENT_DEVICE == (req->bmRequest & USB_REQ_RECIPIENT_MASK))
+  {
+    for (index = 0; index < (sizeof(composite_list) / sizeof(*composite_list)); index++)
+    {
+      if (composite_list[index].pnt->Setup)
+        composite_list[index].pnt->Setup(pdev, req);
+    }
+
+    return USBD_OK;
+  }
+
+  owner = USBD_Composite_Owner(req);
+
+  if (owner)
+  {
+    if (owner->Setup)
+      return owner->Setup(pdev, req);
+  }
+  else if (USB_REQ_RECIPIENT_INTERFACE == (req->bmRequest & USB_REQ_RECIPIENT_MASK))
   {
-    if (composite_list[index].pnt->Setup)
-      composite_list[index].pnt->Setup(pdev, req);
+    /* nobody owns this interface, so it does not exist */
+    USBD_CtlError(pdev, req);
+    return USBD_FAIL;
   }
 
   return USBD_OK;
@@ -114,26 +156,20 @@ static uint8_t USBD_Composite_Setup (USBD_HandleTypeDef *pdev, USBD_SetupReqType
 
 static uint8_t USBD_Composite_DataIn (USBD_HandleTypeDef *pdev, uint8_t epnum)
 {
-  unsigned index;
+  const USBD_CompClassTypeDef *owner = in_ep_owner[epnum & 0x0F];
 
-  for (index = 0; index < (sizeof(composite_list) / sizeof(*composite_list)); index++)
-  {
-    if (composite_list[index].pnt->DataIn)
-      composite_list[index].pnt->DataIn(pdev, epnum);
-  }
+  if (owner && owner->DataIn)
+    owner->DataIn(pdev, epnum);
 
   return USBD_OK;
 }
 
 static uint8_t USBD_Composite_DataOut (USBD_HandleTypeDef *pdev, uint8_t epnum)
 {      
-  unsigned index;
+  const USBD_CompClassTypeDef *owner = out_ep_owner[epnum & 0x0F];
 
-  for (index = 0; index < (sizeof(composite_list) / sizeof(*composite_list)); index++)
-  {
-    if (composite_list[index].pnt->DataOut)
-      composite_list[index].pnt->DataOut(pdev, epnum);
-  }
+  if (owner && owner->DataOut)
+    owner->DataOut(pdev, epnum);
 
   return USBD_OK;
 }
@@ -153,26 +189,22 @@ static uint8_t USBD_Composite_SOF (USBD_HandleTypeDef *pdev)
 
 static uint8_t USBD_Composite_EP0_TxSent (USBD_HandleTypeDef *pdev)
 { 
-  unsigned index;
+  /* the data stage belongs to whichever member answered the SETUP that is still in pdev->request */
+  const USBD_CompClassTypeDef *owner = USBD_Composite_Owner(&pdev->request);
 
-  for (index = 0; index < (sizeof(composite_list) / sizeof(*composite_list)); index++)
-  {
-    if (composite_list[index].pnt->EP0_TxSent)
-      composite_list[index].pnt->EP0_TxSent(pdev);
-  }
+  if (owner && owner->EP0_TxSent)
+    owner->EP0_TxSent(pdev);
 
   return USBD_OK;
 }
 
 static uint8_t USBD_Composite_EP0_RxReady (USBD_HandleTypeDef *pdev)
 { 
-  unsigned index;
+  /* likewise */
+  const USBD_CompClassTypeDef *owner = USBD_Composite_Owner(&pdev->request);
 
-  for (index = 0; index < (sizeof(composite_list) / sizeof(*composite_list)); index++)
-  {
-    if (composite_list[index].pnt->EP0_RxReady)
-      composite_list[index].pnt->EP0_RxReady(pdev);
-  }
+  if (owner && owner->EP0_RxReady)
+    owner->EP0_RxReady(pdev);
 
   return USBD_OK;
 }
@@ -183,6 +215,19 @@ static const uint8_t *USBD_Composite_GetFSCfgDesc (uint16_t *length)
   return USBD_CfgFSDesc_pnt;
 }
 
+void USBD_Composite_Claim(void)
+{
+  unsigned index;
+
+  for (index = 0; index < (sizeof(composite_list) / sizeof(*composite_list)); index++)
+  {
+    claimant = composite_list[index].pnt;
+    if (claimant->Claim)
+      claimant->Claim();
+  }
+  claimant = NULL;
+}
+
 void USBD_Composite_PMAConfig(PCD_HandleTypeDef *hpcd, uint32_t *pma_address)
 {
   unsigned index;
@@ -193,3 +238,20 @@ void USBD_Composite_PMAConfig(PCD_HandleTypeDef *hpcd, uint32_t *pma_address)
       composite_list[index].pnt->PMAConfig(hpcd, pma_address);
   }
 }
+
+void USBD_Composite_ClaimInterface(uint8_t itf)
+{
+  if (claimant && (itf < USBD_MAX_NUM_INTERFACES))
+    itf_owner[itf] = claimant;
+}
+
+void USBD_Composite_ClaimEndpoint(uint8_t ep_addr)
+{
+  if (!claimant)
+    return;
+
+  if (ep_addr & 0x80)
+    in_ep_owner[ep_addr & 0x0F] = claimant;
+  else
+    out_ep_owner[ep_addr & 0x0F] = claimant;
+}
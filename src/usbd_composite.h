@@ -17,11 +17,17 @@ typedef struct
   uint8_t  (*DataOut)          (struct _USBD_HandleTypeDef *pdev , uint8_t epnum); 
   uint8_t  (*SOF)              (struct _USBD_HandleTypeDef *pdev); 
   void (*PMAConfig)            (PCD_HandleTypeDef *hpcd, uint32_t *pma_address);
+  /* declares the interfaces and endpoints the class owns, by way of USBD_Composite_ClaimInterface() and USBD_Composite_ClaimEndpoint() */
+  void (*Claim)                (void);
 } USBD_CompClassTypeDef;
 
 /* array of callback functions invoked by USBD_RegisterClass() in main.c */
 extern const USBD_ClassTypeDef USBD_Composite;
 
+/* called once from USBD_LL_Init(): the members stake their claims, and then they are given their PMA */
+void USBD_Composite_Claim(void);
 void USBD_Composite_PMAConfig(PCD_HandleTypeDef *hpcd, uint32_t *pma_address);
+void USBD_Composite_ClaimInterface(uint8_t itf);
+void USBD_Composite_ClaimEndpoint(uint8_t ep_addr);
 
 #endif  // __USB_CDC_H_
@@ -29,6 +29,8 @@
 #include "stm32f0xx_hal.h"
 #include "usbd_core.h"
 #include "usbd_composite.h"
+#include "usbd_pma.h"
+#include "usbd_bulk.h"
 
 PCD_HandleTypeDef hpcd; /* used externally by stm32f0xx_it.c */
 
@@ -67,11 +69,22 @@ void HAL_PCD_MspInit(PCD_HandleTypeDef *hpcd)
   /* Enable USB FS Clock */
   __USB_CLK_ENABLE();
   
-  /* Set USB FS Interrupt priority */
-  HAL_NVIC_SetPriority(USB_IRQn, 3 /* hard-coded: customize if needed */, 0);
+  /*
+  Set USB FS Interrupt priority; this must be above that of the UART and DMA IRQs (see HAL_UART_MspInit()), whose
+  ISRs mask the USB IRQ whilst they touch state shared with it, and above PendSV, which does the per-frame CDC work
+  */
+  HAL_NVIC_SetPriority(USB_IRQn, 2 /* hard-coded: customize if needed */, 0);
+  HAL_NVIC_SetPriority(PendSV_IRQn, 3, 0);
   
   /* Enable USB FS Interrupt */
   HAL_NVIC_EnableIRQ(USB_IRQn);
+
+#if (PCD_PMA_DMA)
+  /* the DMA channel that copies packets to and from PMA; its interrupt only has to wake up the USB ISR */
+  __DMA1_CLK_ENABLE();
+  HAL_NVIC_SetPriority(DMA1_Channel1_IRQn, 2 /* hard-coded: customize if needed */, 0);
+  HAL_NVIC_EnableIRQ(DMA1_Channel1_IRQn);
+#endif
 }
 
 /**
@@ -216,6 +229,9 @@ USBD_StatusTypeDef USBD_LL_Init(USBD_HandleTypeDef *pdev)
 {
   uint32_t pma_address;
 
+  /* the lookup tables that route interface and endpoint events are built before the peripheral can raise any */
+  USBD_Composite_Claim();
+
   /* Set LL Driver parameters */
   hpcd.Instance = USB;
   hpcd.Init.ep0_mps = 0x40;
@@ -228,17 +244,16 @@ USBD_StatusTypeDef USBD_LL_Init(USBD_HandleTypeDef *pdev)
   HAL_PCD_Init(pdev->pData);
 
   /*
-  start address for PMA allocation:
-  ST's USB stack forces a BTABLE_ADDRESS at the start of PMA memory.  The BTABLE occupied 8 bytes per endpoint.
-  we position the EP buffers starting immediately after this
+  PMA allocation follows the layout planned (and checked against the size of PMA) at build time in usbd_pma.h:
+  ST's USB stack forces a BTABLE_ADDRESS at the start of PMA memory, and the EP buffers are positioned after this
   */
-  pma_address = 8 * MAX((sizeof(hpcd.IN_ep) / sizeof(*hpcd.IN_ep)), (sizeof(hpcd.OUT_ep) / sizeof(*hpcd.OUT_ep)));
 
   /* PMA allocation for EP0 */
-  HAL_PCDEx_PMAConfig(pdev->pData, 0x00, PCD_SNG_BUF, pma_address =+ USB_MAX_EP0_SIZE);
-  HAL_PCDEx_PMAConfig(pdev->pData, 0x80, PCD_SNG_BUF, pma_address =+ USB_MAX_EP0_SIZE);
+  HAL_PCDEx_PMAConfig(pdev->pData, 0x00, PCD_SNG_BUF, PMA_EP0_OUT_ADDR);
+  HAL_PCDEx_PMAConfig(pdev->pData, 0x80, PCD_SNG_BUF, PMA_EP0_IN_ADDR);
 
   /* PMA allocation for other endpoints */
+  pma_address = PMA_CDC_BASE;
   USBD_Composite_PMAConfig(pdev->pData, &pma_address);
 
   return USBD_OK;
@@ -294,6 +309,11 @@ USBD_StatusTypeDef USBD_LL_OpenEP(USBD_HandleTypeDef *pdev,
                   ep_addr,
                   ep_mps,
                   ep_type);
+
+#if (USB_BULK_FASTPATH)
+  if (USBD_Bulk_Claimed(ep_addr))
+    USBD_Bulk_Open(pdev->pData, ep_addr);
+#endif
   
   return USBD_OK;
 }
@@ -307,6 +327,10 @@ USBD_StatusTypeDef USBD_LL_OpenEP(USBD_HandleTypeDef *pdev,
 USBD_StatusTypeDef USBD_LL_CloseEP(USBD_HandleTypeDef *pdev, uint8_t ep_addr)
 {
   HAL_PCD_EP_Close(pdev->pData, ep_addr);
+#if (USB_BULK_FASTPATH)
+  if (USBD_Bulk_Claimed(ep_addr))
+    USBD_Bulk_Close(pdev->pData, ep_addr);
+#endif
   return USBD_OK;
 }
 
@@ -343,6 +367,11 @@ USBD_StatusTypeDef USBD_LL_StallEP(USBD_HandleTypeDef *pdev, uint8_t ep_addr)
 USBD_StatusTypeDef USBD_LL_ClearStallEP(USBD_HandleTypeDef *pdev, uint8_t ep_addr)
 {
   HAL_PCD_EP_ClrStall(pdev->pData, ep_addr);
+#if (USB_BULK_FASTPATH)
+  /* the register may have been left as HAL_PCD_EP_Open() leaves it, so the fast path closes and reopens its view too */
+  if (USBD_Bulk_Claimed(ep_addr))
+    USBD_Bulk_Open(pdev->pData, ep_addr);
+#endif
   return USBD_OK; 
 }
 
@@ -392,6 +421,13 @@ USBD_StatusTypeDef USBD_LL_Transmit(USBD_HandleTypeDef *pdev,
                                     uint16_t size)
 {
   HAL_StatusTypeDef outcome;
+#if (USB_BULK_FASTPATH)
+  if (USBD_Bulk_Claimed(ep_addr))
+  {
+    USBD_Bulk_Transmit(pdev->pData, ep_addr, pbuf, size);
+    return USBD_OK;
+  }
+#endif
   outcome = HAL_PCD_EP_Transmit(pdev->pData, ep_addr, pbuf, size);
   return (HAL_OK == outcome) ? USBD_OK : USBD_BUSY;
 }
@@ -410,6 +446,13 @@ USBD_StatusTypeDef USBD_LL_PrepareReceive(USBD_HandleTypeDef *pdev,
                                           uint16_t size)
 {
   HAL_StatusTypeDef outcome;
+#if (USB_BULK_FASTPATH)
+  if (USBD_Bulk_Claimed(ep_addr))
+  {
+    USBD_Bulk_Receive(pdev->pData, ep_addr, pbuf, size);
+    return USBD_OK;
+  }
+#endif
   outcome = HAL_PCD_EP_Receive(pdev->pData, ep_addr, pbuf, size);
   return (HAL_OK == outcome) ? USBD_OK : USBD_BUSY;
 }
@@ -422,6 +465,10 @@ USBD_StatusTypeDef USBD_LL_PrepareReceive(USBD_HandleTypeDef *pdev,
   */
 uint32_t USBD_LL_GetRxDataSize(USBD_HandleTypeDef *pdev, uint8_t ep_addr)
 {
+#if (USB_BULK_FASTPATH)
+  if (USBD_Bulk_Claimed(ep_addr))
+    return USBD_Bulk_RxCount(ep_addr);
+#endif
   return HAL_PCD_EP_GetRxCount(pdev->pData, ep_addr);
 }
 
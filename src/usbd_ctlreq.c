@@ -177,7 +177,7 @@ USBD_StatusTypeDef  USBD_StdItfReq (USBD_HandleTypeDef *pdev , USBD_SetupReqType
     
     if (LOBYTE(req->wIndex) <= USBD_MAX_NUM_INTERFACES) 
     {
-      pdev->pClass->Setup (pdev, req); 
+      ret = (USBD_StatusTypeDef)pdev->pClass->Setup (pdev, req); 
       
       if((req->wLength == 0)&& (ret == USBD_OK))
       {
@@ -102,15 +102,15 @@ __ALIGN_BEGIN static const struct configuration_1 USBD_Composite_CfgFSDesc __ALI
   {
 #if (NUM_OF_CDC_UARTS > 0)
     /* CDC1 */
-    CDC_DESCRIPTOR(/* Command ITF */ 0x00, /* Data ITF */ 0x01, /* Command EP */ 0x82, /* DataOut EP */ 0x01, /* DataIn EP */ 0x81)
+    CDC_DESCRIPTOR(/* Command ITF */ CDC_CMD_ITF(0), /* Data ITF */ CDC_DATA_ITF(0), /* Command EP */ CDC_CMD_EP(0), /* DataOut EP */ CDC_DATA_OUT_EP(0), /* DataIn EP */ CDC_DATA_IN_EP(0))
 #endif
 #if (NUM_OF_CDC_UARTS > 1)
     /* CDC2 */
-    CDC_DESCRIPTOR(/* Command ITF */ 0x02, /* Data ITF */ 0x03, /* Command EP */ 0x84, /* DataOut EP */ 0x03, /* DataIn EP */ 0x83)
+    CDC_DESCRIPTOR(/* Command ITF */ CDC_CMD_ITF(1), /* Data ITF */ CDC_DATA_ITF(1), /* Command EP */ CDC_CMD_EP(1), /* DataOut EP */ CDC_DATA_OUT_EP(1), /* DataIn EP */ CDC_DATA_IN_EP(1))
 #endif
 #if (NUM_OF_CDC_UARTS > 2)
     /* CDC3 */
-    CDC_DESCRIPTOR(/* Command ITF */ 0x04, /* Data ITF */ 0x05, /* Command EP */ 0x86, /* DataOut EP */ 0x05, /* DataIn EP */ 0x85)
+    CDC_DESCRIPTOR(/* Command ITF */ CDC_CMD_ITF(2), /* Data ITF */ CDC_DATA_ITF(2), /* Command EP */ CDC_CMD_EP(2), /* DataOut EP */ CDC_DATA_OUT_EP(2), /* DataIn EP */ CDC_DATA_IN_EP(2))
 #endif
   },
 };
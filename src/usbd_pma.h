@@ -0,0 +1,82 @@
+/*
+    DMA-accelerated multi-UART USB CDC for STM32F072 microcontroller
+
+    Copyright (C) 2015,2016 Peter Lawrence
+
+    Permission is hereby granted, free of charge, to any person obtaining a 
+    copy of this software and associated documentation files (the "Software"), 
+    to deal in the Software without restriction, including without limitation 
+    the rights to use, copy, modify, merge, publish, distribute, sublicense, 
+    and/or sell copies of the Software, and to permit persons to whom the 
+    Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in 
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL 
+    THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+    DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef __USBD_PMA_H_
+#define __USBD_PMA_H_
+
+#include "usbd_def.h"
+#include "usbd_cdc.h"
+#include "config.h"
+
+/*
+PMA (USB packet memory) layout, worked out at build time from config.h
+
+  PMA_BTABLE_ADDR       BTABLE: 8 bytes for each of the 8 endpoint registers
+  PMA_EP0_OUT_ADDR      EP0 OUT
+  PMA_EP0_IN_ADDR       EP0 IN
+  PMA_CDC_BASE          per CDC UART, in port order: data IN, data OUT, command IN
+  PMA_END               first unused byte
+
+the addresses are those handed to HAL_PCDEx_PMAConfig(); a double-buffered endpoint has its two banks back to back
+*/
+
+#define PMA_SIZE                            1024 /* bytes of PMA in the STM32F072 */
+
+#define PMA_BTABLE_ADDR                     0x000
+#define PMA_BTABLE_SIZE                     (8 * 8)
+
+#define PMA_EP0_OUT_ADDR                    (PMA_BTABLE_ADDR + PMA_BTABLE_SIZE)
+#define PMA_EP0_IN_ADDR                     (PMA_EP0_OUT_ADDR + USB_MAX_EP0_SIZE)
+
+/* the data endpoints are opened with USB_FS_MAX_PACKET_SIZE packets, so no bank needs to be larger than that */
+#if (CDC_IN_DOUBLE_BUFFERED)
+#define PMA_CDC_DATA_IN_SIZE                (2 * USB_FS_MAX_PACKET_SIZE)
+#else
+#define PMA_CDC_DATA_IN_SIZE                USB_FS_MAX_PACKET_SIZE
+#endif
+#if (CDC_OUT_DOUBLE_BUFFERED)
+#define PMA_CDC_DATA_OUT_SIZE               (2 * CDC_DATA_OUT_MAX_PACKET_SIZE)
+#else
+#define PMA_CDC_DATA_OUT_SIZE               CDC_DATA_OUT_MAX_PACKET_SIZE
+#endif
+#define PMA_CDC_CMD_SIZE                    CDC_CMD_PACKET_SIZE
+#define PMA_CDC_PORT_SIZE                   (PMA_CDC_DATA_IN_SIZE + PMA_CDC_DATA_OUT_SIZE + PMA_CDC_CMD_SIZE)
+
+#define PMA_CDC_BASE                        (PMA_EP0_IN_ADDR + USB_MAX_EP0_SIZE)
+#define PMA_CDC_DATA_IN_ADDR(port)          (PMA_CDC_BASE + (port) * PMA_CDC_PORT_SIZE)
+#define PMA_CDC_DATA_OUT_ADDR(port)         (PMA_CDC_DATA_IN_ADDR(port) + PMA_CDC_DATA_IN_SIZE)
+#define PMA_CDC_CMD_ADDR(port)              (PMA_CDC_DATA_OUT_ADDR(port) + PMA_CDC_DATA_OUT_SIZE)
+
+#define PMA_END                             (PMA_CDC_BASE + NUM_OF_CDC_UARTS * PMA_CDC_PORT_SIZE)
+
+/* the peripheral addresses PMA in halfwords */
+#if (PMA_CDC_PORT_SIZE & 1) || (USB_MAX_EP0_SIZE & 1)
+#error PMA buffers must be an even number of bytes
+#endif
+
+#if (PMA_END > PMA_SIZE)
+#error the endpoints configured in config.h need more PMA than the USB peripheral has; reduce NUM_OF_CDC_UARTS or disable double buffering
+#endif
+
+#endif  // __USBD_PMA_H_